@@ -0,0 +1,102 @@
+/**
+ * Print the option values which other processes publish through shared
+ * memory segments (see cliopts_shm_create()), e.g.
+ *
+ *   ./cliopts-shm -i 1000 /dev/shm/myprog.*
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+#include "cliopts.h"
+
+static int interval = 0;
+static int count = 1;
+
+static cliopts_entry entries[] = {
+        {'i', "interval", CLIOPTS_ARGT_INT, &interval,
+                "Sample every MS milliseconds (0 to sample once)", "MS" },
+        {'c', "count", CLIOPTS_ARGT_INT, &count,
+                "Number of samples to take when sampling repeatedly", "N" },
+        { 0 }
+};
+
+static void
+sleep_ms(int ms)
+{
+#ifndef _WIN32
+    usleep((unsigned)ms * 1000);
+#else
+    Sleep(ms);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    struct cliopts_extra_settings settings = { 0 };
+    cliopts_shm_reader **readers;
+    const char **paths;
+    size_t ii, jj, npaths;
+    int round;
+
+    paths = malloc(sizeof(*paths) * argc);
+    if (!paths) {
+        return EXIT_FAILURE;
+    }
+    settings.restargs = paths;
+    settings.argstring_restargs = "SEGMENT...";
+    settings.min_restargs = 1;
+    settings.show_defaults = 1;
+    cliopts_parse_options(entries, argc, argv, NULL, &settings);
+    npaths = settings.nrestargs;
+
+    readers = calloc(npaths, sizeof(*readers));
+    if (!readers) {
+        return EXIT_FAILURE;
+    }
+    for (ii = 0; ii < npaths; ii++) {
+        char *err = NULL;
+        readers[ii] = cliopts_shm_attach(paths[ii], &err);
+        if (!readers[ii]) {
+            fprintf(stderr, "%s: %s\n", paths[ii], err);
+        }
+    }
+
+    for (round = 0; !interval || round < count; round++) {
+        if (round) {
+            sleep_ms(interval);
+        }
+        for (ii = 0; ii < npaths; ii++) {
+            cliopts_shm_snapshot snap;
+            if (!readers[ii]) {
+                continue;
+            }
+            if (cliopts_shm_sample(readers[ii], &snap) != 0) {
+                fprintf(stderr, "%s: busy\n", paths[ii]);
+                continue;
+            }
+            printf("%s pid=%lu generation=%lu\n", paths[ii], snap.pid,
+                   snap.generation);
+            for (jj = 0; jj < snap.nvalues; jj++) {
+                const cliopts_shm_value *val = snap.values + jj;
+                printf("  %s (%s) = %s%s%s\n", val->name, val->type,
+                       val->value, val->truncated ? "..." : "",
+                       val->found ? "" : " [default]");
+            }
+        }
+        fflush(stdout);
+        if (!interval) {
+            break;
+        }
+    }
+
+    for (ii = 0; ii < npaths; ii++) {
+        cliopts_shm_detach(readers[ii]);
+    }
+    free(readers);
+    free(paths);
+    return EXIT_SUCCESS;
+}
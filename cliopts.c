@@ -1,5 +1,16 @@
+/* A strict -std= hides POSIX functions such as ftruncate() and
+ * clock_gettime() */
+#if defined(__STRICT_ANSI__) && !defined(_WIN32) && \
+        !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #ifndef _WIN32
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <termios.h>
 #else
 #include <windows.h>
@@ -15,30 +26,67 @@
 #include "cliopts.h"
 
 
-enum {
-    CLIOPTS_ERR_SUCCESS,
-    CLIOPTS_ERR_NEED_ARG,
-    CLIOPTS_ERR_ISSWITCH,
-    CLIOPTS_ERR_BADOPT,
-    CLIOPTS_ERR_BAD_VALUE,
-    CLIOPTS_ERR_UNRECOGNIZED
+struct parse_record;
+
+/**
+ * Tables parsed together (see cliopts_chain_create()). A single table is
+ * parsed as a chain of one, without an index.
+ */
+struct cliopts_chain_st {
+    cliopts_table *tables;
+    /* Position of the first entry of each table */
+    size_t *starts;
+    size_t ntables;
+    /* Merged lookup index. NULL for a single table */
+    cliopts_index *idx;
+
+    /* Storage for a chain of one */
+    cliopts_table single;
+    size_t single_start;
 };
 
+static void
+chain_init_single(struct cliopts_chain_st *chain, cliopts_entry *entries)
+{
+    memset(chain, 0, sizeof(*chain));
+    chain->single.entries = entries;
+    chain->tables = &chain->single;
+    chain->starts = &chain->single_start;
+    chain->ntables = 1;
+}
+
 struct cliopts_priv {
+    /* The first table */
     cliopts_entry *entries;
+    const struct cliopts_chain_st *chain;
 
     cliopts_entry *prev;
     cliopts_entry *current;
+    /* Position of 'current' in the chain */
+    size_t pos;
     struct cliopts_extra_settings *settings;
 
     char *errstr;
     int errnum;
+    /* Where in the current argument the error was found */
+    const char *errpos;
 
     int argsplit;
     int wanted;
 
+    /* Index in argv of the argument being parsed */
+    int argidx;
+    /* Number of positional arguments which have been given a value */
+    size_t npos;
+    /* If set, what the parse does is recorded here (see cliopts_parser) */
+    struct parse_record *record;
+
     char current_key[4096];
     char current_value[4096];
+
+#ifdef CLIOPTS_ENABLE_STATS
+    struct cliopts_stats *stats;
+#endif
 };
 
 enum {
@@ -47,7 +95,8 @@ enum {
 
     MODE_ERROR,
     MODE_RESTARGS,
-    MODE_HELP
+    MODE_HELP,
+    MODE_HELP_JSON
 };
 
 #define INDENT "  "
@@ -64,24 +113,222 @@ enum {
 static void cliopt_debug(void *unused, ...) { (void)unused; }
 #endif /* CLIOPT_DEBUG */
 
+/**
+ * Statistics. With CLIOPTS_ENABLE_STATS undefined these expand to nothing.
+ */
+#ifdef CLIOPTS_ENABLE_STATS
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+typedef unsigned long long cliopts_hrtime;
+
+static cliopts_hrtime
+stats_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER cnt, freq;
+    QueryPerformanceCounter(&cnt);
+    QueryPerformanceFrequency(&freq);
+    return (cliopts_hrtime)(cnt.QuadPart * (1000000000.0 / freq.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (cliopts_hrtime)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#if defined(__GNUC__)
+#define STATS_TLS __thread
+#elif defined(_MSC_VER)
+#define STATS_TLS __declspec(thread)
+#else
+#define STATS_TLS
+#endif
+
+/* Statistics of the parse running on this thread. Allocations are counted
+ * here, as most of them happen where the parser state isn't to hand */
+static STATS_TLS struct cliopts_stats *stats_active;
+
+static void *
+stats_malloc(size_t n)
+{
+    void *p = malloc(n);
+    if (p && stats_active) {
+        stats_active->nallocs++;
+    }
+    return p;
+}
+
+static void *
+stats_calloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (p && stats_active) {
+        stats_active->nallocs++;
+    }
+    return p;
+}
+
+static void *
+stats_realloc(void *old, size_t n)
+{
+    void *p = realloc(old, n);
+    if (p && stats_active) {
+        stats_active->nallocs++;
+    }
+    return p;
+}
+
+#define CLIOPTS_MALLOC(n) stats_malloc(n)
+#define CLIOPTS_CALLOC(n, size) stats_calloc(n, size)
+#define CLIOPTS_REALLOC(p, n) stats_realloc(p, n)
+
+#define STATS_ADD(ctx, field, n) do { \
+    if ((ctx)->stats) { (ctx)->stats->field += (n); } \
+} while (0)
+#define STATS_TIMER(var) cliopts_hrtime var = 0;
+#define STATS_START(ctx, var) do { \
+    if ((ctx)->stats) { var = stats_now(); } \
+} while (0)
+/* Charge the time since 'var' to 'field', and restart the timer */
+#define STATS_LAP(ctx, var, field) do { \
+    if ((ctx)->stats) { \
+        cliopts_hrtime now_ = stats_now(); \
+        (ctx)->stats->field += now_ - var; \
+        var = now_; \
+    } \
+} while (0)
+#else
+#define CLIOPTS_MALLOC(n) malloc(n)
+#define CLIOPTS_CALLOC(n, size) calloc(n, size)
+#define CLIOPTS_REALLOC(p, n) realloc(p, n)
+#define STATS_ADD(ctx, field, n) ((void)0)
+#define STATS_TIMER(var)
+#define STATS_START(ctx, var) ((void)0)
+#define STATS_LAP(ctx, var, field) ((void)0)
+#endif /* CLIOPTS_ENABLE_STATS */
+
+/**
+ * USDT probes (for SystemTap, bpftrace, dtrace). Provider name is 'cliopts'.
+ */
+#ifdef CLIOPTS_ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE_OPTION_MATCH(ent) \
+    DTRACE_PROBE2(cliopts, option__match, (ent)->klong, (int)(ent)->kshort)
+#define PROBE_VALUE_CONVERT(ent, val, rv) \
+    DTRACE_PROBE3(cliopts, value__convert, (ent)->klong, val, rv)
+#define PROBE_ERROR(ctx) \
+    DTRACE_PROBE3(cliopts, error, (ctx)->errnum, (ctx)->errstr, \
+        (ctx)->current_key)
+#else
+#define PROBE_OPTION_MATCH(ent)
+#define PROBE_VALUE_CONVERT(ent, val, rv)
+#define PROBE_ERROR(ctx)
+#endif /* CLIOPTS_ENABLE_USDT */
+
+/**
+ * Token descriptors. Before the state machine sees them, the arguments are
+ * classified in batches, finding the length, '-' prefix and '=' of each in
+ * a single pass over the string.
+ */
+#define TOKEN_PLAIN 0 /* No prefix, or more than two '-' */
+#define TOKEN_SHORT 1 /* -c */
+#define TOKEN_LONG 2 /* --long, --long=value */
+
+struct cliopts_token {
+    size_t len;
+    /* Offset of the '=' in --long=value, or 0 if there is none */
+    size_t eq;
+    /* Number of leading '-' */
+    size_t prefix;
+    int kind;
+};
+
+#define TOKEN_BATCH 128
+
+static void
+classify_token(const char *s, struct cliopts_token *tok)
+{
+    size_t prefix = 0;
+    const char *p;
+
+    while (s[prefix] == '-') {
+        prefix++;
+    }
+    tok->prefix = prefix;
+    tok->kind = prefix == 1 ? TOKEN_SHORT :
+            prefix == 2 ? TOKEN_LONG : TOKEN_PLAIN;
+    tok->eq = 0;
+
+    /* Only the first '=' or quote matters, and the '=' only splits a
+     * --long=value. The rest of the length is left to strlen(), which the C
+     * library already vectorizes */
+    for (p = s + prefix; *p; p++) {
+        if (*p == '=' || *p == '"' || *p == '\'') {
+            if (*p == '=' && prefix == 2) {
+                tok->eq = p - s;
+            }
+            break;
+        }
+    }
+    tok->len = (p - s) + strlen(p);
+}
+
+/**
+ * Classify up to TOKEN_BATCH arguments, returning the number done
+ */
+static int
+classify_tokens(char **argv, int argc, struct cliopts_token *toks)
+{
+    int ii;
+    if (argc > TOKEN_BATCH) {
+        argc = TOKEN_BATCH;
+    }
+    for (ii = 0; ii < argc; ii++) {
+        classify_token(argv[ii], toks + ii);
+    }
+    return argc;
+}
+
+/* Copy n bytes into a fixed size buffer, truncating if needed */
+static void
+copy_bounded(char *dst, size_t ndst, const char *src, size_t n)
+{
+    if (n >= ndst) {
+        n = ndst - 1;
+    }
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+static int
+parse_option(struct cliopts_priv *ctx, const char *key,
+             const struct cliopts_token *tok);
+
+
 static int
-parse_option(struct cliopts_priv *ctx, const char *key);
+parse_value(struct cliopts_priv *ctx, const char *value, size_t vlen);
 
+static void
+index_lookup(struct cliopts_priv *ctx, int prefix_len, size_t klen);
 
 static int
-parse_value(struct cliopts_priv *ctx, const char *value);
+fingerprint_chain(const struct cliopts_chain_st *chain,
+                  const struct cliopts_extra_settings *settings,
+                  cliopts_fingerprint *fp);
 
 static void
 add_list_value(const char *src, size_t nsrc, cliopts_list *l)
 {
-    char *cp = malloc(nsrc + 1);
+    char *cp = CLIOPTS_MALLOC(nsrc + 1);
 
     if (!l->nalloc) {
         l->nalloc = 2;
-        l->values = malloc(l->nalloc * sizeof(*l->values));
-    } else {
+        l->values = CLIOPTS_MALLOC(l->nalloc * sizeof(*l->values));
+    } else if (l->nvalues == l->nalloc) {
         l->nalloc *= 1.5;
-        l->values = realloc(l->values, sizeof(*l->values) * l->nalloc);
+        l->values = CLIOPTS_REALLOC(l->values, sizeof(*l->values) * l->nalloc);
     }
 
     l->values[l->nvalues++] = cp;
@@ -112,10 +359,11 @@ cliopts_list_clear(cliopts_list *l)
     if (*endptr != '\0') { *errp = "Trailing garbage"; return -1; }
 
 static int
-extract_int(const char *s, void *dest, char **errp)
+extract_int(const char *s, size_t n, void *dest, void *arg, char **errp)
 {
     long int value;
     char *endptr = NULL;
+    (void)n; (void)arg;
     value = strtol(s, &endptr, 10);
     _VERIFY_INT_COMMON(LONG_MAX, INT_MAX)
     *(int*)dest = value;
@@ -123,10 +371,11 @@ extract_int(const char *s, void *dest, char **errp)
 }
 
 static int
-extract_uint(const char *s, void *dest, char **errp)
+extract_uint(const char *s, size_t n, void *dest, void *arg, char **errp)
 {
     unsigned long int value;
     char *endptr = NULL;
+    (void)n; (void)arg;
     value = strtoul(s, &endptr, 10);
     _VERIFY_INT_COMMON(ULONG_MAX, UINT_MAX)
     *(unsigned int*)dest = value;
@@ -135,10 +384,11 @@ extract_uint(const char *s, void *dest, char **errp)
 
 #ifdef ULLONG_MAX
 static int
-extract_ulonglong(const char *s, void *dest, char **errp)
+extract_ulonglong(const char *s, size_t n, void *dest, void *arg, char **errp)
 {
     unsigned long long value;
     char *endptr = NULL;
+    (void)n; (void)arg;
 #ifdef _WIN32
     value = _strtoui64(s, &endptr, 10);
 #else
@@ -149,18 +399,21 @@ extract_ulonglong(const char *s, void *dest, char **errp)
     return 0;
 }
 #else
-static int extract_ulonglong(const char *s, void *dest, char **errp)
+static int
+extract_ulonglong(const char *s, size_t n, void *dest, void *arg, char **errp)
 {
+    (void)s; (void)n; (void)dest; (void)arg;
     *errp = "long long not available";
     return -1;
 }
 #endif /* ULLONG_MAX */
 
 static int
-extract_hex(const char *s, void *dest, char **errp)
+extract_hex(const char *s, size_t n, void *dest, void *arg, char **errp)
 {
     unsigned long value;
     char *endptr = NULL;
+    (void)n; (void)arg;
     value = strtoul(s, &endptr, 16);
     _VERIFY_INT_COMMON(ULONG_MAX, UINT_MAX);
     *(unsigned int*)dest = value;
@@ -170,10 +423,11 @@ extract_hex(const char *s, void *dest, char **errp)
 #undef _VERIFY_INT_COMMON
 
 static int
-extract_float(const char *s, void *dest, char **errp)
+extract_float(const char *s, size_t n, void *dest, void *arg, char **errp)
 {
     char dummy_buf[4096];
     float value;
+    (void)n; (void)arg;
     if (sscanf(s, "%f%s", &value, dummy_buf) != 1) {
         *errp = "Found trailing garbage";
         return -1;
@@ -182,615 +436,6898 @@ extract_float(const char *s, void *dest, char **errp)
     return 0;
 }
 
-typedef int(*cliopts_extractor_func)(const char*, void*, char**);
-
+static int
+extract_double(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    double value;
+    char *endptr = NULL;
+    (void)arg;
+    errno = 0;
+    value = strtod(s, &endptr);
+    if (endptr == s) {
+        *errp = "Expected a number";
+        return -1;
+    } else if (endptr != s + n) {
+        *errp = "Trailing garbage";
+        return -1;
+    } else if (errno == ERANGE && (value > 1 || value < -1)) {
+        /* Underflow is rounded towards zero, overflow is an error */
+        *errp = "Value too large";
+        return -1;
+    }
+    *(double *)dest = value;
+    return 0;
+}
 
 /**
- * This function tries to extract a single value for an option key.
- * If it successfully has extracted a value, it returns MODE_VALUE.
- * If the entry takes no arguments, then the current string is a key,
- * and it will return MODE_OPTION. On error, MODE_ERROR is set, and errp
- * will point to a string.
- *
- * @param entry The current entry
- * @param value the string which might be a value
- * @errp a pointer which will be populated with the address of the error, if any
- *
- * @return a MODE_* type
+ * Sizes and durations are a number with a unit, stored as a count of bytes
+ * or nanoseconds. Each is converted in a single pass over the value,
+ * checking for overflow as the digits are accumulated.
  */
-static int
-parse_value(struct cliopts_priv *ctx,
-            const char *value)
-{
-    cliopts_entry *entry = ctx->current;
+struct scale_unit {
+    const char *name;
+    unsigned long long mult;
+};
 
-    size_t vlen = strlen(value);
-    cliopts_extractor_func exfn = NULL;
-    int exret;
-    int is_option = 0;
+/* Largest first, for formatting */
+static const struct scale_unit duration_units[] = {
+    { "h", (unsigned long long)3600 * 1000000000UL },
+    { "m", (unsigned long long)60 * 1000000000UL },
+    { "s", 1000000000UL },
+    { "ms", 1000000UL },
+    { "us", 1000UL },
+    { "ns", 1 }
+};
 
-    cliopt_debug("Called with %s, want=%d", value, ctx->wanted);
+#define SCALE_NUNITS(a) (sizeof(a) / sizeof(*(a)))
 
-    if (ctx->argsplit) {
-        if (vlen > 2 && strncmp(value, "--", 2) == 0) {
-            is_option = 1;
-        } else if (*value == '-') {
-            is_option = 1;
-        }
-    }
+#ifdef ULLONG_MAX
+/* Multiplier for the letters after a number, or 0 if they are not a unit */
+typedef unsigned long long (*scale_unit_fn)(const char *s, size_t n);
 
-    if (is_option) {
-        ctx->errstr = "Expected option. Got '-' or '--' prefixed value "
-                        "(use = if this is really a value)";
-        ctx->errnum = CLIOPTS_ERR_NEED_ARG;
-        return MODE_ERROR;
-    }
+/* B, or an SI (kB = 1000) or IEC (KiB = 1024) prefix with an optional B */
+static unsigned long long
+size_unit(const char *s, size_t n)
+{
+    static const char prefixes[] = "kmgtpe";
+    const char *p;
+    unsigned long long mult = 1;
+    int iec, ii;
 
-    if (entry->ktype == CLIOPTS_ARGT_STRING) {
-        char *vp = malloc(vlen+1);
-        vp[vlen] = 0;
-        strcpy(vp, value);
-        *(char**)entry->dest = vp;
-        return WANT_OPTION;
+    if (n && s[n - 1] == 'B') {
+        n--;
     }
-
-    if (entry->ktype == CLIOPTS_ARGT_LIST) {
-        add_list_value(value, vlen, (cliopts_list *)entry->dest);
-        return WANT_OPTION;
+    if (!n) {
+        return 1;
     }
-
-    if (entry->ktype == CLIOPTS_ARGT_FLOAT) {
-        exfn = extract_float;
-    } else if (entry->ktype == CLIOPTS_ARGT_HEX) {
-        exfn = extract_hex;
-    } else if (entry->ktype == CLIOPTS_ARGT_INT) {
-        exfn = extract_int;
-    } else if (entry->ktype == CLIOPTS_ARGT_UINT) {
-        exfn = extract_uint;
-    } else if (entry->ktype == CLIOPTS_ARGT_ULONGLONG) {
-        exfn = extract_ulonglong;
-    } else {
-        fprintf(stderr, "Unrecognized type %d.\n", entry->ktype);
-        return MODE_ERROR;
+    p = strchr(prefixes, tolower((unsigned char)*s));
+    iec = n == 2 && s[1] == 'i';
+    if (!p || n != (size_t)(1 + iec)) {
+        return 0;
     }
-
-    exret = exfn(value, entry->dest, &ctx->errstr);
-    if (exret == 0) {
-        return WANT_OPTION;
-    } else {
-        ctx->errnum = CLIOPTS_ERR_BAD_VALUE;
+    for (ii = 0; ii <= p - prefixes; ii++) {
+        mult *= iec ? 1024 : 1000;
     }
-
-    return MODE_ERROR;
+    return mult;
 }
 
-/**
- * Like parse_value, except for keys.
- *
- * @param entries all option entries
- * @param key the current string from argv
- * @param errp a pointer which will be populated with the address of an error
- * string
- *
- * @param found_entry a pointer to be populated with the relevant entry
- * structure
- * @param kp a pointer which will be poplated with the address of the 'sanitized'
- * key string
- *
- * @param valp if the string is actually a key-value pair (i.e. --foo=bar) then
- * this will be populated with the address of that string
- *
- * @return MODE_OPTION if an option was found, MODE_VALUE if the current option
- * is a value, or MODE_ERROR on error
- */
-static int
-parse_option(struct cliopts_priv *ctx,
-          const char *key)
+/* ns to h. A number on its own is in seconds */
+static unsigned long long
+duration_unit(const char *s, size_t n)
 {
-    cliopts_entry *cur = NULL;
-    int prefix_len = 0;
-    unsigned ii = 0;
-    const char *valp = NULL;
-    size_t klen;
-
-    klen = strlen(key);
-    ctx->errstr = NULL;
-    ctx->prev = ctx->current;
-    ctx->current = NULL;
-
-    cliopt_debug("Called with %s, want=%d", key, ctx->wanted);
-    if (klen == 0) {
-        ctx->errstr = "Got an empty string";
-        ctx->errnum = CLIOPTS_ERR_BADOPT;
-        return MODE_ERROR;
-    }
-
-    /**
-     * figure out what type of option it is..
-     * it can either be a -c, --long, or --long=value
-     */
-    while (*key == '-') {
-        key++;
-        prefix_len++;
-        klen--;
+    size_t ii;
+    if (!n) {
+        return 1000000000UL;
     }
-
-    for (ii = 0; ii < klen; ii++) {
-        if (key[ii] == '"' || key[ii] == '\'') {
-            ii = klen;
-            break;
-
-        } else if (key[ii] == '=' && prefix_len == 2) {
-            /* only split on '=' if we're called as '--' */
-            valp = key + (ii + 1);
-            klen = ii;
-            break;
+    for (ii = 0; ii < SCALE_NUNITS(duration_units); ii++) {
+        const char *name = duration_units[ii].name;
+        if (strlen(name) == n && memcmp(name, s, n) == 0) {
+            return duration_units[ii].mult;
         }
     }
+    return 0;
+}
 
-    GT_PARSEOPT:
-    memset(ctx->current_value, 0, sizeof(ctx->current_value));
-    memcpy(ctx->current_key, key, klen);
-    ctx->current_key[ii] = '\0';
+/*
+ * Convert s[0..n), which is one or more (if 'compound', e.g. 1h30m) numbers
+ * with an optional fraction, each followed by its unit. Fractions are
+ * rounded down to a whole number of the base unit.
+ */
+static int
+scale_parse(const char *s, size_t n, scale_unit_fn unit, int compound,
+            unsigned long long *out, char **errp)
+{
+    const char *end = s + n, *fstart, *fend, *ustart;
+    unsigned long long total = 0, value, frac, mult;
+    unsigned digit;
+    int ndigits, first = 1;
 
-    if (valp) {
-        strcpy(ctx->current_value, valp);
-    }
+    do {
+        value = frac = 0;
+        fstart = NULL;
+        for (ndigits = 0; s < end && (digit = *s - '0') <= 9; s++, ndigits++) {
+            if (value > (ULLONG_MAX - digit) / 10) {
+                goto GT_OVERFLOW;
+            }
+            value = value * 10 + digit;
+        }
+        if (s < end && *s == '.') {
+            for (fstart = ++s; s < end && (unsigned)(*s - '0') <= 9; s++) {
+                ndigits++;
+            }
+        }
+        fend = s;
+        if (!ndigits) {
+            *errp = "Expected a number";
+            return -1;
+        }
 
-    if (prefix_len == 0 || prefix_len > 2) {
-        if (ctx->settings->restargs) {
-            key -= prefix_len;
-            ctx->settings->restargs[ctx->settings->nrestargs++] = key;
-            return WANT_OPTION;
-        } else if (ctx->prev && ctx->prev->ktype == CLIOPTS_ARGT_NONE) {
-            ctx->errstr = "Option does not accept a value";
-            ctx->errnum = CLIOPTS_ERR_ISSWITCH;
-        } else {
-            ctx->errstr = "Options must begin with either '-' or '--'";
-            ctx->errnum = CLIOPTS_ERR_BADOPT;
+        ustart = s;
+        while (s < end && isalpha((unsigned char)*s)) {
+            s++;
+        }
+        if (s == ustart && !first) {
+            *errp = "Missing unit";
+            return -1;
+        }
+        if (!(mult = unit(ustart, s - ustart))) {
+            *errp = "Unknown unit";
+            return -1;
         }
-        return MODE_ERROR;
-    }
 
-    /**
-     * --help or -?
-     */
+        /* From the last digit of the fraction back, so nothing is lost */
+        for (; fstart && fend > fstart; fend--) {
+            frac = (frac + (unsigned)(fend[-1] - '0') * mult) / 10;
+        }
+        if (value > (ULLONG_MAX - frac) / mult) {
+            goto GT_OVERFLOW;
+        }
+        value = value * mult + frac;
+        if (total > ULLONG_MAX - value) {
+            goto GT_OVERFLOW;
+        }
+        total += value;
+        first = 0;
+    } while (compound && s < end);
 
-    if ( (prefix_len == 1 && *key == '?') ||
-            (prefix_len == 2 && strcmp(key, "help") == 0)) {
-        return MODE_HELP;
+    if (s != end) {
+        *errp = "Trailing garbage";
+        return -1;
     }
+    *out = total;
+    return 0;
 
-    /**
-     * Bare --
-     */
-    if (prefix_len == 2 && *key == '\0') {
-        if (ctx->settings->restargs) {
+    GT_OVERFLOW:
+    *errp = "Value too large";
+    return -1;
+}
 
-        }
-        if (ctx->wanted == WANT_VALUE) {
-            ctx->errnum = CLIOPTS_ERR_NEED_ARG;
-            ctx->errstr = "Found bare '--', but value wanted";
-            return MODE_ERROR;
-        }
+static int
+extract_longlong(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    const char *end = s + n;
+    unsigned long long value = 0, limit = LLONG_MAX;
+    unsigned digit;
+    int neg = 0;
+    (void)arg;
 
-        return MODE_RESTARGS;
+    if (s < end && (*s == '-' || *s == '+')) {
+        neg = *s++ == '-';
+        limit += neg;
     }
-
-    for (cur = ctx->entries; cur->dest; cur++) {
-        int optlen;
-        if (prefix_len == 1) {
-            if (cur->kshort == ctx->current_key[0]) {
-                ctx->current = cur;
-                break;
-            }
-            continue;
+    if (s == end) {
+        *errp = "Expected a number";
+        return -1;
+    }
+    for (; s < end; s++) {
+        if ((digit = *s - '0') > 9) {
+            *errp = "Trailing garbage";
+            return -1;
         }
-        /** else, prefix_len is 2 */
-        if (cur->klong == NULL ||
-                (optlen = strlen(cur->klong) != klen) ||
-                strncmp(cur->klong, ctx->current_key, klen) != 0) {
-
-            continue;
+        if (value > (limit - digit) / 10) {
+            *errp = "Value too large";
+            return -1;
         }
-
-        ctx->current = cur;
-        break;
+        value = value * 10 + digit;
     }
+    /* Negated without overflow, even for LLONG_MIN */
+    *(long long *)dest = neg && value ? -(long long)(value - 1) - 1
+                                      : (long long)value;
+    return 0;
+}
 
-    if (!ctx->current) {
-        ctx->errstr = "Unknown option";
-        ctx->errnum = CLIOPTS_ERR_UNRECOGNIZED;
+static int
+extract_size(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    (void)arg;
+    return scale_parse(s, n, size_unit, 0, dest, errp);
+}
+
+static int
+extract_duration(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    (void)arg;
+    return scale_parse(s, n, duration_unit, 1, dest, errp);
+}
+#else
+static int
+extract_longlong(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    (void)s; (void)n; (void)dest; (void)arg;
+    *errp = "long long not available";
+    return -1;
+}
+#define extract_size extract_longlong
+#define extract_duration extract_longlong
+#endif /* ULLONG_MAX */
+
+static int
+extract_string(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    char *vp = CLIOPTS_MALLOC(n + 1);
+    (void)arg; (void)errp;
+    memcpy(vp, s, n);
+    vp[n] = '\0';
+    *(char**)dest = vp;
+    return 0;
+}
+
+static int
+extract_list(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    (void)arg; (void)errp;
+    add_list_value(s, n, (cliopts_list *)dest);
+    return 0;
+}
+
+/**
+ * Blobs. Literal values point into the arguments, and @path values map the
+ * file, so that large inputs are not copied. Files which can't be mapped
+ * are read into memory instead.
+ */
+#define BLOB_MAPPED 1
+#define BLOB_ALLOCATED 2
+
+static char *
+schema_read_file(const char *path, size_t *np);
+
+static int
+blob_read(cliopts_blob *blob, const char *path, char **errp)
+{
+    size_t n;
+    char *buf = schema_read_file(path, &n);
+
+    if (!buf) {
+        *errp = "Couldn't read file";
+        return -1;
+    }
+    blob->data = buf;
+    blob->len = n;
+    blob->mapped = BLOB_ALLOCATED;
+    return 0;
+}
+
+static int
+blob_map(cliopts_blob *blob, const char *path, char **errp)
+{
+#ifndef _WIN32
+    struct stat st;
+    void *addr;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        *errp = "Couldn't open file";
+        return -1;
+    }
+    /* Pipes and files in /proc have no size to map */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return blob_read(blob, path, errp);
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        *errp = "Couldn't map file";
+        return -1;
+    }
+    blob->data = addr;
+    blob->len = (size_t)st.st_size;
+    blob->mapped = BLOB_MAPPED;
+    return 0;
+#else
+    return blob_read(blob, path, errp);
+#endif
+}
+
+CLIOPTS_API
+void
+cliopts_blob_clear(cliopts_blob *blob)
+{
+#ifndef _WIN32
+    if (blob->mapped == BLOB_MAPPED) {
+        munmap((void *)blob->data, blob->len);
+    } else
+#endif
+    if (blob->mapped == BLOB_ALLOCATED) {
+        free((void *)blob->data);
+    }
+    blob->data = NULL;
+    blob->len = 0;
+    blob->mapped = 0;
+}
+
+CLIOPTS_API
+int
+cliopts_blob_copy(cliopts_blob *dst, const cliopts_blob *src)
+{
+    char *buf;
+
+    if (!src->mapped) {
+        *dst = *src;
+        return 0;
+    }
+    if ((buf = CLIOPTS_MALLOC(src->len)) == NULL) {
+        return -1;
+    }
+    memcpy(buf, src->data, src->len);
+    dst->data = buf;
+    dst->len = src->len;
+    dst->mapped = BLOB_ALLOCATED;
+    return 0;
+}
+
+CLIOPTS_API
+int
+cliopts_blob_next_line(const cliopts_blob *blob, size_t *pos,
+                       const char **line, size_t *nline)
+{
+    const char *start, *nl;
+    size_t left;
+
+    if (*pos >= blob->len) {
+        return 0;
+    }
+    start = blob->data + *pos;
+    left = blob->len - *pos;
+    nl = memchr(start, '\n', left);
+    *line = start;
+    if (nl) {
+        *nline = (size_t)(nl - start);
+        *pos += *nline + 1;
+    } else {
+        *nline = left;
+        *pos = blob->len;
+    }
+    if (*nline && start[*nline - 1] == '\r') {
+        (*nline)--;
+    }
+    return 1;
+}
+
+/**
+ * String pools. Each string is encoded as a varint count of the bytes it
+ * shares with the previous string, a varint count of the bytes which follow,
+ * and those bytes.
+ */
+#define STRPOOL_RESTART CLIOPTS_STRPOOL_RESTART
+
+static size_t
+strpool_put_varint(unsigned char *out, size_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+static size_t
+strpool_get_varint(const char *in, size_t *pos)
+{
+    const unsigned char *up = (const unsigned char *)in;
+    size_t v = 0;
+    unsigned shift = 0;
+    unsigned char c;
+    do {
+        c = up[(*pos)++];
+        v |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+/* Grow a byte buffer to hold at least need bytes */
+static int
+strpool_grow(char **buf, size_t *nalloc, size_t need)
+{
+    size_t n = *nalloc ? *nalloc : 64;
+    char *tmp;
+
+    if (need <= *nalloc) {
+        return 0;
+    }
+    /* Grow by half rather than doubling, since pools can be large */
+    while (n < need) {
+        n += n / 2;
+    }
+    if ((tmp = CLIOPTS_REALLOC(*buf, n)) == NULL) {
+        return -1;
+    }
+    *buf = tmp;
+    *nalloc = n;
+    return 0;
+}
+
+CLIOPTS_API
+int
+cliopts_strpool_add(cliopts_strpool *p, const char *s, size_t n)
+{
+    size_t shared = 0, pos;
+    int restart = p->nvalues % STRPOOL_RESTART == 0;
+
+    if (restart && p->nvalues / STRPOOL_RESTART == p->noffsets_alloc) {
+        size_t nalloc = p->noffsets_alloc ? p->noffsets_alloc * 2 : 4;
+        size_t *tmp = CLIOPTS_REALLOC(p->offsets, nalloc * sizeof(*tmp));
+        if (!tmp) {
+            return -1;
+        }
+        p->offsets = tmp;
+        p->noffsets_alloc = nalloc;
+    } else if (!restart) {
+        size_t max = n < p->nlast ? n : p->nlast;
+        while (shared < max && s[shared] == p->last[shared]) {
+            shared++;
+        }
+    }
+
+    /* Each varint takes at most 10 bytes */
+    if (strpool_grow(&p->data, &p->nalloc, p->ndata + n - shared + 20) != 0 ||
+            strpool_grow(&p->last, &p->nlast_alloc, n + 1) != 0) {
+        return -1;
+    }
+    if (restart) {
+        p->offsets[p->nvalues / STRPOOL_RESTART] = p->ndata;
+    }
+    pos = p->ndata;
+    pos += strpool_put_varint((unsigned char *)p->data + pos, shared);
+    pos += strpool_put_varint((unsigned char *)p->data + pos, n - shared);
+    memcpy(p->data + pos, s + shared, n - shared);
+    p->ndata = pos + n - shared;
+
+    memcpy(p->last + shared, s + shared, n - shared);
+    p->nlast = n;
+    p->nvalues++;
+    return 0;
+}
+
+CLIOPTS_API
+void
+cliopts_strpool_iter_clear(cliopts_strpool_iter *it)
+{
+    free(it->buf);
+    it->buf = NULL;
+    it->nbuf = 0;
+    it->value = NULL;
+    it->len = 0;
+}
+
+CLIOPTS_API
+int
+cliopts_strpool_next(const cliopts_strpool *p, cliopts_strpool_iter *it)
+{
+    size_t shared, n;
+
+    if (it->index >= p->nvalues) {
+        cliopts_strpool_iter_clear(it);
+        return 0;
+    }
+    shared = strpool_get_varint(p->data, &it->pos);
+    n = strpool_get_varint(p->data, &it->pos);
+    /* The shared prefix is already in the buffer */
+    if (strpool_grow(&it->buf, &it->nbuf, shared + n + 1) != 0) {
+        cliopts_strpool_iter_clear(it);
+        return 0;
+    }
+    memcpy(it->buf + shared, p->data + it->pos, n);
+    it->buf[shared + n] = '\0';
+    it->pos += n;
+    it->index++;
+    it->value = it->buf;
+    it->len = shared + n;
+    return 1;
+}
+
+CLIOPTS_API
+size_t
+cliopts_strpool_get(const cliopts_strpool *p, size_t index, char *buf,
+                    size_t nbuf)
+{
+    cliopts_strpool_iter it;
+    size_t len;
+
+    if (index >= p->nvalues) {
+        return (size_t)-1;
+    }
+    memset(&it, 0, sizeof it);
+    it.index = index - index % STRPOOL_RESTART;
+    it.pos = p->offsets[index / STRPOOL_RESTART];
+    while (it.index <= index) {
+        if (!cliopts_strpool_next(p, &it)) {
+            return (size_t)-1;
+        }
+    }
+    len = it.len;
+    if (nbuf) {
+        size_t ncopy = len < nbuf - 1 ? len : nbuf - 1;
+        memcpy(buf, it.value, ncopy);
+        buf[ncopy] = '\0';
+    }
+    cliopts_strpool_iter_clear(&it);
+    return len;
+}
+
+struct strpool_ref {
+    const char *s;
+    size_t n;
+};
+
+static int
+strpool_ref_cmp(const void *a, const void *b)
+{
+    const struct strpool_ref *x = a, *y = b;
+    int rv = memcmp(x->s, y->s, x->n < y->n ? x->n : y->n);
+    if (rv) {
+        return rv;
+    }
+    return x->n < y->n ? -1 : x->n > y->n;
+}
+
+CLIOPTS_API
+int
+cliopts_strpool_sort(cliopts_strpool *p)
+{
+    struct strpool_ref *refs = NULL;
+    cliopts_strpool_iter it;
+    cliopts_strpool sorted;
+    char *flat = NULL, *trimmed;
+    size_t ii, nflat = 0;
+    int rv = -1;
+
+    /* Decode the strings into one buffer, so they can be compared */
+    memset(&it, 0, sizeof it);
+    while (cliopts_strpool_next(p, &it)) {
+        nflat += it.len;
+    }
+    if (it.index != p->nvalues) {
+        return -1;
+    }
+    if (!p->nvalues) {
+        return 0;
+    }
+    memset(&sorted, 0, sizeof sorted);
+    refs = CLIOPTS_MALLOC(p->nvalues * sizeof(*refs));
+    flat = CLIOPTS_MALLOC(nflat ? nflat : 1);
+    if (!refs || !flat) {
+        goto GT_DONE;
+    }
+
+    memset(&it, 0, sizeof it);
+    for (ii = 0, nflat = 0; cliopts_strpool_next(p, &it); ii++) {
+        memcpy(flat + nflat, it.value, it.len);
+        refs[ii].s = flat + nflat;
+        refs[ii].n = it.len;
+        nflat += it.len;
+    }
+    if (ii != p->nvalues) {
+        goto GT_DONE;
+    }
+
+    qsort(refs, p->nvalues, sizeof(*refs), strpool_ref_cmp);
+    for (ii = 0; ii < p->nvalues; ii++) {
+        if (ii && strpool_ref_cmp(refs + ii - 1, refs + ii) == 0) {
+            continue;
+        }
+        if (cliopts_strpool_add(&sorted, refs[ii].s, refs[ii].n) != 0) {
+            cliopts_strpool_clear(&sorted);
+            goto GT_DONE;
+        }
+    }
+    if ((trimmed = CLIOPTS_REALLOC(sorted.data, sorted.ndata)) != NULL) {
+        sorted.data = trimmed;
+        sorted.nalloc = sorted.ndata;
+    }
+    cliopts_strpool_clear(p);
+    *p = sorted;
+    rv = 0;
+
+    GT_DONE:
+    free(refs);
+    free(flat);
+    return rv;
+}
+
+CLIOPTS_API
+void
+cliopts_strpool_clear(cliopts_strpool *p)
+{
+    free(p->data);
+    free(p->offsets);
+    free(p->last);
+    memset(p, 0, sizeof(*p));
+}
+
+CLIOPTS_API
+int
+cliopts_strpool_copy(cliopts_strpool *dst, const cliopts_strpool *src)
+{
+    cliopts_strpool tmp;
+    size_t nblocks = (src->nvalues + STRPOOL_RESTART - 1) / STRPOOL_RESTART;
+
+    memset(&tmp, 0, sizeof tmp);
+    if (src->nvalues) {
+        tmp.data = CLIOPTS_MALLOC(src->ndata);
+        tmp.offsets = CLIOPTS_MALLOC(nblocks * sizeof(*tmp.offsets));
+        tmp.last = CLIOPTS_MALLOC(src->nlast + 1);
+        if (!tmp.data || !tmp.offsets || !tmp.last) {
+            cliopts_strpool_clear(&tmp);
+            return -1;
+        }
+        memcpy(tmp.data, src->data, src->ndata);
+        memcpy(tmp.offsets, src->offsets, nblocks * sizeof(*tmp.offsets));
+        memcpy(tmp.last, src->last, src->nlast);
+        tmp.ndata = tmp.nalloc = src->ndata;
+        tmp.noffsets_alloc = nblocks;
+        tmp.nvalues = src->nvalues;
+        tmp.nlast = src->nlast;
+        tmp.nlast_alloc = src->nlast + 1;
+    }
+    *dst = tmp;
+    return 0;
+}
+
+static int
+extract_strpool(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    cliopts_blob file;
+    const char *line;
+    size_t pos = 0, nline;
+    int rv = 0;
+    (void)arg;
+
+    if (n < 2 || s[0] != '@' || s[1] == '@') {
+        if (n > 1 && s[0] == '@') {
+            s++;
+            n--;
+        }
+        if (cliopts_strpool_add(dest, s, n) != 0) {
+            *errp = "Out of memory";
+            return -1;
+        }
+        return 0;
+    }
+
+    /* @path adds each line of the file, skipping blank ones */
+    memset(&file, 0, sizeof file);
+    if (blob_map(&file, s + 1, errp) != 0) {
+        return -1;
+    }
+    while (rv == 0 && cliopts_blob_next_line(&file, &pos, &line, &nline)) {
+        if (nline && cliopts_strpool_add(dest, line, nline) != 0) {
+            *errp = "Out of memory";
+            rv = -1;
+        }
+    }
+    cliopts_blob_clear(&file);
+    return rv;
+}
+
+static int
+extract_blob(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    cliopts_blob *blob = dest;
+    (void)arg;
+
+    /* A repeated option replaces the earlier value */
+    cliopts_blob_clear(blob);
+    if (n > 1 && s[0] == '@' && s[1] != '@') {
+        return blob_map(blob, s + 1, errp);
+    }
+    if (n > 1 && s[0] == '@') {
+        s++;
+        n--;
+    }
+    blob->data = s;
+    blob->len = n;
+    return 0;
+}
+
+/**
+ * Display functions, for the default values in the help text
+ */
+
+/* Append a string to a bounded buffer, truncating if necessary */
+static size_t
+format_append(char *buf, size_t nbuf, size_t pos, const char *s)
+{
+    for (; *s && pos + 1 < nbuf; s++, pos++) {
+        buf[pos] = *s;
+    }
+    if (nbuf) {
+        buf[pos < nbuf ? pos : nbuf - 1] = '\0';
+    }
+    return pos;
+}
+
+static void
+format_bool(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    (void)arg;
+    format_append(buf, nbuf, 0, *(const int*)dest ? "TRUE" : "FALSE");
+}
+
+static void
+format_int(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    char tmp[32];
+    (void)arg;
+    sprintf(tmp, "%d", *(const int*)dest);
+    format_append(buf, nbuf, 0, tmp);
+}
+
+static void
+format_uint(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    char tmp[32];
+    (void)arg;
+    sprintf(tmp, "%u", *(const unsigned int*)dest);
+    format_append(buf, nbuf, 0, tmp);
+}
+
+static void
+format_ulonglong(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+#ifdef ULLONG_MAX
+    char tmp[32];
+    (void)arg;
+    sprintf(tmp, "%llu", *(const unsigned long long*)dest);
+    format_append(buf, nbuf, 0, tmp);
+#else
+    (void)dest; (void)arg; (void)buf; (void)nbuf;
+#endif
+}
+
+static void
+format_hex(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    char tmp[32];
+    (void)arg;
+    sprintf(tmp, "0x%x", *(const unsigned int*)dest);
+    format_append(buf, nbuf, 0, tmp);
+}
+
+static void
+format_float(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    char tmp[64];
+    (void)arg;
+    sprintf(tmp, "%0.2f", *(const float*)dest);
+    format_append(buf, nbuf, 0, tmp);
+}
+
+static void
+format_longlong(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+#ifdef ULLONG_MAX
+    char tmp[32];
+    (void)arg;
+    sprintf(tmp, "%lld", *(const long long*)dest);
+    format_append(buf, nbuf, 0, tmp);
+#else
+    (void)dest; (void)arg; (void)buf; (void)nbuf;
+#endif
+}
+
+static void
+format_double(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    char tmp[64];
+    (void)arg;
+    sprintf(tmp, "%g", *(const double*)dest);
+    format_append(buf, nbuf, 0, tmp);
+}
+
+/* In the largest unit which divides the size exactly, e.g. 64MiB or 1500B */
+static void
+format_size(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+#ifdef ULLONG_MAX
+    unsigned long long value = *(const unsigned long long*)dest, v;
+    char tmp[32];
+    int si = 0, iec = 0, ii;
+    (void)arg;
+
+    for (v = value; v && v % 1000 == 0 && si < 6; v /= 1000) {
+        si++;
+    }
+    for (v = value; v && v % 1024 == 0 && iec < 6; v /= 1024) {
+        iec++;
+    }
+    if (iec && iec >= si) {
+        sprintf(tmp, "%llu%ciB", value >> (10 * iec), "KMGTPE"[iec - 1]);
+    } else if (si) {
+        for (v = value, ii = 0; ii < si; ii++) {
+            v /= 1000;
+        }
+        sprintf(tmp, "%llu%cB", v, "kMGTPE"[si - 1]);
+    } else {
+        sprintf(tmp, "%lluB", value);
+    }
+    format_append(buf, nbuf, 0, tmp);
+#else
+    (void)dest; (void)arg; (void)buf; (void)nbuf;
+#endif
+}
+
+/* As a sum of units, e.g. 1m30s or 250ms */
+static void
+format_duration(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+#ifdef ULLONG_MAX
+    unsigned long long value = *(const unsigned long long*)dest;
+    char tmp[32];
+    size_t ii, pos = 0;
+    (void)arg;
+
+    format_append(buf, nbuf, 0, value ? "" : "0s");
+    for (ii = 0; ii < SCALE_NUNITS(duration_units) && value; ii++) {
+        const struct scale_unit *u = duration_units + ii;
+        if (value >= u->mult) {
+            sprintf(tmp, "%llu%s", value / u->mult, u->name);
+            pos = format_append(buf, nbuf, pos, tmp);
+            value %= u->mult;
+        }
+    }
+#else
+    (void)dest; (void)arg; (void)buf; (void)nbuf;
+#endif
+}
+
+static void
+format_string(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const char *s = *(char * const *)dest;
+    size_t pos;
+    (void)arg;
+    pos = format_append(buf, nbuf, 0, "'");
+    pos = format_append(buf, nbuf, pos, s ? s : "");
+    format_append(buf, nbuf, pos, "'");
+}
+
+static void
+format_list(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_list *l = dest;
+    size_t ii, pos = 0;
+    (void)arg;
+    format_append(buf, nbuf, 0, "");
+    for (ii = 0; ii < l->nvalues; ii++) {
+        pos = format_append(buf, nbuf, pos, "'");
+        pos = format_append(buf, nbuf, pos, l->values[ii]);
+        pos = format_append(buf, nbuf, pos, "'");
+        if (ii != l->nvalues-1) {
+            pos = format_append(buf, nbuf, pos, ", ");
+        }
+    }
+}
+
+static void
+format_blob(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_blob *blob = dest;
+    char tmp[48];
+    size_t pos;
+    (void)arg;
+
+    format_append(buf, nbuf, 0, "");
+    if (!blob->data) {
+        return;
+    }
+    if (blob->mapped) {
+        sprintf(tmp, "(%lu bytes)", (unsigned long)blob->len);
+        format_append(buf, nbuf, 0, tmp);
+        return;
+    }
+    pos = format_append(buf, nbuf, 0, "'");
+    if (pos + blob->len + 2 <= nbuf) {
+        memcpy(buf + pos, blob->data, blob->len);
+        pos += blob->len;
+    }
+    format_append(buf, nbuf, pos, "'");
+}
+
+static void
+format_strpool(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    cliopts_strpool_iter it;
+    size_t pos = 0;
+    (void)arg;
+
+    format_append(buf, nbuf, 0, "");
+    memset(&it, 0, sizeof it);
+    while (cliopts_strpool_next(dest, &it)) {
+        if (it.index > 1) {
+            pos = format_append(buf, nbuf, pos, ", ");
+        }
+        pos = format_append(buf, nbuf, pos, "'");
+        pos = format_append(buf, nbuf, pos, it.value);
+        pos = format_append(buf, nbuf, pos, "'");
+        if (pos + 1 >= nbuf) {
+            cliopts_strpool_iter_clear(&it);
+            break;
+        }
+    }
+}
+
+/**
+ * Numeric lists. Values are parsed into a numval and then stored as the
+ * list's element type.
+ */
+typedef union {
+    long i;
+    unsigned long long u;
+    double d;
+} numval;
+
+#define NUMLIST_IS_SIGNED(t) ((t) == CLIOPTS_ARGT_INT_LIST)
+#define NUMLIST_IS_FLOAT(t) ((t) == CLIOPTS_ARGT_FLOAT_LIST)
+
+static size_t
+numlist_elsize(int ktype)
+{
+    switch (ktype) {
+    case CLIOPTS_ARGT_INT_LIST:
+        return sizeof(int);
+    case CLIOPTS_ARGT_UINT_LIST:
+        return sizeof(unsigned);
+    case CLIOPTS_ARGT_ULONGLONG_LIST:
+        return sizeof(unsigned long long);
+    default:
+        return sizeof(float);
+    }
+}
+
+static int
+numlist_parse_num(const char **sp, int ktype, numval *out, char **errp)
+{
+    const char *s = *sp;
+    char *endptr = NULL;
+
+    errno = 0;
+    if (NUMLIST_IS_FLOAT(ktype)) {
+        out->d = strtod(s, &endptr);
+    } else if (NUMLIST_IS_SIGNED(ktype)) {
+        out->i = strtol(s, &endptr, 10);
+        if (out->i > INT_MAX || out->i < INT_MIN) {
+            errno = ERANGE;
+        }
+    } else {
+        if (*s == '-') {
+            *errp = "Negative value for unsigned list";
+            return -1;
+        }
+#ifdef _WIN32
+        out->u = _strtoui64(s, &endptr, 10);
+#else
+        out->u = strtoull(s, &endptr, 10);
+#endif
+        if (ktype == CLIOPTS_ARGT_UINT_LIST && out->u > UINT_MAX) {
+            errno = ERANGE;
+        }
+    }
+
+    if (endptr == s) {
+        *errp = "Expected a number";
+        return -1;
+    } else if (errno == ERANGE) {
+        *errp = "Value too large";
+        return -1;
+    }
+    *sp = endptr;
+    return 0;
+}
+
+static void
+numlist_store(void *arr, size_t pos, int ktype, const numval *v)
+{
+    switch (ktype) {
+    case CLIOPTS_ARGT_INT_LIST:
+        ((int *)arr)[pos] = (int)v->i;
+        break;
+    case CLIOPTS_ARGT_UINT_LIST:
+        ((unsigned *)arr)[pos] = (unsigned)v->u;
+        break;
+    case CLIOPTS_ARGT_ULONGLONG_LIST:
+        ((unsigned long long *)arr)[pos] = v->u;
+        break;
+    default:
+        ((float *)arr)[pos] = (float)v->d;
+        break;
+    }
+}
+
+static void
+numlist_load(const void *arr, size_t pos, int ktype, numval *v)
+{
+    switch (ktype) {
+    case CLIOPTS_ARGT_INT_LIST:
+        v->i = ((const int *)arr)[pos];
+        break;
+    case CLIOPTS_ARGT_UINT_LIST:
+        v->u = ((const unsigned *)arr)[pos];
+        break;
+    case CLIOPTS_ARGT_ULONGLONG_LIST:
+        v->u = ((const unsigned long long *)arr)[pos];
+        break;
+    default:
+        v->d = ((const float *)arr)[pos];
+        break;
+    }
+}
+
+/* Make room for 'n' more elements, growing geometrically */
+static int
+numlist_reserve(void **arr, size_t *nalloc, size_t nused, size_t n,
+                size_t elsize)
+{
+    size_t want = nused + n;
+    size_t newalloc = *nalloc ? *nalloc : 4;
+    void *newarr;
+
+    if (want < nused) {
+        return -1;
+    }
+    if (want <= *nalloc) {
+        return 0;
+    }
+    while (newalloc < want) {
+        if (newalloc * 2 < newalloc) {
+            newalloc = want;
+            break;
+        }
+        newalloc *= 2;
+    }
+    if (newalloc > ((size_t)-1) / elsize) {
+        return -1;
+    }
+    newarr = CLIOPTS_REALLOC(*arr, newalloc * elsize);
+    if (!newarr) {
+        return -1;
+    }
+    *arr = newarr;
+    *nalloc = newalloc;
+    return 0;
+}
+
+/**
+ * Number of elements in the range. Returns 0 if the count does not fit in
+ * a size_t.
+ */
+static size_t
+numlist_range_count(int ktype, const numval *first, const numval *last,
+                    const numval *step)
+{
+    unsigned long long span;
+    if (NUMLIST_IS_FLOAT(ktype)) {
+        double cnt = (last->d - first->d) / step->d + 1 + 1e-9;
+        if (cnt >= (double)(size_t)-1) {
+            return 0;
+        }
+        return (size_t)cnt;
+    } else if (NUMLIST_IS_SIGNED(ktype)) {
+        span = (unsigned long long)((long long)last->i - first->i) /
+                (unsigned long long)step->i;
+    } else {
+        span = (last->u - first->u) / step->u;
+    }
+    if (span >= (size_t)-1) {
+        return 0;
+    }
+    return (size_t)span + 1;
+}
+
+static int
+numlist_add_range(cliopts_numlist *l, int ktype, const numval *first,
+                  const numval *last, const numval *step, char **errp)
+{
+    size_t elsize = numlist_elsize(ktype), count, ii;
+
+    if (NUMLIST_IS_FLOAT(ktype) ? (step->d <= 0) :
+            NUMLIST_IS_SIGNED(ktype) ? (step->i <= 0) : (step->u == 0)) {
+        *errp = "Range step must be positive";
+        return -1;
+    }
+    if (NUMLIST_IS_FLOAT(ktype) ? (first->d > last->d) :
+            NUMLIST_IS_SIGNED(ktype) ? (first->i > last->i) :
+                    (first->u > last->u)) {
+        *errp = "Range start is greater than its end";
+        return -1;
+    }
+
+    count = numlist_range_count(ktype, first, last, step);
+
+    if (count == 0 || count > (l->max_expand ? l->max_expand :
+                               CLIOPTS_NUMLIST_MAX_EXPAND)) {
+        size_t nalloc = l->nranges_alloc;
+        char *rp;
+        /* The positions first, so that they never have less room than
+         * the ranges */
+        if (numlist_reserve((void **)&l->range_pos, &nalloc, l->nranges, 1,
+                            sizeof(*l->range_pos)) != 0 ||
+                numlist_reserve(&l->ranges, &l->nranges_alloc, l->nranges, 1,
+                                elsize * 3) != 0) {
+            *errp = "Out of memory";
+            return -1;
+        }
+        l->range_pos[l->nranges] = l->nvalues;
+        rp = (char *)l->ranges + (l->nranges++ * elsize * 3);
+        numlist_store(rp, 0, ktype, first);
+        numlist_store(rp, 1, ktype, last);
+        numlist_store(rp, 2, ktype, step);
+        return 0;
+    }
+
+    if (count == 0 || numlist_reserve(&l->values, &l->nalloc, l->nvalues,
+                                      count, elsize) != 0) {
+        *errp = "Range too large";
+        return -1;
+    }
+
+    for (ii = 0; ii < count; ii++) {
+        numval cur;
+        if (NUMLIST_IS_FLOAT(ktype)) {
+            cur.d = first->d + step->d * ii;
+        } else if (NUMLIST_IS_SIGNED(ktype)) {
+            cur.i = first->i + step->i * (long)ii;
+        } else {
+            cur.u = first->u + step->u * ii;
+        }
+        numlist_store(l->values, l->nvalues++, ktype, &cur);
+    }
+    return 0;
+}
+
+static int
+numlist_extract(const char *s, cliopts_numlist *l, int ktype, char **errp)
+{
+    size_t orig_nvalues = l->nvalues, orig_nranges = l->nranges;
+    const char *p = s;
+
+    l->generation++;
+    for (;;) {
+        numval first, last, step;
+
+        if (numlist_parse_num(&p, ktype, &first, errp) != 0) {
+            goto GT_ERR;
+        }
+
+        if (*p == '-') {
+            p++;
+            if (numlist_parse_num(&p, ktype, &last, errp) != 0) {
+                goto GT_ERR;
+            }
+            if (*p == ':') {
+                p++;
+                if (numlist_parse_num(&p, ktype, &step, errp) != 0) {
+                    goto GT_ERR;
+                }
+            } else if (NUMLIST_IS_FLOAT(ktype)) {
+                *errp = "Floating point ranges need a step (first-last:step)";
+                goto GT_ERR;
+            } else if (NUMLIST_IS_SIGNED(ktype)) {
+                step.i = 1;
+            } else {
+                step.u = 1;
+            }
+        } else {
+            last = first;
+            step = first;
+            if (NUMLIST_IS_FLOAT(ktype)) {
+                step.d = 1;
+            } else if (NUMLIST_IS_SIGNED(ktype)) {
+                step.i = 1;
+            } else {
+                step.u = 1;
+            }
+        }
+
+        if (numlist_add_range(l, ktype, &first, &last, &step, errp) != 0) {
+            goto GT_ERR;
+        }
+
+        if (*p == ',') {
+            p++;
+        } else if (*p == '\0') {
+            return 0;
+        } else {
+            *errp = "Trailing garbage";
+            goto GT_ERR;
+        }
+    }
+
+    GT_ERR:
+    /* Don't leave a partially parsed value in the list */
+    l->nvalues = orig_nvalues;
+    l->nranges = orig_nranges;
+    return -1;
+}
+
+#define NUMLIST_EXTRACTOR(fn, ktype) \
+    static int \
+    fn(const char *s, size_t n, void *dest, void *arg, char **errp) \
+    { \
+        (void)n; (void)arg; \
+        return numlist_extract(s, (cliopts_numlist *)dest, ktype, errp); \
+    }
+
+NUMLIST_EXTRACTOR(extract_int_list, CLIOPTS_ARGT_INT_LIST)
+NUMLIST_EXTRACTOR(extract_uint_list, CLIOPTS_ARGT_UINT_LIST)
+NUMLIST_EXTRACTOR(extract_ulonglong_list, CLIOPTS_ARGT_ULONGLONG_LIST)
+NUMLIST_EXTRACTOR(extract_float_list, CLIOPTS_ARGT_FLOAT_LIST)
+
+#undef NUMLIST_EXTRACTOR
+
+CLIOPTS_API
+size_t
+cliopts_numlist_count(const cliopts_numlist *l, cliopts_argtype_t ktype)
+{
+    size_t ii, count, total = l->nvalues, elsize = numlist_elsize(ktype);
+    for (ii = 0; ii < l->nranges; ii++) {
+        const char *rp = (const char *)l->ranges + ii * elsize * 3;
+        numval first, last, step;
+        numlist_load(rp, 0, ktype, &first);
+        numlist_load(rp, 1, ktype, &last);
+        numlist_load(rp, 2, ktype, &step);
+        count = numlist_range_count(ktype, &first, &last, &step);
+        if (count == 0 || total + count < total ||
+                total + count == (size_t)-1) {
+            return (size_t)-1;
+        }
+        total += count;
+    }
+    return total;
+}
+
+CLIOPTS_API
+void
+cliopts_numlist_clear(cliopts_numlist *l)
+{
+    free(l->values);
+    free(l->ranges);
+    free(l->range_pos);
+    l->values = NULL;
+    l->ranges = NULL;
+    l->range_pos = NULL;
+    l->nvalues = l->nalloc = 0;
+    l->nranges = l->nranges_alloc = 0;
+    l->generation++;
+}
+
+CLIOPTS_API
+int
+cliopts_numlist_copy(cliopts_numlist *dst, const cliopts_numlist *src,
+                     cliopts_argtype_t ktype)
+{
+    size_t elsize = numlist_elsize(ktype), nalloc = 0;
+    cliopts_numlist tmp;
+
+    memset(&tmp, 0, sizeof tmp);
+    tmp.max_expand = src->max_expand;
+    if (numlist_reserve(&tmp.values, &tmp.nalloc, 0, src->nvalues,
+                        elsize) != 0 ||
+            numlist_reserve((void **)&tmp.range_pos, &nalloc, 0,
+                            src->nranges, sizeof(*tmp.range_pos)) != 0 ||
+            numlist_reserve(&tmp.ranges, &tmp.nranges_alloc, 0,
+                            src->nranges, elsize * 3) != 0) {
+        cliopts_numlist_clear(&tmp);
+        return -1;
+    }
+    if (src->nvalues) {
+        memcpy(tmp.values, src->values, src->nvalues * elsize);
+    }
+    if (src->nranges) {
+        memcpy(tmp.ranges, src->ranges, src->nranges * 3 * elsize);
+        memcpy(tmp.range_pos, src->range_pos,
+               src->nranges * sizeof(*tmp.range_pos));
+    }
+    tmp.nvalues = src->nvalues;
+    tmp.nranges = src->nranges;
+    tmp.generation = src->generation;
+    *dst = tmp;
+    return 0;
+}
+
+static size_t
+numlist_format_num(char *buf, size_t nbuf, size_t pos, int ktype,
+                   const numval *v)
+{
+    char tmp[64];
+    if (NUMLIST_IS_FLOAT(ktype)) {
+        sprintf(tmp, "%g", v->d);
+    } else if (NUMLIST_IS_SIGNED(ktype)) {
+        sprintf(tmp, "%ld", v->i);
+    } else {
+        sprintf(tmp, "%llu", v->u);
+    }
+    return format_append(buf, nbuf, pos, tmp);
+}
+
+static void
+numlist_format(const cliopts_numlist *l, int ktype, char *buf, size_t nbuf)
+{
+    size_t ii, jj = 0, pos = format_append(buf, nbuf, 0, "");
+    size_t elsize = numlist_elsize(ktype);
+
+    /* Each range goes after the values which were given before it */
+    for (ii = 0; ii <= l->nranges; ii++) {
+        size_t end = ii < l->nranges ? l->range_pos[ii] : l->nvalues;
+        const char *rp = (const char *)l->ranges + ii * elsize * 3;
+        numval v;
+
+        for (; jj < end; jj++) {
+            numlist_load(l->values, jj, ktype, &v);
+            if (jj || ii) {
+                pos = format_append(buf, nbuf, pos, ",");
+            }
+            pos = numlist_format_num(buf, nbuf, pos, ktype, &v);
+        }
+        if (ii == l->nranges) {
+            break;
+        }
+        if (ii || jj) {
+            pos = format_append(buf, nbuf, pos, ",");
+        }
+        numlist_load(rp, 0, ktype, &v);
+        pos = numlist_format_num(buf, nbuf, pos, ktype, &v);
+        pos = format_append(buf, nbuf, pos, "-");
+        numlist_load(rp, 1, ktype, &v);
+        pos = numlist_format_num(buf, nbuf, pos, ktype, &v);
+        pos = format_append(buf, nbuf, pos, ":");
+        numlist_load(rp, 2, ktype, &v);
+        pos = numlist_format_num(buf, nbuf, pos, ktype, &v);
+    }
+}
+
+#define NUMLIST_FORMATTER(fn, ktype) \
+    static void \
+    fn(const void *dest, void *arg, char *buf, size_t nbuf) \
+    { \
+        (void)arg; \
+        numlist_format((const cliopts_numlist *)dest, ktype, buf, nbuf); \
+    }
+
+NUMLIST_FORMATTER(format_int_list, CLIOPTS_ARGT_INT_LIST)
+NUMLIST_FORMATTER(format_uint_list, CLIOPTS_ARGT_UINT_LIST)
+NUMLIST_FORMATTER(format_ulonglong_list, CLIOPTS_ARGT_ULONGLONG_LIST)
+NUMLIST_FORMATTER(format_float_list, CLIOPTS_ARGT_FLOAT_LIST)
+
+#undef NUMLIST_FORMATTER
+
+/**
+ * Maps and sets: open addressing with linear probing. Each key is stored in
+ * a single allocation along with its value ("key\0value\0").
+ */
+static size_t
+map_hash(const char *s, size_t n)
+{
+    /* FNV-1a */
+    size_t ii, h = (size_t)2166136261UL;
+    for (ii = 0; ii < n; ii++) {
+        h ^= (unsigned char)s[ii];
+        h *= (size_t)16777619UL;
+    }
+    return h;
+}
+
+static cliopts_map_slot *
+map_probe(cliopts_map_slot *slots, size_t nslots,
+          const char *key, size_t nkey, size_t hash)
+{
+    size_t pos = hash & (nslots - 1);
+    for (;; pos = (pos + 1) & (nslots - 1)) {
+        cliopts_map_slot *slot = slots + pos;
+        if (!slot->key) {
+            return slot;
+        }
+        if (slot->hash == hash && strncmp(slot->key, key, nkey) == 0 &&
+                slot->key[nkey] == '\0') {
+            return slot;
+        }
+    }
+}
+
+static int
+map_grow(cliopts_map *m)
+{
+    size_t ii, nslots = m->nslots ? m->nslots * 2 : 16;
+    cliopts_map_slot *slots = CLIOPTS_CALLOC(nslots, sizeof(*slots));
+
+    if (!slots) {
+        return -1;
+    }
+    for (ii = 0; ii < m->nslots; ii++) {
+        cliopts_map_slot *old = m->slots + ii;
+        size_t pos;
+        if (!old->key) {
+            continue;
+        }
+        for (pos = old->hash & (nslots - 1); slots[pos].key;
+                pos = (pos + 1) & (nslots - 1)) {
+        }
+        slots[pos] = *old;
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->nslots = nslots;
+    return 0;
+}
+
+static int
+map_insert(cliopts_map *m, const char *key, size_t nkey,
+           const char *value, size_t nvalue, char **errp)
+{
+    cliopts_map_slot *slot;
+    size_t hash = map_hash(key, nkey);
+    char *buf;
+
+    /* Keep the load factor at or below 1/2 */
+    if ((m->nitems + 1) * 2 > m->nslots && map_grow(m) != 0) {
+        *errp = "Out of memory";
+        return -1;
+    }
+
+    slot = map_probe(m->slots, m->nslots, key, nkey, hash);
+    if (slot->key && !value) {
+        /* Already in the set */
+        return 0;
+    }
+
+    buf = CLIOPTS_MALLOC(nkey + 1 + (value ? nvalue + 1 : 0));
+    if (!buf) {
+        *errp = "Out of memory";
+        return -1;
+    }
+    memcpy(buf, key, nkey);
+    buf[nkey] = '\0';
+    if (value) {
+        memcpy(buf + nkey + 1, value, nvalue);
+        buf[nkey + 1 + nvalue] = '\0';
+    }
+
+    if (slot->key) {
+        free((char *)slot->key);
+    } else {
+        m->nitems++;
+    }
+    slot->key = buf;
+    slot->value = value ? buf + nkey + 1 : NULL;
+    slot->hash = hash;
+    m->generation++;
+    return 0;
+}
+
+CLIOPTS_API
+const cliopts_map_slot *
+cliopts_map_find(const cliopts_map *m, const char *key)
+{
+    size_t nkey = strlen(key);
+    const cliopts_map_slot *slot;
+    if (!m->nitems) {
+        return NULL;
+    }
+    slot = map_probe(m->slots, m->nslots, key, nkey, map_hash(key, nkey));
+    return slot->key ? slot : NULL;
+}
+
+CLIOPTS_API
+const char *
+cliopts_map_get(const cliopts_map *m, const char *key)
+{
+    const cliopts_map_slot *slot = cliopts_map_find(m, key);
+    return slot ? slot->value : NULL;
+}
+
+CLIOPTS_API
+void
+cliopts_map_clear(cliopts_map *m)
+{
+    size_t ii;
+    for (ii = 0; ii < m->nslots; ii++) {
+        free((char *)m->slots[ii].key);
+    }
+    free(m->slots);
+    m->slots = NULL;
+    m->nslots = 0;
+    m->nitems = 0;
+    m->generation++;
+}
+
+CLIOPTS_API
+int
+cliopts_map_copy(cliopts_map *dst, const cliopts_map *src)
+{
+    size_t ii;
+    cliopts_map tmp;
+
+    memset(&tmp, 0, sizeof tmp);
+    if (src->nslots) {
+        tmp.slots = CLIOPTS_CALLOC(src->nslots, sizeof(*tmp.slots));
+        if (!tmp.slots) {
+            return -1;
+        }
+        tmp.nslots = src->nslots;
+    }
+    /* Same size, so each key keeps its slot */
+    for (ii = 0; ii < src->nslots; ii++) {
+        const cliopts_map_slot *from = src->slots + ii;
+        size_t nkey, nbuf;
+        char *buf;
+        if (!from->key) {
+            continue;
+        }
+        nkey = strlen(from->key) + 1;
+        nbuf = nkey + (from->value ? strlen(from->value) + 1 : 0);
+        if ((buf = CLIOPTS_MALLOC(nbuf)) == NULL) {
+            cliopts_map_clear(&tmp);
+            return -1;
+        }
+        memcpy(buf, from->key, nbuf);
+        tmp.slots[ii].key = buf;
+        tmp.slots[ii].value = from->value ? buf + nkey : NULL;
+        tmp.slots[ii].hash = from->hash;
+        tmp.nitems++;
+    }
+    tmp.generation = src->generation;
+    *dst = tmp;
+    return 0;
+}
+
+static int
+extract_set(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    (void)arg;
+    return map_insert((cliopts_map *)dest, s, n, NULL, 0, errp);
+}
+
+static int
+extract_map(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    const char *eq = memchr(s, '=', n);
+    size_t nkey = eq ? (size_t)(eq - s) : n;
+    (void)arg;
+
+    if (nkey == 0) {
+        *errp = "Expected key=value";
+        return -1;
+    }
+    if (eq) {
+        return map_insert((cliopts_map *)dest, s, nkey, eq + 1, n - nkey - 1,
+                          errp);
+    }
+    return map_insert((cliopts_map *)dest, s, nkey, "", 0, errp);
+}
+
+static void
+format_map(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_map *m = dest;
+    size_t ii, pos = format_append(buf, nbuf, 0, "");
+    int first = 1;
+    (void)arg;
+
+    for (ii = 0; ii < m->nslots; ii++) {
+        const cliopts_map_slot *slot = m->slots + ii;
+        if (!slot->key) {
+            continue;
+        }
+        if (!first) {
+            pos = format_append(buf, nbuf, pos, ", ");
+        }
+        first = 0;
+        pos = format_append(buf, nbuf, pos, "'");
+        pos = format_append(buf, nbuf, pos, slot->key);
+        if (slot->value) {
+            pos = format_append(buf, nbuf, pos, "=");
+            pos = format_append(buf, nbuf, pos, slot->value);
+        }
+        pos = format_append(buf, nbuf, pos, "'");
+    }
+}
+
+/**
+ * Enums. Choice tables are small, so lookup is a scan which only compares
+ * names of the right length. Nothing is allocated.
+ */
+static const cliopts_choice *
+enum_lookup(const cliopts_choice *choices, const char *s, size_t n)
+{
+    for (; choices && choices->name; choices++) {
+        if (choices->name[0] == s[0] && strlen(choices->name) == n &&
+                memcmp(choices->name, s, n) == 0) {
+            return choices;
+        }
+    }
+    return NULL;
+}
+
+/* Write the names of all choices, separated by 'sep' */
+static size_t
+enum_format_choices(const cliopts_choice *choices, const char *sep,
+                    char *buf, size_t nbuf)
+{
+    size_t pos = format_append(buf, nbuf, 0, "");
+    for (; choices && choices->name; choices++) {
+        if (pos) {
+            pos = format_append(buf, nbuf, pos, sep);
+        }
+        pos = format_append(buf, nbuf, pos, choices->name);
+    }
+    return pos;
+}
+
+static int
+extract_enum(const char *s, size_t n, void *dest, void *arg, char **errp)
+{
+    const cliopts_choice *choice = enum_lookup(arg, s, n);
+    if (!choice) {
+        *errp = "Not a valid choice";
+        return -1;
+    }
+    *(int *)dest = choice->value;
+    return 0;
+}
+
+static void
+format_enum(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_choice *choices = arg;
+    for (; choices && choices->name; choices++) {
+        if (choices->value == *(const int *)dest) {
+            format_append(buf, nbuf, 0, choices->name);
+            return;
+        }
+    }
+    format_int(dest, arg, buf, nbuf);
+}
+
+/**
+ * Canonical forms, for fingerprints. Integers are written as eight bytes,
+ * least significant first, and floating point numbers as text, so that
+ * equal values give the same bytes on any platform.
+ */
+#define U64(hi, lo) \
+    (((unsigned long long)(hi) << 32) | (unsigned long long)(lo))
+
+/* Copy 'n' bytes to 'pos', as far as they fit */
+static size_t
+canon_put(char *buf, size_t nbuf, size_t pos, const void *src, size_t n)
+{
+    if (pos < nbuf) {
+        memcpy(buf + pos, src, n < nbuf - pos ? n : nbuf - pos);
+    }
+    return pos + n;
+}
+
+static size_t
+canon_put_u64(char *buf, size_t nbuf, size_t pos, unsigned long long v)
+{
+    unsigned char tmp[8];
+    int ii;
+    for (ii = 0; ii < 8; ii++) {
+        tmp[ii] = (unsigned char)(v >> (ii * 8));
+    }
+    return canon_put(buf, nbuf, pos, tmp, sizeof tmp);
+}
+
+static size_t
+canon_put_double(char *buf, size_t nbuf, size_t pos, double v)
+{
+    char tmp[64];
+    /* -0 is the same setting as 0 */
+    sprintf(tmp, "%.17g", v == 0 ? 0.0 : v);
+    return canon_put(buf, nbuf, pos, tmp, strlen(tmp) + 1);
+}
+
+static unsigned long long
+hash_rotl64(unsigned long long x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long
+hash_fmix64(unsigned long long k)
+{
+    k ^= k >> 33;
+    k *= U64(0xff51afd7UL, 0xed558ccdUL);
+    k ^= k >> 33;
+    k *= U64(0xc4ceb9feUL, 0x1a85ec53UL);
+    k ^= k >> 33;
+    return k;
+}
+
+/* Read up to eight bytes, least significant first */
+static unsigned long long
+hash_load64(const unsigned char *p, size_t n)
+{
+    unsigned long long k = 0;
+    while (n--) {
+        k = (k << 8) | p[n];
+    }
+    return k;
+}
+
+/**
+ * MurmurHash3 (x64, 128 bit variant, seed 0). Blocks are read a byte at a
+ * time, so the result does not depend on alignment or byte order.
+ */
+static void
+hash128(const void *data, size_t len, unsigned long long out[2])
+{
+    const unsigned char *p = data;
+    const unsigned long long c1 = U64(0x87c37b91UL, 0x114253d5UL);
+    const unsigned long long c2 = U64(0x4cf5ad43UL, 0x2745937fUL);
+    unsigned long long h1 = 0, h2 = 0, k1, k2;
+    size_t ii, nblocks = len / 16, tail = len % 16;
+
+    for (ii = 0; ii < nblocks; ii++, p += 16) {
+        k1 = hash_load64(p, 8);
+        k2 = hash_load64(p + 8, 8);
+
+        k1 *= c1; k1 = hash_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = hash_rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729UL;
+        k2 *= c2; k2 = hash_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = hash_rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5UL;
+    }
+
+    if (tail > 8) {
+        k2 = hash_load64(p + 8, tail - 8);
+        k2 *= c2; k2 = hash_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (tail) {
+        k1 = hash_load64(p, tail > 8 ? 8 : tail);
+        k1 *= c1; k1 = hash_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (unsigned long long)len;
+    h2 ^= (unsigned long long)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = hash_fmix64(h1);
+    h2 = hash_fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+static size_t
+canon_bool(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    unsigned char c = *(const int *)dest != 0;
+    (void)arg;
+    return canon_put(buf, nbuf, 0, &c, 1);
+}
+
+static size_t
+canon_int(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    (void)arg;
+    return canon_put_u64(buf, nbuf, 0,
+                         (unsigned long long)(long)*(const int *)dest);
+}
+
+static size_t
+canon_uint(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    (void)arg;
+    return canon_put_u64(buf, nbuf, 0, *(const unsigned *)dest);
+}
+
+static size_t
+canon_ulonglong(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    (void)arg;
+    return canon_put_u64(buf, nbuf, 0, *(const unsigned long long *)dest);
+}
+
+static size_t
+canon_float(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    (void)arg;
+    return canon_put_double(buf, nbuf, 0, *(const float *)dest);
+}
+
+static size_t
+canon_longlong(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    (void)arg;
+    return canon_put_u64(buf, nbuf, 0,
+                         (unsigned long long)*(const long long *)dest);
+}
+
+static size_t
+canon_double(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    (void)arg;
+    return canon_put_double(buf, nbuf, 0, *(const double *)dest);
+}
+
+static size_t
+canon_string(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const char *s = *(char * const *)dest;
+    (void)arg;
+    /* An unset string is distinct from an empty one */
+    if (!s) {
+        return 0;
+    }
+    return canon_put(buf, nbuf, canon_put(buf, nbuf, 0, "s", 1),
+                     s, strlen(s));
+}
+
+static size_t
+canon_list(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_list *l = dest;
+    size_t ii, n, pos;
+    (void)arg;
+    pos = canon_put_u64(buf, nbuf, 0, l->nvalues);
+    for (ii = 0; ii < l->nvalues; ii++) {
+        n = strlen(l->values[ii]);
+        pos = canon_put_u64(buf, nbuf, pos, n);
+        pos = canon_put(buf, nbuf, pos, l->values[ii], n);
+    }
+    return pos;
+}
+
+static size_t
+canon_blob(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_blob *blob = dest;
+    (void)arg;
+    if (!blob->data) {
+        return 0;
+    }
+    return canon_put(buf, nbuf, canon_put(buf, nbuf, 0, "b", 1),
+                     blob->data, blob->len);
+}
+
+static size_t
+canon_strpool(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_strpool *p = dest;
+    cliopts_strpool_iter it;
+    size_t pos;
+    (void)arg;
+
+    pos = canon_put_u64(buf, nbuf, 0, p->nvalues);
+    memset(&it, 0, sizeof it);
+    while (cliopts_strpool_next(p, &it)) {
+        pos = canon_put_u64(buf, nbuf, pos, it.len);
+        pos = canon_put(buf, nbuf, pos, it.value, it.len);
+    }
+    return pos;
+}
+
+static size_t
+canon_numval(char *buf, size_t nbuf, size_t pos, int ktype, const numval *v)
+{
+    if (NUMLIST_IS_FLOAT(ktype)) {
+        return canon_put_double(buf, nbuf, pos, v->d);
+    } else if (NUMLIST_IS_SIGNED(ktype)) {
+        return canon_put_u64(buf, nbuf, pos, (unsigned long long)v->i);
+    }
+    return canon_put_u64(buf, nbuf, pos, v->u);
+}
+
+static size_t
+numlist_canonical(const cliopts_numlist *l, int ktype, char *buf, size_t nbuf)
+{
+    numval v;
+    size_t ii, pos;
+
+    pos = canon_put_u64(buf, nbuf, 0, l->nvalues);
+    for (ii = 0; ii < l->nvalues; ii++) {
+        numlist_load(l->values, ii, ktype, &v);
+        pos = canon_numval(buf, nbuf, pos, ktype, &v);
+    }
+    pos = canon_put_u64(buf, nbuf, pos, l->nranges);
+    for (ii = 0; ii < l->nranges * 3; ii++) {
+        numlist_load(l->ranges, ii, ktype, &v);
+        pos = canon_numval(buf, nbuf, pos, ktype, &v);
+        if (ii % 3 == 2) {
+            pos = canon_put_u64(buf, nbuf, pos, l->range_pos[ii / 3]);
+        }
+    }
+    return pos;
+}
+
+#define NUMLIST_CANONICAL(fn, ktype) \
+    static size_t \
+    fn(const void *dest, void *arg, char *buf, size_t nbuf) \
+    { \
+        (void)arg; \
+        return numlist_canonical((const cliopts_numlist *)dest, ktype, \
+                                 buf, nbuf); \
+    }
+
+NUMLIST_CANONICAL(canon_int_list, CLIOPTS_ARGT_INT_LIST)
+NUMLIST_CANONICAL(canon_uint_list, CLIOPTS_ARGT_UINT_LIST)
+NUMLIST_CANONICAL(canon_ulonglong_list, CLIOPTS_ARGT_ULONGLONG_LIST)
+NUMLIST_CANONICAL(canon_float_list, CLIOPTS_ARGT_FLOAT_LIST)
+
+#undef NUMLIST_CANONICAL
+
+/* Write a digest as sixteen bytes */
+static size_t
+canon_put_digest(char *buf, size_t nbuf, size_t pos,
+                 const unsigned long long h[2])
+{
+    return canon_put_u64(buf, nbuf, canon_put_u64(buf, nbuf, pos, h[0]), h[1]);
+}
+
+/**
+ * Slots are in no particular order, so each item is hashed on its own (as
+ * the digests of its key and of its value) and the digests are added up
+ */
+static size_t
+canon_map(const void *dest, void *arg, char *buf, size_t nbuf)
+{
+    const cliopts_map *m = dest;
+    unsigned long long sum[2] = { 0, 0 }, h[2];
+    char item[32];
+    size_t ii, nitem;
+    (void)arg;
+
+    for (ii = 0; ii < m->nslots; ii++) {
+        const cliopts_map_slot *slot = m->slots + ii;
+        if (!slot->key) {
+            continue;
+        }
+        hash128(slot->key, strlen(slot->key), h);
+        nitem = canon_put_digest(item, sizeof item, 0, h);
+        if (slot->value) {
+            hash128(slot->value, strlen(slot->value), h);
+            nitem = canon_put_digest(item, sizeof item, nitem, h);
+        }
+        hash128(item, nitem, h);
+        sum[0] += h[0];
+        sum[1] += h[1];
+    }
+    return canon_put_digest(buf, nbuf,
+                            canon_put_u64(buf, nbuf, 0, m->nitems), sum);
+}
+
+/**
+ * Built-in types, indexed by cliopts_argtype_t
+ */
+static const cliopts_valtype builtin_types[] = {
+    { "none", NULL, format_bool, 0,
+        canon_bool },                           /* CLIOPTS_ARGT_NONE */
+    { "int", extract_int, format_int, 0,
+        canon_int },                            /* CLIOPTS_ARGT_INT */
+    { "uint", extract_uint, format_uint, 0,
+        canon_uint },                           /* CLIOPTS_ARGT_UINT */
+    { "ulonglong", extract_ulonglong, format_ulonglong, 0,
+        canon_ulonglong },                      /* CLIOPTS_ARGT_ULONGLONG */
+    { "hex", extract_hex, format_hex, 0,
+        canon_uint },                           /* CLIOPTS_ARGT_HEX */
+    { "string", extract_string, format_string, 0,
+        canon_string },                         /* CLIOPTS_ARGT_STRING */
+    { "float", extract_float, format_float, 0,
+        canon_float },                          /* CLIOPTS_ARGT_FLOAT */
+    { "list", extract_list, format_list, CLIOPTS_VT_MULTI,
+        canon_list },                           /* CLIOPTS_ARGT_LIST */
+    { "custom", NULL, NULL },                   /* CLIOPTS_ARGT_CUSTOM */
+    { "int-list", extract_int_list, format_int_list, CLIOPTS_VT_MULTI,
+        canon_int_list },                       /* CLIOPTS_ARGT_INT_LIST */
+    { "uint-list", extract_uint_list, format_uint_list, CLIOPTS_VT_MULTI,
+        canon_uint_list },                      /* CLIOPTS_ARGT_UINT_LIST */
+    { "ulonglong-list", extract_ulonglong_list, format_ulonglong_list,
+        CLIOPTS_VT_MULTI,
+        canon_ulonglong_list },                /* CLIOPTS_ARGT_ULONGLONG_LIST */
+    { "float-list", extract_float_list, format_float_list, CLIOPTS_VT_MULTI,
+        canon_float_list },                     /* CLIOPTS_ARGT_FLOAT_LIST */
+    { "set", extract_set, format_map, CLIOPTS_VT_MULTI,
+        canon_map },                            /* CLIOPTS_ARGT_SET */
+    { "map", extract_map, format_map, CLIOPTS_VT_MULTI,
+        canon_map },                            /* CLIOPTS_ARGT_MAP */
+    { "enum", extract_enum, format_enum, 0,
+        canon_int },                            /* CLIOPTS_ARGT_ENUM */
+    { "longlong", extract_longlong, format_longlong, 0,
+        canon_longlong },                       /* CLIOPTS_ARGT_LONGLONG */
+    { "double", extract_double, format_double, 0,
+        canon_double },                         /* CLIOPTS_ARGT_DOUBLE */
+    { "size", extract_size, format_size, 0,
+        canon_ulonglong },                      /* CLIOPTS_ARGT_SIZE */
+    { "duration", extract_duration, format_duration, 0,
+        canon_ulonglong },                      /* CLIOPTS_ARGT_DURATION */
+    { "blob", extract_blob, format_blob, 0,
+        canon_blob },                           /* CLIOPTS_ARGT_BLOB */
+    { "strpool", extract_strpool, format_strpool, CLIOPTS_VT_MULTI,
+        canon_strpool }                         /* CLIOPTS_ARGT_STRPOOL */
+};
+
+/**
+ * Validation
+ */
+static int
+range_check(double val, const cliopts_range *range, char **errp)
+{
+    if (val < range->min || val > range->max) {
+        *errp = "Value out of range";
+        return -1;
+    }
+    return 0;
+}
+
+static int
+range_check_num(const numval *v, int ktype, const cliopts_range *range,
+                char **errp)
+{
+    if (NUMLIST_IS_FLOAT(ktype)) {
+        return range_check(v->d, range, errp);
+    } else if (NUMLIST_IS_SIGNED(ktype)) {
+        return range_check((double)v->i, range, errp);
+    }
+    return range_check((double)v->u, range, errp);
+}
+
+CLIOPTS_API
+int
+cliopts_validate_range(const cliopts_entry *entry, const void *dest,
+                       void *arg, char **errp)
+{
+    const cliopts_range *range = arg;
+    int ktype = entry->ktype;
+
+    switch (ktype) {
+    case CLIOPTS_ARGT_INT:
+        return range_check(*(const int *)dest, range, errp);
+    case CLIOPTS_ARGT_UINT:
+    case CLIOPTS_ARGT_HEX:
+        return range_check(*(const unsigned *)dest, range, errp);
+#ifdef ULLONG_MAX
+    case CLIOPTS_ARGT_ULONGLONG:
+    case CLIOPTS_ARGT_SIZE:
+    case CLIOPTS_ARGT_DURATION:
+        return range_check((double)*(const unsigned long long *)dest, range,
+                           errp);
+    case CLIOPTS_ARGT_LONGLONG:
+        return range_check((double)*(const long long *)dest, range, errp);
+#endif
+    case CLIOPTS_ARGT_FLOAT:
+        return range_check(*(const float *)dest, range, errp);
+    case CLIOPTS_ARGT_DOUBLE:
+        return range_check(*(const double *)dest, range, errp);
+
+    case CLIOPTS_ARGT_INT_LIST:
+    case CLIOPTS_ARGT_UINT_LIST:
+    case CLIOPTS_ARGT_ULONGLONG_LIST:
+    case CLIOPTS_ARGT_FLOAT_LIST: {
+        const cliopts_numlist *l = dest;
+        size_t ii, elsize = numlist_elsize(ktype);
+        numval v;
+
+        for (ii = 0; ii < l->nvalues; ii++) {
+            numlist_load(l->values, ii, ktype, &v);
+            if (range_check_num(&v, ktype, range, errp) != 0) {
+                return -1;
+            }
+        }
+        /* The ends of a range are enough to check all of it */
+        for (ii = 0; ii < l->nranges * 3; ii++) {
+            if (ii % 3 == 2) {
+                continue;
+            }
+            numlist_load((const char *)l->ranges + (ii / 3) * elsize * 3,
+                         ii % 3, ktype, &v);
+            if (range_check_num(&v, ktype, range, errp) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    default:
+        *errp = "Range checks are only possible for numeric options";
+        return -1;
+    }
+}
+
+/**
+ * Get the value handling for an entry: its own, if it has one, otherwise the
+ * built-in one for its type. Returns NULL for an unknown type.
+ */
+static const cliopts_valtype *
+entry_valtype(const cliopts_entry *entry)
+{
+    if (entry->vtype) {
+        return entry->vtype;
+    }
+    if ((unsigned)entry->ktype <
+            sizeof(builtin_types) / sizeof(builtin_types[0])) {
+        return builtin_types + entry->ktype;
+    }
+    return NULL;
+}
+
+/**
+ * Where an entry's value is stored. With a base structure, dest is an
+ * offset made by CLIOPTS_OFFSET()
+ */
+static void *
+entry_dest(const cliopts_entry *entry,
+           const struct cliopts_extra_settings *settings)
+{
+    if (settings && settings->base) {
+        return (char *)settings->base + ((size_t)entry->dest - 1);
+    }
+    return entry->dest;
+}
+
+/* How many times the entry at position 'pos' of the table was found */
+static int
+entry_found(const cliopts_entry *entry, size_t pos,
+            const struct cliopts_extra_settings *settings)
+{
+    if (settings && settings->found) {
+        return settings->found[pos];
+    }
+    return entry->found;
+}
+
+/**
+ * Recording of a parse, so that its effects can be repeated from the parse
+ * cache (see cliopts_parser) without parsing again.
+ */
+#define PARSE_MATCH 0
+#define PARSE_VALUE 1
+#define PARSE_REST 2
+
+struct parse_event {
+    int kind;
+    unsigned pos; /* position of the entry in the table */
+    int argidx; /* the argument holding the value */
+    const char *value;
+    size_t len;
+};
+
+struct parse_record {
+    struct parse_event *events;
+    size_t nevents;
+    size_t nalloc;
+    /* Set if an event could not be recorded */
+    int failed;
+};
+
+static void
+record_event(struct cliopts_priv *ctx, int kind, const cliopts_entry *entry,
+             const char *value, size_t len)
+{
+    struct parse_record *rec = ctx->record;
+    struct parse_event *ev;
+
+    if (!rec || rec->failed) {
+        return;
+    }
+    if (rec->nevents == rec->nalloc) {
+        size_t nalloc = rec->nalloc ? rec->nalloc * 2 : 16;
+        ev = CLIOPTS_REALLOC(rec->events, nalloc * sizeof(*ev));
+        if (!ev) {
+            rec->failed = 1;
+            return;
+        }
+        rec->events = ev;
+        rec->nalloc = nalloc;
+    }
+    ev = rec->events + rec->nevents++;
+    ev->kind = kind;
+    ev->pos = entry ? (unsigned)(entry - ctx->entries) : 0;
+    ev->argidx = ctx->argidx;
+    ev->value = value;
+    ev->len = len;
+}
+
+/* Convert a value into an entry's destination, and validate it */
+static int
+convert_value(cliopts_entry *entry, void *dest, const cliopts_valtype *vt,
+              const char *value, size_t nvalue, char **errp)
+{
+    int rv;
+
+    *errp = NULL;
+    rv = vt->extract(value, nvalue, dest, entry->vtype_arg, errp);
+    if (rv == 0 && entry->validator) {
+        rv = entry->validator(entry, dest, entry->validator_arg, errp);
+    }
+    if (rv != 0 && !*errp) {
+        *errp = "Invalid value";
+    }
+    return rv;
+}
+
+
+/**
+ * This function tries to extract a single value for an option key.
+ * If it successfully has extracted a value, it returns MODE_VALUE.
+ * If the entry takes no arguments, then the current string is a key,
+ * and it will return MODE_OPTION. On error, MODE_ERROR is set, and errp
+ * will point to a string.
+ *
+ * @param entry The current entry
+ * @param value the string which might be a value
+ * @errp a pointer which will be populated with the address of the error, if any
+ *
+ * @return a MODE_* type
+ */
+static int
+parse_value(struct cliopts_priv *ctx,
+            const char *value,
+            size_t vlen)
+{
+    cliopts_entry *entry = ctx->current;
+
+    const cliopts_valtype *vt;
+    int exret;
+    int is_option = 0;
+    STATS_TIMER(t0)
+
+    cliopt_debug("Called with %s, want=%d", value, ctx->wanted);
+
+    if (ctx->argsplit) {
+        if (vlen > 2 && strncmp(value, "--", 2) == 0) {
+            is_option = 1;
+        } else if (*value == '-') {
+            is_option = 1;
+        }
+    }
+
+    if (is_option) {
+        ctx->errstr = "Expected option. Got '-' or '--' prefixed value "
+                        "(use = if this is really a value)";
+        ctx->errnum = CLIOPTS_ERR_NEED_ARG;
+        ctx->errpos = value;
+        return MODE_ERROR;
+    }
+
+    vt = entry_valtype(entry);
+    if (!vt || !vt->extract) {
+        ctx->errstr = "Unrecognized type";
+        ctx->errnum = CLIOPTS_ERR_BAD_VALUE;
+        ctx->errpos = value;
+        copy_bounded(ctx->current_value, sizeof(ctx->current_value),
+                     value, vlen);
+        return MODE_ERROR;
+    }
+
+    if (ctx->settings->lazy && !ctx->settings->base &&
+            !(vt->flags & CLIOPTS_VT_MULTI)) {
+        entry->pending = value;
+        return WANT_OPTION;
+    }
+
+    STATS_START(ctx, t0);
+    exret = convert_value(entry, entry_dest(entry, ctx->settings), vt,
+                          value, vlen, &ctx->errstr);
+    STATS_LAP(ctx, t0, ns_convert);
+    PROBE_VALUE_CONVERT(entry, value, exret);
+
+#ifdef CLIOPTS_ENABLE_STATS
+    if (vt == builtin_types + CLIOPTS_ARGT_STRING ||
+            vt == builtin_types + CLIOPTS_ARGT_LIST) {
+        STATS_ADD(ctx, nbytes_copied, vlen);
+    }
+#endif
+
+    if (exret == 0) {
+        record_event(ctx, PARSE_VALUE, entry, value, vlen);
+        return WANT_OPTION;
+    } else {
+        ctx->errnum = CLIOPTS_ERR_BAD_VALUE;
+        ctx->errpos = value;
+        STATS_ADD(ctx, nconv_failures, 1);
+        /* Keep the value for the error message */
+        if (vlen < sizeof(ctx->current_value)) {
+            memcpy(ctx->current_value, value, vlen + 1);
+        }
+    }
+
+    return MODE_ERROR;
+}
+
+/* Whether a positional argument takes all the remaining arguments */
+static int
+positional_is_tail(const cliopts_entry *entry,
+                   const struct cliopts_extra_settings *settings)
+{
+    const cliopts_valtype *vt = entry_valtype(entry);
+    return !entry[1].dest &&
+            (settings->positional_cb || (vt && (vt->flags & CLIOPTS_VT_MULTI)));
+}
+
+/**
+ * Convert an argument which is not an option into the next positional
+ * argument. Returns MODE_RESTARGS if there are no positional arguments left
+ * to take it.
+ */
+static int
+parse_positional(struct cliopts_priv *ctx, const char *arg)
+{
+    struct cliopts_extra_settings *settings = ctx->settings;
+    cliopts_entry *entry = settings->positionals + ctx->npos;
+    const cliopts_valtype *vt;
+    void *dest;
+    int rv, tail;
+
+    if (entry->dest) {
+        ctx->npos++;
+    } else if (!ctx->npos || !positional_is_tail(entry - 1, settings)) {
+        return MODE_RESTARGS;
+    } else {
+        entry--;
+    }
+
+    tail = positional_is_tail(entry, settings);
+    dest = entry_dest(entry, settings);
+    vt = entry_valtype(entry);
+    if (!vt || !vt->extract) {
+        ctx->errstr = "Unrecognized type";
+        rv = -1;
+    } else if (tail && settings->positional_cb &&
+            (vt->flags & CLIOPTS_VT_MULTI)) {
+        /* Each value would be added to all the ones before it */
+        ctx->errstr = "Multi-valued arguments can't be passed to a callback";
+        rv = -1;
+    } else if (tail && settings->positional_cb && vt == builtin_types +
+            CLIOPTS_ARGT_STRING) {
+        /* Streamed strings are passed straight from argv */
+        char *saved = *(char **)dest;
+        *(const char **)dest = arg;
+        ctx->errstr = NULL;
+        rv = settings->positional_cb(entry, dest, ctx->argidx,
+                                     settings->positional_arg, &ctx->errstr);
+        *(char **)dest = saved;
+    } else {
+        rv = convert_value(entry, dest, vt, arg, strlen(arg), &ctx->errstr);
+        if (rv == 0 && tail && settings->positional_cb) {
+            rv = settings->positional_cb(entry, dest, ctx->argidx,
+                                         settings->positional_arg,
+                                         &ctx->errstr);
+        }
+    }
+    if (rv != 0) {
+        ctx->current = NULL;
+        ctx->errnum = CLIOPTS_ERR_BAD_VALUE;
+        ctx->errpos = arg;
+        if (!ctx->errstr) {
+            ctx->errstr = "Invalid value";
+        }
+        sprintf(ctx->current_key, "<%.64s>", entry->klong ? entry->klong : "");
+        copy_bounded(ctx->current_value, sizeof(ctx->current_value),
+                     arg, strlen(arg));
+        return MODE_ERROR;
+    }
+    entry->found++;
+    return WANT_OPTION;
+}
+
+/**
+ * Like parse_value, except for keys.
+ *
+ * @param entries all option entries
+ * @param key the current string from argv
+ * @param errp a pointer which will be populated with the address of an error
+ * string
+ *
+ * @param found_entry a pointer to be populated with the relevant entry
+ * structure
+ * @param kp a pointer which will be poplated with the address of the 'sanitized'
+ * key string
+ *
+ * @param valp if the string is actually a key-value pair (i.e. --foo=bar) then
+ * this will be populated with the address of that string
+ *
+ * @return MODE_OPTION if an option was found, MODE_VALUE if the current option
+ * is a value, or MODE_ERROR on error
+ */
+static int
+parse_option(struct cliopts_priv *ctx,
+          const char *key,
+          const struct cliopts_token *tok)
+{
+    cliopts_entry *cur = NULL;
+    size_t prefix_len = tok->prefix;
+    const char *valp = NULL;
+    size_t klen, vlen = 0;
+    STATS_TIMER(t0)
+
+    STATS_START(ctx, t0);
+    ctx->errstr = NULL;
+    ctx->prev = ctx->current;
+    ctx->current = NULL;
+
+    ctx->errpos = key;
+    cliopt_debug("Called with %s, want=%d", key, ctx->wanted);
+    if (tok->len == 0) {
+        ctx->errstr = "Got an empty string";
+        ctx->errnum = CLIOPTS_ERR_BADOPT;
+        return MODE_ERROR;
+    }
+
+    /**
+     * figure out what type of option it is..
+     * it can either be a -c, --long, or --long=value
+     */
+    if (tok->eq) {
+        valp = key + tok->eq + 1;
+        vlen = tok->len - tok->eq - 1;
+        klen = tok->eq - prefix_len;
+    } else {
+        klen = tok->len - prefix_len;
+    }
+    key += prefix_len;
+
+    GT_PARSEOPT:
+    ctx->current = NULL;
+    ctx->errpos = key;
+    ctx->current_value[0] = '\0';
+    copy_bounded(ctx->current_key, sizeof(ctx->current_key), key, klen);
+
+    if (valp) {
+        copy_bounded(ctx->current_value, sizeof(ctx->current_value),
+                     valp, vlen);
+        STATS_ADD(ctx, nbytes_copied, vlen);
+    }
+    STATS_ADD(ctx, nbytes_copied, klen);
+    STATS_LAP(ctx, t0, ns_tokenize);
+
+    if (tok->kind == TOKEN_PLAIN) {
+        if (ctx->settings->positionals) {
+            int mode = parse_positional(ctx, key - prefix_len);
+            if (mode != MODE_RESTARGS) {
+                return mode;
+            }
+        }
+        if (ctx->settings->restargs) {
+            key -= prefix_len;
+            ctx->settings->restargs[ctx->settings->nrestargs++] = key;
+            record_event(ctx, PARSE_REST, NULL, key, 0);
+            return WANT_OPTION;
+        } else if (ctx->prev && ctx->prev->ktype == CLIOPTS_ARGT_NONE) {
+            ctx->errstr = "Option does not accept a value";
+            ctx->errnum = CLIOPTS_ERR_ISSWITCH;
+        } else {
+            ctx->errstr = "Options must begin with either '-' or '--'";
+            ctx->errnum = CLIOPTS_ERR_BADOPT;
+        }
+        return MODE_ERROR;
+    }
+
+    /**
+     * --help or -?
+     */
+
+    if ( (prefix_len == 1 && *key == '?') ||
+            (prefix_len == 2 && strcmp(key, "help") == 0)) {
+        return MODE_HELP;
+    }
+
+    /**
+     * --help=json
+     */
+    if (prefix_len == 2 && valp && strcmp(ctx->current_key, "help") == 0) {
+        if (strcmp(valp, "json") == 0) {
+            return MODE_HELP_JSON;
+        }
+        ctx->errstr = "Unknown help format (only 'json' is supported)";
+        ctx->errnum = CLIOPTS_ERR_BAD_VALUE;
+        return MODE_ERROR;
+    }
+
+    /**
+     * Bare --
+     */
+    if (prefix_len == 2 && *key == '\0') {
+        if (ctx->settings->restargs) {
+
+        }
+        if (ctx->wanted == WANT_VALUE) {
+            ctx->errnum = CLIOPTS_ERR_NEED_ARG;
+            ctx->errstr = "Found bare '--', but value wanted";
+            return MODE_ERROR;
+        }
+
+        return MODE_RESTARGS;
+    }
+
+    if (ctx->chain->idx) {
+        index_lookup(ctx, prefix_len, klen);
+    } else {
+        for (cur = ctx->entries; cur->dest; cur++) {
+            int optlen;
+            if (prefix_len == 1) {
+                if (cur->kshort == ctx->current_key[0]) {
+                    ctx->current = cur;
+                    break;
+                }
+                continue;
+            }
+            /** else, prefix_len is 2 */
+            if (cur->klong == NULL ||
+                    (optlen = strlen(cur->klong) != klen) ||
+                    strncmp(cur->klong, ctx->current_key, klen) != 0) {
+
+                continue;
+            }
+
+            ctx->current = cur;
+            break;
+        }
+        ctx->pos = cur - ctx->entries;
+    }
+
+    STATS_ADD(ctx, nlookups, 1);
+    STATS_LAP(ctx, t0, ns_lookup);
+
+    if (!ctx->current) {
+        ctx->errstr = "Unknown option";
+        ctx->errnum = CLIOPTS_ERR_UNRECOGNIZED;
         return MODE_ERROR;
     }
 
-    ctx->current->found++;
-    if (ctx->current->ktype != CLIOPTS_ARGT_NONE) {
-        ctx->wanted = WANT_VALUE;
+    PROBE_OPTION_MATCH(ctx->current);
+    record_event(ctx, PARSE_MATCH, ctx->current, NULL, 0);
+    if (ctx->settings->found) {
+        ctx->settings->found[ctx->pos]++;
+    } else {
+        ctx->current->found++;
+    }
+    if (ctx->current->ktype != CLIOPTS_ARGT_NONE) {
+        ctx->wanted = WANT_VALUE;
+    }
+
+    if (valp && *valp) {
+        /* --foo=bar */
+        if (ctx->current->ktype == CLIOPTS_ARGT_NONE) {
+            ctx->errnum = CLIOPTS_ERR_ISSWITCH;
+            ctx->errstr = "Option takes no arguments";
+            ctx->errpos = valp;
+            return MODE_ERROR;
+        } else {
+            return parse_value(ctx, valp, vlen);
+        }
+    }
+
+    if (ctx->current->ktype == CLIOPTS_ARGT_NONE) {
+        *(char*)entry_dest(ctx->current, ctx->settings) = 1;
+
+        if (prefix_len == 1 && klen > 1) {
+            /**
+             * e.g. ls -lsh
+             */
+            klen--;
+            key++;
+
+            /**
+             * While we can also possibly recurse, this may be a security risk
+             * as it wouldn't take much to cause a deep recursion on the stack
+             * which will cause all sorts of nasties.
+             */
+            goto GT_PARSEOPT;
+        }
+        return WANT_OPTION;
+
+    } else if (prefix_len == 1 && klen > 1) {
+
+        /* e.g. patch -p0 */
+        ctx->wanted = WANT_VALUE;
+        return parse_value(ctx, key + 1, klen - 1);
+    }
+    return WANT_VALUE;
+}
+
+static void
+free_value(const cliopts_entry *entry, void *dest);
+
+/* Previous value of an entry, kept while a pending value is validated */
+union lazy_value {
+    int i;
+    unsigned u;
+    unsigned long long ull;
+    float f;
+    double d;
+    char *s;
+    cliopts_blob b;
+};
+
+/* Size of a built-in type which can be put back as it was, or 0 */
+static size_t
+lazy_value_size(const cliopts_entry *entry)
+{
+    if (entry->vtype) {
+        return 0;
+    }
+    switch (entry->ktype) {
+    case CLIOPTS_ARGT_INT:
+    case CLIOPTS_ARGT_ENUM:
+        return sizeof(int);
+    case CLIOPTS_ARGT_UINT:
+    case CLIOPTS_ARGT_HEX:
+        return sizeof(unsigned);
+    case CLIOPTS_ARGT_ULONGLONG:
+    case CLIOPTS_ARGT_LONGLONG:
+    case CLIOPTS_ARGT_SIZE:
+    case CLIOPTS_ARGT_DURATION:
+        return sizeof(unsigned long long);
+    case CLIOPTS_ARGT_FLOAT:
+        return sizeof(float);
+    case CLIOPTS_ARGT_DOUBLE:
+        return sizeof(double);
+    case CLIOPTS_ARGT_STRING:
+        return sizeof(char *);
+    case CLIOPTS_ARGT_BLOB:
+        return sizeof(cliopts_blob);
+    default:
+        return 0;
+    }
+}
+
+CLIOPTS_API
+int
+cliopts_entry_convert(cliopts_entry *entry, char **errp)
+{
+    const cliopts_valtype *vt;
+    union lazy_value saved;
+    size_t nsaved;
+    char *err = NULL;
+    int rv = -1;
+
+    if (!entry->pending) {
+        return 0;
+    }
+
+    vt = entry_valtype(entry);
+    if (!vt || !vt->extract) {
+        err = "Unrecognized type";
+    } else {
+        /* The parse has already succeeded, so a value which the validator
+         * rejects must not replace the previous (e.g. default) one */
+        nsaved = entry->validator ? lazy_value_size(entry) : 0;
+        if (nsaved) {
+            memcpy(&saved, entry->dest, nsaved);
+        }
+        rv = vt->extract(entry->pending, strlen(entry->pending), entry->dest,
+                         entry->vtype_arg, &err);
+        if (rv == 0 && entry->validator) {
+            rv = entry->validator(entry, entry->dest, entry->validator_arg,
+                                  &err);
+            if (rv != 0 && nsaved) {
+                free_value(entry, entry->dest);
+                memcpy(entry->dest, &saved, nsaved);
+            }
+        }
+        if (rv != 0 && !err) {
+            err = "Invalid value";
+        }
+    }
+
+    if (rv == 0) {
+        entry->pending = NULL;
+        return 0;
+    }
+    if (errp) {
+        *errp = err ? err : "Bad value";
+    }
+    return -1;
+}
+
+static char *
+get_option_name(cliopts_entry *entry, char *buf);
+
+CLIOPTS_API
+int
+cliopts_validate_all(cliopts_entry *entries,
+                     const struct cliopts_extra_settings *settings)
+{
+    cliopts_entry *cur;
+    int ret = 0;
+
+    for (cur = entries; cur->dest; cur++) {
+        char *err = NULL;
+        char entbuf[128] = { 0 };
+        const char *value = cur->pending;
+
+        if (cliopts_entry_convert(cur, &err) == 0) {
+            continue;
+        }
+        ret = -1;
+        if (!settings || settings->error_nohelp == 0) {
+            fprintf(stderr, "Bad value '%s' for %s: %s\n",
+                    value, get_option_name(cur, entbuf), err);
+        }
+    }
+    return ret;
+}
+
+static void
+free_value(const cliopts_entry *entry, void *dest)
+{
+    if (entry->vtype) {
+        return;
+    }
+    switch (entry->ktype) {
+    case CLIOPTS_ARGT_STRING:
+        free(*(char **)dest);
+        *(char **)dest = NULL;
+        break;
+    case CLIOPTS_ARGT_LIST:
+        cliopts_list_clear(dest);
+        break;
+    case CLIOPTS_ARGT_INT_LIST:
+    case CLIOPTS_ARGT_UINT_LIST:
+    case CLIOPTS_ARGT_ULONGLONG_LIST:
+    case CLIOPTS_ARGT_FLOAT_LIST:
+        cliopts_numlist_clear(dest);
+        break;
+    case CLIOPTS_ARGT_SET:
+    case CLIOPTS_ARGT_MAP:
+        cliopts_map_clear(dest);
+        break;
+    case CLIOPTS_ARGT_BLOB:
+        cliopts_blob_clear(dest);
+        break;
+    case CLIOPTS_ARGT_STRPOOL:
+        cliopts_strpool_clear(dest);
+        break;
+    default:
+        break;
+    }
+}
+
+CLIOPTS_API
+void
+cliopts_free_values(cliopts_entry *entries,
+                    const struct cliopts_extra_settings *settings)
+{
+    cliopts_entry *cur;
+    size_t ii;
+
+    for (ii = 0, cur = entries; cur->dest; cur++, ii++) {
+        /* Pending values were never converted, so own nothing */
+        if (entry_found(cur, ii, settings) && !cur->pending) {
+            free_value(cur, entry_dest(cur, settings));
+        }
+    }
+    if (!settings || !settings->positionals) {
+        return;
+    }
+    for (cur = settings->positionals; cur->dest; cur++) {
+        /* Streamed strings were never copied */
+        if (!cur->found || (cur->ktype == CLIOPTS_ARGT_STRING &&
+                positional_is_tail(cur, settings))) {
+            continue;
+        }
+        free_value(cur, entry_dest(cur, settings));
+    }
+}
+
+static char *
+get_option_name(cliopts_entry *entry, char *buf)
+{
+    /* [-s,--option] */
+    char *bufp = buf;
+    bufp += sprintf(buf, "[");
+    if (entry->kshort) {
+        bufp += sprintf(bufp, "-%c", entry->kshort);
+    }
+    if (entry->klong) {
+        if (entry->kshort) {
+            bufp += sprintf(bufp, ",");
+        }
+        bufp += sprintf(bufp, "--%s", entry->klong);
+    }
+    sprintf(bufp, "]");
+    return buf;
+}
+
+static int get_terminal_width(void)
+{
+#ifndef _WIN32
+    struct winsize max;
+    if (ioctl(0, TIOCGWINSZ, &max) != -1) {
+        return max.ws_col;
+    } else {
+        return 80;
+    }
+#else
+    CONSOLE_SCREEN_BUFFER_INFO cbsi;
+    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &cbsi);
+    return cbsi.srWindow.Right - cbsi.srWindow.Left;
+#endif
+}
+
+static char*
+format_option_help(cliopts_entry *entry,
+                   char *buf,
+                   struct cliopts_extra_settings *settings)
+{
+    char *bufp = buf;
+    if (entry->kshort) {
+        bufp += sprintf(bufp, " -%c ", entry->kshort);
+    }
+
+#define _advance_margin(offset) \
+    while(bufp-buf < offset || *bufp) { \
+        if (!*bufp) { \
+            *bufp = ' '; \
+        } \
+        bufp++; \
+    }
+
+    _advance_margin(4)
+
+    if (entry->klong) {
+        bufp += sprintf(bufp, " --%s ", entry->klong);
+    }
+
+    if (entry->vdesc) {
+        bufp += sprintf(bufp, " <%s> ", entry->vdesc);
+    } else if (entry->ktype == CLIOPTS_ARGT_ENUM && !entry->vtype) {
+        char choicebuf[256];
+        enum_format_choices(entry->vtype_arg, "|", choicebuf,
+                            sizeof(choicebuf));
+        bufp += sprintf(bufp, " <%s> ", choicebuf);
+    }
+
+    _advance_margin(35)
+#undef _advance_margin
+
+    if (entry->help) {
+        unsigned initial_indent = bufp - buf + 1;
+        int curpos = initial_indent;
+        const char *help_p = entry->help;
+
+        for (; *help_p; help_p++, curpos++, bufp++) {
+
+            if (curpos >= settings->line_max) {
+                unsigned ii;
+                if (!isspace(*help_p) && !isspace(*(help_p-1))) {
+                    *bufp = '-';
+                    bufp++;
+                }
+                *bufp = '\n';
+                bufp++;
+
+                for (ii = 0; ii < initial_indent+1; ii++, bufp++) {
+                    *bufp = ' ';
+                }
+
+                curpos = initial_indent;
+                if (isspace(*help_p)) {
+                    bufp--;
+                    continue;
+                }
+            }
+            *bufp = *help_p;
+        }
+    }
+
+    *bufp = '\0';
+    return buf;
+}
+
+static void
+print_default(cliopts_entry *entry, struct cliopts_extra_settings *settings)
+{
+    const cliopts_valtype *vt = entry_valtype(entry);
+    char defbuf[1024];
+
+    if (!settings->show_defaults || !vt || !vt->format) {
+        return;
+    }
+    defbuf[0] = '\0';
+    vt->format(entry_dest(entry, settings), entry->vtype_arg, defbuf,
+               sizeof(defbuf));
+    if (defbuf[0]) {
+        fprintf(stderr, " [Default=%s]", defbuf);
+    }
+}
+
+static void
+print_help(struct cliopts_priv *ctx, struct cliopts_extra_settings *settings)
+{
+    cliopts_entry *cur;
+    size_t ii;
+    cliopts_entry helpent = { 0 };
+    char helpbuf[1024] = { 0 };
+
+    helpent.klong = "help";
+    helpent.kshort = '?';
+    helpent.help = "this message";
+
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s %s", settings->progname, settings->argstring);
+
+    if (settings->argstring_restargs) {
+        fprintf(stderr, " %s", settings->argstring_restargs);
+    } else if (settings->positionals) {
+        for (cur = settings->positionals; cur->dest; cur++) {
+            fprintf(stderr, cur->required ? " <%s>%s" : " [<%s>%s]",
+                    cur->klong ? cur->klong : "",
+                    positional_is_tail(cur, settings) ? "..." : "");
+        }
+    }
+
+    fprintf(stderr, "\n\n");
+    if (settings->shortdesc) {
+        fprintf(stderr, "%s", settings->shortdesc);
+        fprintf(stderr, "\n");
+    }
+
+    if (settings->positionals) {
+        fprintf(stderr, "Arguments:\n");
+        for (cur = settings->positionals; cur->dest; cur++) {
+            /* Shown as the value of an option without a name */
+            cliopts_entry posent = { 0 };
+            posent.vdesc = cur->klong ? cur->klong : "";
+            posent.help = cur->help;
+
+            memset(helpbuf, 0, sizeof(helpbuf));
+            format_option_help(&posent, helpbuf, settings);
+            fprintf(stderr, INDENT "%s", helpbuf);
+            if (!cur->required && !positional_is_tail(cur, settings)) {
+                print_default(cur, settings);
+            }
+            fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "\nOptions:\n");
+    }
+
+
+    for (ii = 0; ii < ctx->chain->ntables; ii++) {
+        const cliopts_table *table = ctx->chain->tables + ii;
+        /* A blank line between tables, and after the last one */
+        if (ii) {
+            fprintf(stderr, "\n");
+        }
+        if (table->title) {
+            fprintf(stderr, "%s:\n", table->title);
+        }
+
+        for (cur = table->entries; cur->dest; cur++) {
+            if (cur->hidden) {
+                continue;
+            }
+
+            memset(helpbuf, 0, sizeof(helpbuf));
+            format_option_help(cur, helpbuf, settings);
+            fprintf(stderr, INDENT "%s", helpbuf);
+
+
+            if (!cur->required) {
+                print_default(cur, settings);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+    if (ctx->chain->ntables > 1) {
+        fprintf(stderr, "\n");
+    }
+    memset(helpbuf, 0, sizeof(helpbuf));
+    fprintf(stderr, INDENT "%s\n",
+            format_option_help(&helpent, helpbuf, settings));
+
+}
+
+static void
+dump_error(struct cliopts_priv *ctx)
+{
+    fprintf(stderr, "Couldn't parse options: %s\n", ctx->errstr);
+    if (ctx->errnum == CLIOPTS_ERR_BADOPT) {
+        fprintf(stderr, "Bad option: %s", ctx->current_key);
+    } else if (ctx->errnum == CLIOPTS_ERR_BAD_VALUE) {
+        fprintf(stderr, "Bad value '%s' for %s",
+                ctx->current_value,
+                ctx->current_key);
+        if (ctx->current && ctx->current->ktype == CLIOPTS_ARGT_ENUM &&
+                !ctx->current->vtype) {
+            char choicebuf[1024];
+            enum_format_choices(ctx->current->vtype_arg, ", ", choicebuf,
+                                sizeof(choicebuf));
+            fprintf(stderr, "\nValid values are: %s", choicebuf);
+        }
+    } else if (ctx->errnum == CLIOPTS_ERR_UNRECOGNIZED) {
+        fprintf(stderr, "No such option: %s", ctx->current_key);
+    } else if (ctx->errnum == CLIOPTS_ERR_ISSWITCH) {
+        char optbuf[64] = { 0 };
+        fprintf(stderr, "Option %s takes no arguments",
+                get_option_name(ctx->current ? ctx->current : ctx->prev,
+                                optbuf));
+    }
+    fprintf(stderr, "\n");
+
+}
+
+/**
+ * Error lists (settings->errors). The parser records each error and
+ * carries on; the whole list is rendered at once at the end.
+ */
+static char *
+error_strdup(const char *s)
+{
+    char *cp;
+    if (!s) {
+        return NULL;
+    }
+    cp = CLIOPTS_MALLOC(strlen(s) + 1);
+    if (cp) {
+        strcpy(cp, s);
+    }
+    return cp;
+}
+
+static void
+error_add(cliopts_error_list *errs, int argidx, size_t offset,
+          cliopts_errcode code, const char *option, const char *value,
+          const char *message)
+{
+    cliopts_error *err;
+
+    if (errs->nerrors == errs->nalloc) {
+        size_t nalloc = errs->nalloc ? errs->nalloc * 2 : 8;
+        cliopts_error *tmp =
+                CLIOPTS_REALLOC(errs->errors, nalloc * sizeof(*tmp));
+        if (!tmp) {
+            return;
+        }
+        errs->errors = tmp;
+        errs->nalloc = nalloc;
+    }
+    err = errs->errors + errs->nerrors++;
+    err->argidx = argidx;
+    err->offset = offset;
+    err->code = code;
+    err->option = error_strdup(option);
+    err->value = error_strdup(value);
+    err->message = message;
+}
+
+/* Record the parser's current error, found in argument 'argidx' */
+static void
+error_add_current(struct cliopts_priv *ctx, int argidx, const char *arg,
+                  const struct cliopts_token *tok)
+{
+    char namebuf[4096 + 2];
+    const char *option = namebuf, *value = NULL;
+    cliopts_entry *ent = NULL;
+
+    switch (ctx->errnum) {
+    case CLIOPTS_ERR_BAD_VALUE:
+        /* Positional arguments have no entry */
+        ent = ctx->current;
+        option = ctx->current_key;
+        value = ctx->current_value;
+        break;
+    case CLIOPTS_ERR_ISSWITCH:
+        ent = ctx->current ? ctx->current : ctx->prev;
+        break;
+    case CLIOPTS_ERR_NEED_ARG:
+        ent = ctx->current;
+        break;
+    case CLIOPTS_ERR_UNRECOGNIZED:
+        strcpy(namebuf, tok->kind == TOKEN_SHORT ? "-" : "--");
+        strcat(namebuf, ctx->current_key);
+        break;
+    default:
+        option = arg;
+        break;
+    }
+    if (ent) {
+        option = get_option_name(ent, namebuf);
+    }
+    error_add(ctx->settings->errors, argidx,
+              ctx->errpos ? (size_t)(ctx->errpos - arg) : 0, ctx->errnum,
+              option, value, ctx->errstr);
+}
+
+static size_t
+error_append(char *buf, size_t nbuf, size_t pos, const char *s)
+{
+    return format_append(buf, nbuf, pos, s ? s : "");
+}
+
+/* Describe an error on one line */
+static size_t
+error_format(const cliopts_error *err, char *buf, size_t nbuf, size_t pos)
+{
+    if (err->argidx >= 0) {
+        char posbuf[64];
+        sprintf(posbuf, "argv[%d], offset %lu: ", err->argidx,
+                (unsigned long)err->offset);
+        pos = error_append(buf, nbuf, pos, posbuf);
+    }
+
+    switch (err->code) {
+    case CLIOPTS_ERR_BAD_VALUE:
+        pos = error_append(buf, nbuf, pos, "Bad value '");
+        pos = error_append(buf, nbuf, pos, err->value);
+        pos = error_append(buf, nbuf, pos, "' for ");
+        pos = error_append(buf, nbuf, pos, err->option);
+        pos = error_append(buf, nbuf, pos, ": ");
+        pos = error_append(buf, nbuf, pos, err->message);
+        break;
+    case CLIOPTS_ERR_UNRECOGNIZED:
+        pos = error_append(buf, nbuf, pos, "No such option: ");
+        pos = error_append(buf, nbuf, pos, err->option);
+        break;
+    case CLIOPTS_ERR_ISSWITCH:
+        pos = error_append(buf, nbuf, pos, "Option ");
+        pos = error_append(buf, nbuf, pos, err->option);
+        pos = error_append(buf, nbuf, pos, " takes no arguments");
+        break;
+    case CLIOPTS_ERR_MISSING:
+        pos = error_append(buf, nbuf, pos, "Required option ");
+        pos = error_append(buf, nbuf, pos, err->option);
+        pos = error_append(buf, nbuf, pos, " missing");
+        break;
+    case CLIOPTS_ERR_CONSTRAINT:
+    case CLIOPTS_ERR_DUPLICATE:
+        if (err->value) {
+            /* e.g. Option --foo also requires: --bar */
+            pos = error_append(buf, nbuf, pos, "Option ");
+            pos = error_append(buf, nbuf, pos, err->option);
+            pos = error_append(buf, nbuf, pos, " ");
+            pos = error_append(buf, nbuf, pos, err->message);
+            pos = error_append(buf, nbuf, pos, ": ");
+            pos = error_append(buf, nbuf, pos, err->value);
+        } else if (err->option) {
+            pos = error_append(buf, nbuf, pos, err->message);
+            pos = error_append(buf, nbuf, pos, ": ");
+            pos = error_append(buf, nbuf, pos, err->option);
+        } else {
+            pos = error_append(buf, nbuf, pos, err->message);
+        }
+        break;
+    default:
+        pos = error_append(buf, nbuf, pos, err->message);
+        if (err->option) {
+            pos = error_append(buf, nbuf, pos, " (");
+            pos = error_append(buf, nbuf, pos, err->option);
+            pos = error_append(buf, nbuf, pos, ")");
+        }
+        break;
+    }
+    return pos;
+}
+
+CLIOPTS_API
+void
+cliopts_errors_print(const cliopts_error_list *errs, FILE *fp)
+{
+    size_t ii, pos, nbuf = 128;
+    char *buf;
+
+    if (!errs->nerrors) {
+        return;
+    }
+    for (ii = 0; ii < errs->nerrors; ii++) {
+        const cliopts_error *err = errs->errors + ii;
+        nbuf += 128 + strlen(err->message ? err->message : "") +
+                strlen(err->option ? err->option : "") +
+                strlen(err->value ? err->value : "");
+    }
+    buf = CLIOPTS_MALLOC(nbuf);
+    if (!buf) {
+        return;
+    }
+
+    sprintf(buf, "Couldn't parse options: %lu error%s\n",
+            (unsigned long)errs->nerrors, errs->nerrors == 1 ? "" : "s");
+    pos = strlen(buf);
+    for (ii = 0; ii < errs->nerrors; ii++) {
+        pos = format_append(buf, nbuf, pos, INDENT);
+        pos = error_format(errs->errors + ii, buf, nbuf, pos);
+        pos = format_append(buf, nbuf, pos, "\n");
+    }
+    fwrite(buf, 1, pos, fp);
+    free(buf);
+}
+
+CLIOPTS_API
+void
+cliopts_errors_clear(cliopts_error_list *errs)
+{
+    size_t ii;
+    for (ii = 0; ii < errs->nerrors; ii++) {
+        free(errs->errors[ii].option);
+        free(errs->errors[ii].value);
+    }
+    free(errs->errors);
+    errs->errors = NULL;
+    errs->nerrors = errs->nalloc = 0;
+}
+
+/**
+ * Lookup index. Long names are kept sorted for prefix lookups, which are a
+ * binary search, and hashed for exact ones; short names are a direct table.
+ */
+struct cliopts_index_slot {
+    const char *name;
+    cliopts_entry *entry;
+    unsigned ord;
+};
+
+struct cliopts_index_st {
+    cliopts_entry **all;
+    size_t nall;
+
+    struct cliopts_index_slot *bylong;
+    size_t nlong;
+    /* Positions in bylong plus one (0 for an empty bucket) */
+    unsigned *buckets;
+    size_t hmask;
+
+    cliopts_entry *byshort[256];
+    /* Positions of the entries in byshort */
+    unsigned shortord[256];
+};
+
+static int
+index_slot_cmp(const void *a, const void *b)
+{
+    const struct cliopts_index_slot *sa = a, *sb = b;
+    int rv = strcmp(sa->name, sb->name);
+    if (rv) {
+        return rv;
+    }
+    return sa->ord < sb->ord ? -1 : (sa->ord > sb->ord);
+}
+
+/* FNV-1a of the first 'len' bytes of a long name */
+static size_t
+index_hash(const char *name, size_t len)
+{
+    size_t h = (size_t)2166136261UL;
+    for (; len; len--, name++) {
+        h ^= (unsigned char)*name;
+        h *= (size_t)16777619UL;
+    }
+    return h;
+}
+
+/*
+ * Hash the sorted long names, with linear probing in a table at most half
+ * full. Of several entries with the same name, the first is kept, as a
+ * binary search would find it.
+ */
+static int
+index_hash_build(cliopts_index *idx)
+{
+    size_t ii, nbuckets, pos;
+
+    for (nbuckets = 8; nbuckets < idx->nlong * 2; nbuckets *= 2) {
+    }
+    idx->buckets = CLIOPTS_CALLOC(nbuckets, sizeof(*idx->buckets));
+    if (!idx->buckets) {
+        return -1;
+    }
+    idx->hmask = nbuckets - 1;
+    for (ii = 0; ii < idx->nlong; ii++) {
+        const char *name = idx->bylong[ii].name;
+        pos = index_hash(name, strlen(name)) & idx->hmask;
+        while (idx->buckets[pos] &&
+                strcmp(idx->bylong[idx->buckets[pos] - 1].name, name) != 0) {
+            pos = (pos + 1) & idx->hmask;
+        }
+        if (!idx->buckets[pos]) {
+            idx->buckets[pos] = (unsigned)ii + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Build an index. If 'order' is given, it lists the positions of the
+ * entries with long names in sorted order (as computed by an earlier
+ * build), and sorting is skipped.
+ */
+static cliopts_index *
+index_build(cliopts_entry *entries, const unsigned *order, size_t norder)
+{
+    cliopts_index *idx;
+    cliopts_entry *cur;
+    size_t ii, nents = 0;
+
+    for (cur = entries; cur->dest; cur++) {
+        nents++;
+    }
+
+    idx = CLIOPTS_CALLOC(1, sizeof(*idx));
+    if (!idx) {
+        return NULL;
+    }
+    idx->all = CLIOPTS_MALLOC(sizeof(*idx->all) * (nents + 1));
+    idx->bylong = CLIOPTS_MALLOC(sizeof(*idx->bylong) * (nents + 1));
+    if (!idx->all || !idx->bylong) {
+        cliopts_index_free(idx);
+        return NULL;
+    }
+
+    for (ii = 0; ii < nents; ii++) {
+        cur = entries + ii;
+        idx->all[idx->nall++] = cur;
+        if (cur->kshort && !idx->byshort[(unsigned char)cur->kshort]) {
+            idx->byshort[(unsigned char)cur->kshort] = cur;
+            idx->shortord[(unsigned char)cur->kshort] = (unsigned)ii;
+        }
+        if (cur->klong && !order) {
+            struct cliopts_index_slot *slot = idx->bylong + idx->nlong++;
+            slot->name = cur->klong;
+            slot->entry = cur;
+            slot->ord = ii;
+        }
+    }
+
+    if (!order) {
+        qsort(idx->bylong, idx->nlong, sizeof(*idx->bylong), index_slot_cmp);
+    }
+    for (ii = 0; order && ii < norder; ii++) {
+        struct cliopts_index_slot *slot = idx->bylong + idx->nlong++;
+        slot->entry = entries + order[ii];
+        slot->name = slot->entry->klong;
+        slot->ord = order[ii];
+    }
+    if (index_hash_build(idx) != 0) {
+        cliopts_index_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+CLIOPTS_API
+cliopts_index *
+cliopts_index_create(cliopts_entry *entries)
+{
+    return index_build(entries, NULL, 0);
+}
+
+CLIOPTS_API
+void
+cliopts_index_free(cliopts_index *idx)
+{
+    if (!idx) {
+        return;
+    }
+    free(idx->all);
+    free(idx->bylong);
+    free(idx->buckets);
+    free(idx);
+}
+
+/**
+ * Find the first long-name slot which is not less than the first @c len
+ * bytes of @c name. Returns idx->nlong if there is none.
+ */
+static size_t
+index_lower_bound(const cliopts_index *idx, const char *name, size_t len)
+{
+    size_t lo = 0, hi = idx->nlong;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(idx->bylong[mid].name, name, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static const struct cliopts_index_slot *
+index_find_long_slot(const cliopts_index *idx, const char *name, size_t len)
+{
+    size_t pos = index_hash(name, len) & idx->hmask;
+    unsigned found;
+
+    while ((found = idx->buckets[pos]) != 0) {
+        const struct cliopts_index_slot *slot = idx->bylong + found - 1;
+        if (strncmp(slot->name, name, len) == 0 && slot->name[len] == '\0') {
+            return slot;
+        }
+        pos = (pos + 1) & idx->hmask;
+    }
+    return NULL;
+}
+
+static cliopts_entry *
+index_find_long(const cliopts_index *idx, const char *name, size_t len)
+{
+    const struct cliopts_index_slot *slot =
+            index_find_long_slot(idx, name, len);
+    return slot ? slot->entry : NULL;
+}
+
+CLIOPTS_API
+cliopts_entry *
+cliopts_index_find(const cliopts_index *idx, const char *name)
+{
+    size_t len = strlen(name);
+    const struct cliopts_index_slot *slot =
+            index_find_long_slot(idx, name, len);
+
+    if (slot) {
+        return slot->entry;
+    }
+    if (len == 1) {
+        return idx->byshort[(unsigned char)*name];
+    }
+    return NULL;
+}
+
+CLIOPTS_API
+int
+cliopts_handle_resolve(const cliopts_index *idx, const char *name, int ktype,
+                       const struct cliopts_extra_settings *settings,
+                       cliopts_handle *handle, char **errp)
+{
+    cliopts_entry *entry = cliopts_index_find(idx, name);
+
+    handle->entry = NULL;
+    handle->dest = NULL;
+    if (!entry) {
+        *errp = "No such option";
+        return -1;
+    }
+    /* An entry with a vtype of its own (e.g. a C++ StringOption) does not
+     * store the C type which its ktype implies */
+    if (ktype != -1 && ((int)entry->ktype != ktype ||
+            (ktype != CLIOPTS_ARGT_CUSTOM && entry->vtype &&
+             entry->vtype != builtin_types + ktype))) {
+        *errp = "Option is of a different type";
+        return -1;
+    }
+    /* So that the value can then be read directly */
+    if (cliopts_entry_convert(entry, errp) != 0) {
+        return -1;
+    }
+    handle->entry = entry;
+    handle->dest = entry_dest(entry, settings);
+    return 0;
+}
+
+/* Look up the parser's current key in the index of its chain */
+static void
+index_lookup(struct cliopts_priv *ctx, int prefix_len, size_t klen)
+{
+    const cliopts_index *idx = ctx->chain->idx;
+
+    if (prefix_len == 1) {
+        unsigned char c = (unsigned char)ctx->current_key[0];
+        ctx->current = idx->byshort[c];
+        ctx->pos = idx->shortord[c];
+    } else {
+        const struct cliopts_index_slot *slot =
+                index_find_long_slot(idx, ctx->current_key, klen);
+        if (slot) {
+            ctx->current = slot->entry;
+            ctx->pos = slot->ord;
+        }
+    }
+}
+
+/**
+ * Completion
+ */
+
+static void
+complete_emit(FILE *fp, cliopts_shell_t shell, const char *prefix,
+              const char *word, const char *desc)
+{
+    if (prefix) {
+        fputs(prefix, fp);
+    }
+    fputs(word, fp);
+
+    if (desc && shell != CLIOPTS_SHELL_BASH) {
+        const char *p;
+        fputc(shell == CLIOPTS_SHELL_ZSH ? ':' : '\t', fp);
+        for (p = desc; *p; p++) {
+            fputc(*p == '\n' || *p == '\t' ? ' ' : *p, fp);
+        }
+    }
+    fputc('\n', fp);
+}
+
+static int
+complete_value(const cliopts_index *idx, cliopts_entry *entry,
+               const char *prefix, const char *partial,
+               cliopts_shell_t shell, FILE *fp)
+{
+    const cliopts_choice *choice;
+    size_t plen = strlen(partial);
+    int ncands = 0;
+    (void)idx;
+
+    if (entry->ktype != CLIOPTS_ARGT_ENUM || entry->vtype) {
+        /* Free-form values; leave these to the shell's default completion */
+        return 0;
+    }
+
+    for (choice = entry->vtype_arg; choice && choice->name; choice++) {
+        if (strncmp(choice->name, partial, plen) == 0) {
+            complete_emit(fp, shell, prefix, choice->name, NULL);
+            ncands++;
+        }
+    }
+    return ncands;
+}
+
+static cliopts_entry *
+complete_lookup_word(const cliopts_index *idx, const char *word)
+{
+    if (word[0] != '-') {
+        return NULL;
+    }
+    if (word[1] == '-') {
+        if (strchr(word, '=')) {
+            return NULL;
+        }
+        return index_find_long(idx, word + 2, strlen(word + 2));
+    }
+    /* Only a trailing value-taking short switch wants the next word. -abc
+     * would have consumed 'bc' as the value of 'a' */
+    if (word[1] && word[2] == '\0') {
+        return idx->byshort[(unsigned char)word[1]];
+    }
+    return NULL;
+}
+
+CLIOPTS_API
+int
+cliopts_complete(const cliopts_index *idx, int argc, char **argv,
+                 cliopts_shell_t shell, FILE *fp)
+{
+    const char *word;
+    cliopts_entry *prev = NULL;
+    int ii, ncands = 0;
+
+    if (argc < 1) {
+        word = "";
+    } else {
+        word = argv[argc-1];
+    }
+
+    for (ii = 0; ii < argc - 1; ii++) {
+        if (strcmp(argv[ii], "--") == 0) {
+            return 0;
+        }
+    }
+
+    if (argc > 1) {
+        prev = complete_lookup_word(idx, argv[argc-2]);
+        if (prev && prev->ktype != CLIOPTS_ARGT_NONE) {
+            return complete_value(idx, prev, NULL, word, shell, fp);
+        }
+    }
+
+    if (word[0] != '-') {
+        return 0;
+    }
+
+    if (word[1] == '-') {
+        const char *name = word + 2;
+        const char *eq = strchr(name, '=');
+        size_t pos, nlen;
+
+        if (eq) {
+            cliopts_entry *ent = index_find_long(idx, name, eq - name);
+            char prefix[256];
+            if (!ent || (size_t)(eq - word) >= sizeof(prefix) - 1) {
+                return 0;
+            }
+            memcpy(prefix, word, eq - word + 1);
+            prefix[eq - word + 1] = '\0';
+            return complete_value(idx, ent, prefix, eq + 1, shell, fp);
+        }
+
+        nlen = strlen(name);
+        for (pos = index_lower_bound(idx, name, nlen); pos < idx->nlong; pos++) {
+            const struct cliopts_index_slot *slot = idx->bylong + pos;
+            if (strncmp(slot->name, name, nlen) != 0) {
+                break;
+            }
+            if (slot->entry->hidden) {
+                continue;
+            }
+            complete_emit(fp, shell, "--", slot->name, slot->entry->help);
+            ncands++;
+        }
+        if (nlen == 0 || strncmp("help", name, nlen) == 0) {
+            complete_emit(fp, shell, "--", "help", "this message");
+            ncands++;
+        }
+        return ncands;
+    }
+
+    if (word[1] == '\0') {
+        /* A lone '-': offer the short switches */
+        size_t jj;
+        for (jj = 0; jj < idx->nall; jj++) {
+            char sbuf[3];
+            cliopts_entry *ent = idx->all[jj];
+            if (!ent->kshort || ent->hidden ||
+                    idx->byshort[(unsigned char)ent->kshort] != ent) {
+                continue;
+            }
+            sbuf[0] = '-';
+            sbuf[1] = ent->kshort;
+            sbuf[2] = '\0';
+            complete_emit(fp, shell, NULL, sbuf, ent->help);
+            ncands++;
+        }
+    }
+    return ncands;
+}
+
+static void
+script_quote(FILE *fp, const char *s, const char *escapes)
+{
+    for (; s && *s; s++) {
+        if (*s == '\'' && !(escapes && strchr(escapes, '\''))) {
+            /* POSIX shells cannot escape inside single quotes */
+            fputs("'\\''", fp);
+        } else if (*s == '\n' || *s == '\t') {
+            fputc(' ', fp);
+        } else {
+            if (escapes && strchr(escapes, *s)) {
+                fputc('\\', fp);
+            }
+            fputc(*s, fp);
+        }
+    }
+}
+
+static void
+script_funcname(FILE *fp, const char *progname)
+{
+    for (; *progname; progname++) {
+        fputc(isalnum((unsigned char)*progname) ? *progname : '_', fp);
+    }
+}
+
+CLIOPTS_API
+void
+cliopts_completion_script(const cliopts_index *idx, const char *progname,
+                          cliopts_shell_t shell, FILE *fp)
+{
+    size_t ii;
+
+    if (shell == CLIOPTS_SHELL_BASH) {
+        fputs("_cliopts_", fp);
+        script_funcname(fp, progname);
+        fputs("()\n{\n"
+              "    local cur prev\n"
+              "    cur=\"${COMP_WORDS[COMP_CWORD]}\"\n"
+              "    prev=\"${COMP_WORDS[COMP_CWORD-1]}\"\n"
+              "    case \"$prev\" in\n", fp);
+
+        for (ii = 0; ii < idx->nall; ii++) {
+            cliopts_entry *ent = idx->all[ii];
+            if (ent->ktype == CLIOPTS_ARGT_NONE) {
+                continue;
+            }
+            fputs("    ", fp);
+            if (ent->kshort) {
+                fprintf(fp, "-%c", ent->kshort);
+            }
+            if (ent->klong) {
+                fprintf(fp, "%s--%s", ent->kshort ? "|" : "", ent->klong);
+            }
+            if (ent->ktype == CLIOPTS_ARGT_ENUM && !ent->vtype) {
+                char choicebuf[1024];
+                enum_format_choices(ent->vtype_arg, " ", choicebuf,
+                                    sizeof(choicebuf));
+                fputs(")\n        COMPREPLY=( $(compgen -W '", fp);
+                script_quote(fp, choicebuf, NULL);
+                fputs("' -- \"$cur\") )\n", fp);
+            } else {
+                fputs(")\n        COMPREPLY=( $(compgen -f -- \"$cur\") )\n",
+                      fp);
+            }
+            fputs("        return 0 ;;\n", fp);
+        }
+
+        fputs("    esac\n"
+              "    COMPREPLY=( $(compgen -W '", fp);
+        for (ii = 0; ii < idx->nall; ii++) {
+            cliopts_entry *ent = idx->all[ii];
+            if (ent->hidden) {
+                continue;
+            }
+            if (ent->kshort) {
+                fprintf(fp, "-%c ", ent->kshort);
+            }
+            if (ent->klong) {
+                fprintf(fp, "--%s ", ent->klong);
+            }
+        }
+        fputs("--help' -- \"$cur\") )\n}\n", fp);
+        fputs("complete -o default -F _cliopts_", fp);
+        script_funcname(fp, progname);
+        fprintf(fp, " %s\n", progname);
+
+    } else if (shell == CLIOPTS_SHELL_ZSH) {
+        fprintf(fp, "#compdef %s\n\n_arguments -s \\\n", progname);
+        for (ii = 0; ii < idx->nall; ii++) {
+            cliopts_entry *ent = idx->all[ii];
+            const char *optval = ent->ktype == CLIOPTS_ARGT_NONE ? "" : "=";
+            if (ent->hidden) {
+                continue;
+            }
+            fputs("    '", fp);
+            if (ent->kshort && ent->klong) {
+                fprintf(fp, "(-%c --%s)'{-%c,--%s%s}'", ent->kshort, ent->klong,
+                        ent->kshort, ent->klong, optval);
+            } else if (ent->kshort) {
+                fprintf(fp, "-%c", ent->kshort);
+            } else {
+                fprintf(fp, "--%s%s", ent->klong, optval);
+            }
+            fputc('[', fp);
+            script_quote(fp, ent->help, "[]:");
+            fputc(']', fp);
+            if (ent->ktype != CLIOPTS_ARGT_NONE) {
+                fputc(':', fp);
+                script_quote(fp, ent->vdesc ? ent->vdesc : "value", "[]:");
+                if (ent->ktype == CLIOPTS_ARGT_ENUM && !ent->vtype) {
+                    char choicebuf[1024];
+                    enum_format_choices(ent->vtype_arg, " ", choicebuf,
+                                        sizeof(choicebuf));
+                    fputs(":(", fp);
+                    script_quote(fp, choicebuf, "()");
+                    fputc(')', fp);
+                } else {
+                    fputs(":_files", fp);
+                }
+            }
+            fputs("' \\\n", fp);
+        }
+        fputs("    '(- *)'{-\\?,--help}'[this message]' \\\n"
+              "    '*:file:_files'\n", fp);
+
+    } else {
+        for (ii = 0; ii < idx->nall; ii++) {
+            cliopts_entry *ent = idx->all[ii];
+            if (ent->hidden) {
+                continue;
+            }
+            fprintf(fp, "complete -c %s", progname);
+            if (ent->kshort) {
+                fprintf(fp, " -s %c", ent->kshort);
+            }
+            if (ent->klong) {
+                fprintf(fp, " -l %s", ent->klong);
+            }
+            if (ent->ktype == CLIOPTS_ARGT_ENUM && !ent->vtype) {
+                char choicebuf[1024];
+                enum_format_choices(ent->vtype_arg, " ", choicebuf,
+                                    sizeof(choicebuf));
+                fputs(" -x -a '", fp);
+                script_quote(fp, choicebuf, "'\\");
+                fputc('\'', fp);
+            } else if (ent->ktype != CLIOPTS_ARGT_NONE) {
+                fputs(" -r", fp);
+            }
+            if (ent->help) {
+                fputs(" -d '", fp);
+                script_quote(fp, ent->help, "'\\");
+                fputc('\'', fp);
+            }
+            fputc('\n', fp);
+        }
+        fprintf(fp, "complete -c %s -s '?' -l help -d 'this message'\n",
+                progname);
+    }
+}
+
+static void
+handle_completion(const struct cliopts_chain_st *chain, const char *shellname,
+                  int argc, char **argv)
+{
+    cliopts_index *idx = chain->idx;
+    cliopts_shell_t shell = CLIOPTS_SHELL_BASH;
+
+    if (strcmp(shellname, "zsh") == 0) {
+        shell = CLIOPTS_SHELL_ZSH;
+    } else if (strcmp(shellname, "fish") == 0) {
+        shell = CLIOPTS_SHELL_FISH;
+    }
+
+    if (!idx) {
+        idx = cliopts_index_create(chain->tables[0].entries);
+    }
+    if (idx) {
+        cliopts_complete(idx, argc, argv, shell, stdout);
+        if (idx != chain->idx) {
+            cliopts_index_free(idx);
+        }
+    }
+    fflush(stdout);
+}
+
+/**
+ * Constraints. Each one is compiled into a bitmask over the positions of
+ * the entries in the index, so that checking is a few bitwise operations
+ * against the set of options which were found.
+ */
+typedef unsigned long cliopts_word;
+#define WORD_BITS (sizeof(cliopts_word) * CHAR_BIT)
+
+#ifdef __GNUC__
+#define word_popcount(w) __builtin_popcountl(w)
+#else
+static unsigned
+word_popcount(cliopts_word w)
+{
+    unsigned n = 0;
+    for (; w; w &= w - 1) {
+        n++;
+    }
+    return n;
+}
+#endif
+
+struct cliopts_constraint_rule {
+    cliopts_constraint_type type;
+    /* Position of the option, for REQUIRES and CONFLICTS */
+    size_t option;
+};
+
+struct cliopts_constraint_set_st {
+    const cliopts_index *idx;
+    size_t nwords;
+    size_t nrules;
+    struct cliopts_constraint_rule *rules;
+    /* nrules masks of nwords each */
+    cliopts_word *masks;
+};
+
+/* Find the position of an option (by long name, or else short name) */
+static long
+index_position(const cliopts_index *idx, const char *name)
+{
+    size_t nlen = strlen(name), ii;
+    const struct cliopts_index_slot *slot =
+            index_find_long_slot(idx, name, nlen);
+
+    if (slot) {
+        return (long)slot->ord;
+    }
+    if (nlen == 1 && idx->byshort[(unsigned char)name[0]]) {
+        for (ii = 0; ii < idx->nall; ii++) {
+            if (idx->all[ii] == idx->byshort[(unsigned char)name[0]]) {
+                return (long)ii;
+            }
+        }
+    }
+    return -1;
+}
+
+CLIOPTS_API
+cliopts_constraint_set *
+cliopts_constraints_compile(const cliopts_index *idx,
+                            const cliopts_constraint *constraints,
+                            char **errp)
+{
+    cliopts_constraint_set *cs;
+    const cliopts_constraint *cur;
+    size_t ii;
+
+    cs = CLIOPTS_CALLOC(1, sizeof(*cs));
+    if (!cs) {
+        *errp = "Out of memory";
+        return NULL;
+    }
+    cs->idx = idx;
+    cs->nwords = (idx->nall + WORD_BITS - 1) / WORD_BITS;
+    for (cur = constraints; cur->type != CLIOPTS_CONSTRAINT_END; cur++) {
+        cs->nrules++;
+    }
+
+    cs->rules = CLIOPTS_CALLOC(cs->nrules + 1, sizeof(*cs->rules));
+    cs->masks = CLIOPTS_CALLOC(cs->nrules * cs->nwords + 1,
+                               sizeof(*cs->masks));
+    if (!cs->rules || !cs->masks) {
+        *errp = "Out of memory";
+        goto GT_ERR;
+    }
+
+    for (ii = 0; ii < cs->nrules; ii++) {
+        struct cliopts_constraint_rule *rule = cs->rules + ii;
+        cliopts_word *mask = cs->masks + ii * cs->nwords;
+        const char * const *member;
+
+        cur = constraints + ii;
+        rule->type = cur->type;
+
+        if (cur->type == CLIOPTS_CONSTRAINT_REQUIRES ||
+                cur->type == CLIOPTS_CONSTRAINT_CONFLICTS) {
+            long pos = cur->option ? index_position(idx, cur->option) : -1;
+            if (pos < 0) {
+                *errp = "Constraint refers to an unknown option";
+                goto GT_ERR;
+            }
+            rule->option = pos;
+        }
+
+        for (member = cur->members; member && *member; member++) {
+            long pos = index_position(idx, *member);
+            if (pos < 0) {
+                *errp = "Constraint refers to an unknown option";
+                goto GT_ERR;
+            }
+            mask[pos / WORD_BITS] |= (cliopts_word)1 << (pos % WORD_BITS);
+        }
+    }
+    return cs;
+
+    GT_ERR:
+    cliopts_constraints_free(cs);
+    return NULL;
+}
+
+CLIOPTS_API
+void
+cliopts_constraints_free(cliopts_constraint_set *cs)
+{
+    if (!cs) {
+        return;
+    }
+    free(cs->rules);
+    free(cs->masks);
+    free(cs);
+}
+
+/* List the options whose bits are set in 'mask' */
+static void
+constraint_format_members(const cliopts_constraint_set *cs,
+                          const cliopts_word *mask, char *buf, size_t nbuf)
+{
+    size_t ii, pos = format_append(buf, nbuf, 0, "");
+    for (ii = 0; ii < cs->nwords; ii++) {
+        cliopts_word w = mask[ii];
+        size_t bit;
+        for (bit = 0; w; bit++, w >>= 1) {
+            char entbuf[128] = { 0 };
+            if (!(w & 1)) {
+                continue;
+            }
+            if (pos) {
+                pos = format_append(buf, nbuf, pos, ", ");
+            }
+            pos = format_append(buf, nbuf, pos,
+                    get_option_name(cs->idx->all[ii * WORD_BITS + bit],
+                                    entbuf));
+        }
+    }
+}
+
+/**
+ * Check the constraints against a bitmap of the options which were found.
+ * Returns the number of violations
+ */
+/* The constraints couldn't be checked. This fails the parse, as a violation
+ * would */
+static int
+constraints_nomem(int quiet, cliopts_error_list *errs)
+{
+    const char *msg = "Out of memory while checking constraints";
+    if (errs) {
+        error_add(errs, -1, 0, CLIOPTS_ERR_CONSTRAINT, NULL, NULL, msg);
+    } else if (!quiet) {
+        fprintf(stderr, "%s\n", msg);
+    }
+    return -1;
+}
+
+static int
+constraints_check_found(const cliopts_constraint_set *cs,
+                        const cliopts_word *found, int quiet,
+                        cliopts_error_list *errs)
+{
+    size_t ii, jj;
+    int nviolated = 0;
+    cliopts_word *hits = CLIOPTS_MALLOC(sizeof(*hits) * (cs->nwords + 1));
+
+    if (!hits) {
+        return constraints_nomem(quiet, errs);
+    }
+
+    for (ii = 0; ii < cs->nrules; ii++) {
+        const struct cliopts_constraint_rule *rule = cs->rules + ii;
+        const cliopts_word *mask = cs->masks + ii * cs->nwords;
+        size_t nhits = 0;
+        int violated = 0, have_option;
+        char entbuf[128] = { 0 };
+        char members[1024];
+        cliopts_error err = { -1, 0, CLIOPTS_ERR_CONSTRAINT };
+
+        for (jj = 0; jj < cs->nwords; jj++) {
+            hits[jj] = found[jj] & mask[jj];
+            nhits += word_popcount(hits[jj]);
+        }
+        have_option = (found[rule->option / WORD_BITS] >>
+                (rule->option % WORD_BITS)) & 1;
+
+        switch (rule->type) {
+        case CLIOPTS_CONSTRAINT_EXACTLY_ONE:
+            violated = nhits != 1;
+            break;
+        case CLIOPTS_CONSTRAINT_AT_MOST_ONE:
+            violated = nhits > 1;
+            break;
+        case CLIOPTS_CONSTRAINT_AT_LEAST_ONE:
+            violated = nhits == 0;
+            break;
+        case CLIOPTS_CONSTRAINT_REQUIRES:
+            if (have_option) {
+                /* Report the members which are missing */
+                for (jj = 0; jj < cs->nwords; jj++) {
+                    hits[jj] = mask[jj] & ~found[jj];
+                    violated |= hits[jj] != 0;
+                }
+            }
+            break;
+        case CLIOPTS_CONSTRAINT_CONFLICTS:
+            violated = have_option && nhits;
+            break;
+        default:
+            break;
+        }
+
+        if (!violated) {
+            continue;
+        }
+        nviolated++;
+        if (quiet && !errs) {
+            continue;
+        }
+
+        switch (rule->type) {
+        case CLIOPTS_CONSTRAINT_EXACTLY_ONE:
+            err.message = "Exactly one of these options is required";
+            constraint_format_members(cs, mask, members, sizeof(members));
+            err.option = members;
+            break;
+        case CLIOPTS_CONSTRAINT_AT_MOST_ONE:
+            err.message = "Options may not be used together";
+            constraint_format_members(cs, hits, members, sizeof(members));
+            err.option = members;
+            break;
+        case CLIOPTS_CONSTRAINT_AT_LEAST_ONE:
+            err.message = "At least one of these options is required";
+            constraint_format_members(cs, mask, members, sizeof(members));
+            err.option = members;
+            break;
+        case CLIOPTS_CONSTRAINT_REQUIRES:
+            err.message = "also requires";
+            err.option = get_option_name(cs->idx->all[rule->option], entbuf);
+            constraint_format_members(cs, hits, members, sizeof(members));
+            err.value = members;
+            break;
+        default:
+            err.message = "may not be used with";
+            err.option = get_option_name(cs->idx->all[rule->option], entbuf);
+            constraint_format_members(cs, hits, members, sizeof(members));
+            err.value = members;
+            break;
+        }
+
+        if (errs) {
+            error_add(errs, -1, 0, err.code, err.option, err.value,
+                      err.message);
+        } else {
+            char msgbuf[2048];
+            error_format(&err, msgbuf, sizeof(msgbuf), 0);
+            fprintf(stderr, "%s\n", msgbuf);
+        }
+    }
+
+    free(hits);
+    return nviolated;
+}
+
+CLIOPTS_API
+int
+cliopts_constraints_check(const cliopts_constraint_set *cs,
+                          const struct cliopts_extra_settings *settings)
+{
+    size_t ii;
+    int rv;
+    cliopts_word *found = CLIOPTS_CALLOC(cs->nwords + 1, sizeof(*found));
+
+    if (!found) {
+        return constraints_nomem(settings && settings->error_nohelp,
+                                 settings ? settings->errors : NULL);
+    }
+    for (ii = 0; ii < cs->idx->nall; ii++) {
+        if (entry_found(cs->idx->all[ii], ii, settings)) {
+            found[ii / WORD_BITS] |= (cliopts_word)1 << (ii % WORD_BITS);
+        }
+    }
+    rv = constraints_check_found(cs, found,
+                                 settings && settings->error_nohelp,
+                                 settings ? settings->errors : NULL);
+    free(found);
+    return rv;
+}
+
+/**
+ * Schema export. The table is written as JSON so that tools can learn a
+ * program's options without scraping its help text.
+ */
+static void
+json_string(FILE *fp, const char *s)
+{
+    if (!s) {
+        fputs("null", fp);
+        return;
+    }
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", fp);
+        } else if (c == '\t') {
+            fputs("\\t", fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* The name by which constraints refer to an option */
+static const char *
+schema_option_name(const cliopts_entry *entry, char *buf)
+{
+    if (entry->klong) {
+        return entry->klong;
+    }
+    buf[0] = entry->kshort;
+    buf[1] = '\0';
+    return buf;
+}
+
+static void
+schema_dump_entry(const cliopts_entry *entry, const char *group,
+                  const struct cliopts_extra_settings *settings, FILE *fp)
+{
+    const cliopts_valtype *vt = entry_valtype(entry);
+    char buf[1024];
+
+    fputs("{\"short\":", fp);
+    if (entry->kshort) {
+        buf[0] = entry->kshort;
+        buf[1] = '\0';
+        json_string(fp, buf);
+    } else {
+        json_string(fp, NULL);
+    }
+    fputs(",\"long\":", fp);
+    json_string(fp, entry->klong);
+    fputs(",\"type\":", fp);
+    json_string(fp, vt ? vt->name : NULL);
+    fputs(",\"value\":", fp);
+    json_string(fp, entry->vdesc);
+    fputs(",\"help\":", fp);
+    json_string(fp, entry->help);
+    fprintf(fp, ",\"required\":%s,\"hidden\":%s,\"multiple\":%s",
+            entry->required ? "true" : "false",
+            entry->hidden ? "true" : "false",
+            vt && (vt->flags & CLIOPTS_VT_MULTI) ? "true" : "false");
+
+    if (!entry->required && vt && vt->format) {
+        buf[0] = '\0';
+        vt->format(entry_dest(entry, settings), entry->vtype_arg,
+                   buf, sizeof(buf));
+        if (buf[0]) {
+            fputs(",\"default\":", fp);
+            json_string(fp, buf);
+        }
+    }
+
+    if (entry->ktype == CLIOPTS_ARGT_ENUM && !entry->vtype) {
+        const cliopts_choice *choice = entry->vtype_arg;
+        fputs(",\"choices\":[", fp);
+        for (; choice && choice->name; choice++) {
+            if (choice != entry->vtype_arg) {
+                fputc(',', fp);
+            }
+            json_string(fp, choice->name);
+        }
+        fputc(']', fp);
+    }
+    if (group) {
+        fputs(",\"group\":", fp);
+        json_string(fp, group);
+    }
+    fputc('}', fp);
+}
+
+static void
+schema_dump_constraints(const cliopts_constraint_set *cs, FILE *fp)
+{
+    static const char *typenames[] = {
+        NULL, "exactly_one", "at_most_one", "at_least_one",
+        "requires", "conflicts"
+    };
+    size_t ii, jj;
+
+    for (ii = 0; ii < cs->nrules; ii++) {
+        const struct cliopts_constraint_rule *rule = cs->rules + ii;
+        const cliopts_word *mask = cs->masks + ii * cs->nwords;
+        char namebuf[2];
+        int first = 1;
+
+        fprintf(fp, "%s{\"type\":", ii ? ",\n" : "\n");
+        json_string(fp, typenames[rule->type]);
+        if (rule->type == CLIOPTS_CONSTRAINT_REQUIRES ||
+                rule->type == CLIOPTS_CONSTRAINT_CONFLICTS) {
+            fputs(",\"option\":", fp);
+            json_string(fp, schema_option_name(cs->idx->all[rule->option],
+                                               namebuf));
+        }
+        fputs(",\"members\":[", fp);
+        for (jj = 0; jj < cs->idx->nall; jj++) {
+            cliopts_word bit = (cliopts_word)1 << (jj % WORD_BITS);
+            if (!(mask[jj / WORD_BITS] & bit)) {
+                continue;
+            }
+            if (!first) {
+                fputc(',', fp);
+            }
+            json_string(fp, schema_option_name(cs->idx->all[jj], namebuf));
+            first = 0;
+        }
+        fputs("]}", fp);
+    }
+}
+
+static void
+dump_schema(const struct cliopts_chain_st *chain,
+            const struct cliopts_extra_settings *settings, FILE *fp)
+{
+    const cliopts_entry *cur;
+    size_t ii;
+    int first = 1;
+
+    fputs("{\"program\":", fp);
+    json_string(fp, settings ? settings->progname : NULL);
+    fputs(",\"usage\":", fp);
+    json_string(fp, settings ? settings->argstring : NULL);
+    fputs(",\"args\":", fp);
+    json_string(fp, settings ? settings->argstring_restargs : NULL);
+    fputs(",\"description\":", fp);
+    json_string(fp, settings ? settings->shortdesc : NULL);
+
+    fputs(",\n\"options\":[", fp);
+    for (ii = 0; ii < chain->ntables; ii++) {
+        const cliopts_table *table = chain->tables + ii;
+        for (cur = table->entries; cur->dest; cur++) {
+            fputs(first ? "\n" : ",\n", fp);
+            schema_dump_entry(cur, table->title, settings, fp);
+            first = 0;
+        }
+    }
+    fputs("],\n\"constraints\":[", fp);
+    if (settings && settings->constraints) {
+        schema_dump_constraints(settings->constraints, fp);
+    }
+    fputs("]}\n", fp);
+}
+
+CLIOPTS_API
+void
+cliopts_dump_schema(cliopts_entry *entries,
+                    const struct cliopts_extra_settings *settings,
+                    FILE *fp)
+{
+    struct cliopts_chain_st chain;
+    chain_init_single(&chain, entries);
+    dump_schema(&chain, settings, fp);
+}
+
+static int
+parse_chain(const struct cliopts_chain_st *chain,
+            int argc,
+            char **argv,
+            int *lastidx,
+            struct cliopts_extra_settings *settings,
+            struct parse_record *record)
+{
+    /**
+     * Now let's build ourselves a
+     */
+    int curmode;
+    int ii, ret = 0, lastidx_s = 0;
+    int tokbase, ntoks = 0;
+    struct cliopts_token toks[TOKEN_BATCH];
+    struct cliopts_priv ctx = { 0 };
+    struct cliopts_extra_settings default_settings = { 0 };
+    STATS_TIMER(t0)
+#ifdef CLIOPTS_ENABLE_STATS
+    struct cliopts_stats *stats_prev = stats_active;
+#endif
+
+    if (!lastidx) {
+        lastidx = &lastidx_s;
+    }
+
+    ctx.entries = chain->tables[0].entries;
+    ctx.chain = chain;
+    ctx.record = record;
+
+    if (!settings) {
+        settings = &default_settings;
+        settings->show_defaults = 1;
+    }
+    if (!settings->progname) {
+        settings->progname = argv[0];
+    }
+    if (!settings->argstring) {
+        settings->argstring = "[OPTIONS...]";
+    }
+    settings->nrestargs = 0;
+    if (settings->errors) {
+        cliopts_errors_clear(settings->errors);
+    }
+#ifdef CLIOPTS_ENABLE_STATS
+    ctx.stats = settings->stats;
+    stats_active = settings->stats;
+#endif
+
+    if (!settings->line_max) {
+        settings->line_max = get_terminal_width() - 3;
+    }
+
+    ii = (settings->argv_noskip) ? 0 : 1;
+
+    if (settings->enable_completion && ii < argc &&
+            strncmp(argv[ii], "--cliopts-complete=", 19) == 0) {
+        handle_completion(chain, argv[ii] + 19, argc - ii - 1, argv + ii + 1);
+        exit(0);
+    }
+
+    if (ii >= argc) {
+        *lastidx = 0;
+        ret = 0;
+        goto GT_CHECK_REQ;
+        return 0;
+    }
+
+    curmode = WANT_OPTION;
+    ctx.wanted = curmode;
+    ctx.settings = settings;
+
+    for (tokbase = ii; ii < argc; ii++) {
+        const struct cliopts_token *tok;
+        STATS_ADD(&ctx, ntokens, 1);
+
+        if (ii - tokbase >= ntoks) {
+            STATS_START(&ctx, t0);
+            tokbase = ii;
+            ntoks = classify_tokens(argv + ii, argc - ii, toks);
+            STATS_LAP(&ctx, t0, ns_tokenize);
+        }
+        tok = toks + (ii - tokbase);
+        ctx.argidx = ii;
+        ctx.errpos = NULL;
+
+        if (curmode == WANT_OPTION) {
+            curmode = parse_option(&ctx, argv[ii], tok);
+        } else if (curmode == WANT_VALUE) {
+            curmode = parse_value(&ctx, argv[ii], tok->len);
+        }
+
+        if (curmode == MODE_ERROR) {
+            PROBE_ERROR(&ctx);
+            ret = -1;
+            if (settings->errors) {
+                error_add_current(&ctx, ii, argv[ii], tok);
+                curmode = ctx.wanted = WANT_OPTION;
+                continue;
+            }
+            if (settings->error_nohelp == 0) {
+                dump_error(&ctx);
+            }
+            break;
+        } else if (curmode == MODE_HELP) {
+            if (settings->help_noflag) {
+                /* ignore it ? */
+                continue;
+            }
+
+            STATS_START(&ctx, t0);
+            print_help(&ctx, settings);
+            STATS_LAP(&ctx, t0, ns_help);
+            exit(0);
+
+        } else if (curmode == MODE_HELP_JSON) {
+            if (settings->help_noflag) {
+                continue;
+            }
+            dump_schema(chain, settings, stdout);
+            exit(0);
+
+        } else if (curmode == MODE_RESTARGS) {
+            ii++;
+            break;
+        } else {
+            ctx.wanted = curmode;
+        }
+    }
+
+    /* Arguments after -- still fill the positional arguments */
+    for (; curmode == MODE_RESTARGS && settings->positionals && ii < argc;
+            ii++) {
+        int mode;
+        ctx.argidx = ii;
+        mode = parse_positional(&ctx, argv[ii]);
+        if (mode == MODE_RESTARGS) {
+            break;
+        } else if (mode == MODE_ERROR) {
+            ret = -1;
+            if (settings->errors) {
+                error_add(settings->errors, ii, 0, ctx.errnum,
+                          ctx.current_key, ctx.current_value, ctx.errstr);
+                continue;
+            }
+            if (settings->error_nohelp == 0) {
+                dump_error(&ctx);
+            }
+            break;
+        }
+    }
+
+    *lastidx = ii;
+
+    if (curmode == WANT_VALUE) {
+        ret = -1;
+
+        if (settings->errors) {
+            char entbuf[128] = { 0 };
+            error_add(settings->errors, ii - 1, 0, CLIOPTS_ERR_NEED_ARG,
+                      get_option_name(ctx.current, entbuf), NULL,
+                      "Option requires an argument");
+        } else {
+            if (settings->error_nohelp == 0) {
+                fprintf(stderr,
+                        "Option %s requires argument\n",
+                        ctx.current_key);
+            }
+            goto GT_RET;
+        }
+    }
+
+    if (settings->argstring_restargs &&
+            settings->nrestargs < settings->min_restargs) {
+        ret = -1;
+
+        if (settings->errors) {
+            error_add(settings->errors, -1, 0, CLIOPTS_ERR_RESTARGS,
+                      settings->argstring_restargs, NULL,
+                      "Required arguments missing");
+        } else {
+            if (settings->error_nohelp == 0) {
+                fprintf(stderr,
+                        "Required arguments: %s\n",
+                        settings->argstring_restargs);
+            }
+            goto GT_RET;
+        }
+    }
+
+    GT_CHECK_REQ:
+    STATS_START(&ctx, t0);
+    if (settings->positionals && (ret == 0 || settings->errors)) {
+        cliopts_entry *cur_ent = settings->positionals + ctx.npos;
+        for (; cur_ent->dest; cur_ent++) {
+            char namebuf[80];
+            if (!cur_ent->required) {
+                continue;
+            }
+            ret = -1;
+            sprintf(namebuf, "<%.64s>", cur_ent->klong ? cur_ent->klong : "");
+            if (settings->errors) {
+                error_add(settings->errors, -1, 0, CLIOPTS_ERR_RESTARGS,
+                          namebuf, NULL, "Required argument missing");
+                continue;
+            }
+            if (settings->error_nohelp == 0) {
+                fprintf(stderr, "Required argument %s missing\n", namebuf);
+            }
+            break;
+        }
+    }
+    {
+        cliopts_entry *cur_ent;
+        size_t tt, pos;
+        int stop = 0;
+        for (tt = 0; tt < chain->ntables && !stop; tt++) {
+            cur_ent = chain->tables[tt].entries;
+            for (pos = chain->starts[tt]; cur_ent->dest; cur_ent++, pos++) {
+                char entbuf[128] = { 0 };
+                if (cur_ent->required == 0 ||
+                        entry_found(cur_ent, pos, settings)) {
+                    continue;
+                }
+
+                ret = -1;
+                if (settings->errors) {
+                    error_add(settings->errors, -1, 0, CLIOPTS_ERR_MISSING,
+                              get_option_name(cur_ent, entbuf), NULL,
+                              "Required option missing");
+                    continue;
+                }
+                if (settings->error_nohelp) {
+                    stop = 1;
+                    break;
+                }
+
+                fprintf(stderr, "Required option %s missing\n",
+                        get_option_name(cur_ent, entbuf));
+            }
+        }
+    }
+    if (settings->constraints &&
+            (ret == 0 || !settings->error_nohelp || settings->errors) &&
+            cliopts_constraints_check(settings->constraints, settings)) {
+        ret = -1;
+    }
+    STATS_LAP(&ctx, t0, ns_required);
+
+    if (ret == 0 && settings->fingerprint) {
+        fingerprint_chain(chain, settings, settings->fingerprint);
+    }
+    if (ret == 0 && settings->shm) {
+        cliopts_shm_publish(settings->shm);
+    }
+
+    GT_RET:
+    if (ret == -1) {
+        if (settings->errors && settings->error_nohelp == 0) {
+            cliopts_errors_print(settings->errors, stderr);
+        }
+        if (settings->error_nohelp == 0) {
+            STATS_START(&ctx, t0);
+            print_help(&ctx, settings);
+            STATS_LAP(&ctx, t0, ns_help);
+        }
+        if (settings->error_noexit == 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+#ifdef CLIOPTS_ENABLE_STATS
+    stats_active = stats_prev;
+#endif
+    return ret;
+}
+
+static int
+parse_options(cliopts_entry *entries,
+              int argc,
+              char **argv,
+              int *lastidx,
+              struct cliopts_extra_settings *settings,
+              struct parse_record *record)
+{
+    struct cliopts_chain_st chain;
+    chain_init_single(&chain, entries);
+    return parse_chain(&chain, argc, argv, lastidx, settings, record);
+}
+
+CLIOPTS_API
+int
+cliopts_parse_options(cliopts_entry *entries,
+                      int argc,
+                      char **argv,
+                      int *lastidx,
+                      struct cliopts_extra_settings *settings)
+{
+    return parse_options(entries, argc, argv, lastidx, settings, NULL);
+}
+
+/* Name a table in a conflict message, e.g. 'logging' or 'table #2' */
+static size_t
+chain_table_name(const cliopts_chain *chain, size_t pos, char *buf,
+                 size_t nbuf, size_t bufpos)
+{
+    size_t ii = chain->ntables - 1;
+    char numbuf[32];
+
+    while (chain->starts[ii] > pos) {
+        ii--;
+    }
+    if (chain->tables[ii].title) {
+        return format_append(buf, nbuf, bufpos, chain->tables[ii].title);
+    }
+    sprintf(numbuf, "table #%lu", (unsigned long)ii + 1);
+    return format_append(buf, nbuf, bufpos, numbuf);
+}
+
+static void
+chain_conflict(const cliopts_chain *chain, cliopts_error_list *errors,
+               const char *name, size_t first, size_t second)
+{
+    char tables[512];
+    size_t pos = chain_table_name(chain, first, tables, sizeof tables, 0);
+    pos = format_append(tables, sizeof tables, pos, ", ");
+    chain_table_name(chain, second, tables, sizeof tables, pos);
+    error_add(errors, -1, 0, CLIOPTS_ERR_DUPLICATE, name, tables,
+              "is defined more than once");
+}
+
+CLIOPTS_API
+cliopts_chain *
+cliopts_chain_create(const cliopts_table *tables, size_t ntables,
+                     cliopts_error_list *errors)
+{
+    cliopts_error_list local = { 0 };
+    cliopts_chain *chain;
+    cliopts_index *idx;
+    cliopts_entry *cur;
+    size_t ii, nents = 0;
+    char namebuf[3];
+
+    if (!errors) {
+        errors = &local;
+    }
+    cliopts_errors_clear(errors);
+
+    chain = CLIOPTS_CALLOC(1, sizeof(*chain));
+    if (!chain || !ntables) {
+        free(chain);
+        return NULL;
+    }
+    chain->ntables = ntables;
+    chain->tables = CLIOPTS_MALLOC(sizeof(*chain->tables) * ntables);
+    chain->starts = CLIOPTS_MALLOC(sizeof(*chain->starts) * ntables);
+    chain->idx = idx = CLIOPTS_CALLOC(1, sizeof(*idx));
+    if (!chain->tables || !chain->starts || !idx) {
+        cliopts_chain_free(chain);
+        return NULL;
+    }
+    for (ii = 0; ii < ntables; ii++) {
+        chain->tables[ii] = tables[ii];
+        chain->starts[ii] = nents;
+        for (cur = tables[ii].entries; cur->dest; cur++) {
+            nents++;
+        }
+    }
+
+    idx->all = CLIOPTS_MALLOC(sizeof(*idx->all) * (nents + 1));
+    idx->bylong = CLIOPTS_MALLOC(sizeof(*idx->bylong) * (nents + 1));
+    if (!idx->all || !idx->bylong) {
+        cliopts_chain_free(chain);
+        return NULL;
+    }
+
+    /* The same as index_build(), over all the tables */
+    for (ii = 0; ii < ntables; ii++) {
+        for (cur = tables[ii].entries; cur->dest; cur++) {
+            unsigned char c = (unsigned char)cur->kshort;
+            unsigned ord = (unsigned)idx->nall;
+            idx->all[idx->nall++] = cur;
+            if (c && idx->byshort[c]) {
+                namebuf[0] = '-';
+                namebuf[1] = cur->kshort;
+                namebuf[2] = '\0';
+                chain_conflict(chain, errors, namebuf, idx->shortord[c], ord);
+            } else if (c) {
+                idx->byshort[c] = cur;
+                idx->shortord[c] = ord;
+            }
+            if (cur->klong) {
+                struct cliopts_index_slot *slot = idx->bylong + idx->nlong++;
+                slot->name = cur->klong;
+                slot->entry = cur;
+                slot->ord = ord;
+            }
+        }
+    }
+    qsort(idx->bylong, idx->nlong, sizeof(*idx->bylong), index_slot_cmp);
+    if (index_hash_build(idx) != 0) {
+        cliopts_chain_free(chain);
+        return NULL;
+    }
+
+    /* Equal names are now adjacent, in table order */
+    for (ii = 1; ii < idx->nlong; ii++) {
+        const struct cliopts_index_slot *a = idx->bylong + ii - 1;
+        const struct cliopts_index_slot *b = idx->bylong + ii;
+        if (strcmp(a->name, b->name) == 0) {
+            char *name = CLIOPTS_MALLOC(strlen(b->name) + 3);
+            if (name) {
+                sprintf(name, "--%s", b->name);
+                chain_conflict(chain, errors, name, a->ord, b->ord);
+                free(name);
+            }
+        }
+    }
+
+    if (errors->nerrors) {
+        if (errors == &local) {
+            for (ii = 0; ii < local.nerrors; ii++) {
+                char msgbuf[1024];
+                error_format(local.errors + ii, msgbuf, sizeof msgbuf, 0);
+                fprintf(stderr, "%s\n", msgbuf);
+            }
+            cliopts_errors_clear(&local);
+        }
+        cliopts_chain_free(chain);
+        return NULL;
+    }
+    return chain;
+}
+
+CLIOPTS_API
+const cliopts_index *
+cliopts_chain_index(const cliopts_chain *chain)
+{
+    return chain->idx;
+}
+
+CLIOPTS_API
+int
+cliopts_chain_parse(const cliopts_chain *chain,
+                    int argc,
+                    char **argv,
+                    int *lastidx,
+                    struct cliopts_extra_settings *settings)
+{
+    return parse_chain(chain, argc, argv, lastidx, settings, NULL);
+}
+
+CLIOPTS_API
+void
+cliopts_chain_free(cliopts_chain *chain)
+{
+    if (!chain) {
+        return;
+    }
+    cliopts_index_free(chain->idx);
+    free(chain->tables);
+    free(chain->starts);
+    free(chain);
+}
+
+
+static int
+parse_cached(cliopts_parser *parser, cliopts_entry *entries, int argc,
+             char **argv, int *lastidx,
+             struct cliopts_extra_settings *settings);
+
+static int
+parse_into(cliopts_parser *parser,
+           const cliopts_entry *entries,
+           void *base,
+           int *found,
+           int argc,
+           char **argv,
+           int *lastidx,
+           struct cliopts_extra_settings *settings)
+{
+    struct cliopts_extra_settings local = { 0 };
+    const cliopts_entry *cur;
+    int *counts = found;
+    int rv;
+
+    for (cur = entries; cur->dest; cur++) {
+    }
+    if (!counts) {
+        /* Counts are still needed, for required options and constraints */
+        counts = CLIOPTS_CALLOC((size_t)(cur - entries) + 1, sizeof(*counts));
+        if (!counts) {
+            return -1;
+        }
+    } else {
+        memset(counts, 0, (size_t)(cur - entries) * sizeof(*counts));
+    }
+
+    /* Work on a copy, so that the caller's settings may be shared */
+    if (settings) {
+        local = *settings;
+    } else {
+        local.show_defaults = 1;
+    }
+    local.base = base;
+    local.found = counts;
+
+    /* With both base and found set, the table is only read */
+    rv = parse_cached(parser, (cliopts_entry *)entries, argc, argv, lastidx,
+                      &local);
+    if (settings) {
+        settings->nrestargs = local.nrestargs;
+    }
+    if (counts != found) {
+        free(counts);
+    }
+    return rv;
+}
+
+CLIOPTS_API
+int
+cliopts_parse_into(const cliopts_entry *entries,
+                   void *base,
+                   int *found,
+                   int argc,
+                   char **argv,
+                   int *lastidx,
+                   struct cliopts_extra_settings *settings)
+{
+    return parse_into(NULL, entries, base, found, argc, argv, lastidx,
+                      settings);
+}
+
+/**
+ * Parse cache. A successful parse is kept as a list of actions which repeat
+ * its effects: counting the options found, copying the final values of
+ * simple types into place, converting the values of other types again (from
+ * the same place in the new argv, so nothing is tokenized or looked up) and
+ * collecting positional arguments. Records are found by a hash of the
+ * arguments, and the least recently used one is dropped when full.
+ */
+#define CACHE_FOUND 0
+#define CACHE_FLAT 1
+#define CACHE_VALUE 2
+#define CACHE_REST 3
+
+/* Keys also cover the settings which change the outcome of a parse */
+#define CACHE_KEY_NOSKIP 0x01
+#define CACHE_KEY_RESTARGS 0x02
+#define CACHE_KEY_BASE 0x04
+#define CACHE_KEY_HELP_NOFLAG 0x08
+
+struct cache_key {
+    const cliopts_entry *entries;
+    const cliopts_constraint_set *constraints;
+    size_t hash;
+    /* Total length of the arguments, including their NULs */
+    size_t ntext;
+    int argc;
+    int flags;
+    int min_restargs;
+};
+
+struct cache_action {
+    int kind;
+    unsigned pos; /* position of the entry in the table */
+    int argidx; /* the argument holding the value */
+    size_t off; /* offset of the value in the argument */
+    size_t len; /* length of the value, size of FLAT, or count of FOUND */
+    union {
+        unsigned char bytes[sizeof(unsigned long long)];
+        unsigned long long u;
+        double d;
+    } flat;
+};
+
+struct cache_record {
+    /* LRU order, most recent first */
+    struct cache_record *prev;
+    struct cache_record *next;
+    /* Next record in the same bucket */
+    struct cache_record *chain;
+    struct cache_key key;
+    int lastidx;
+    size_t nactions;
+    /* These follow the record, in the same allocation */
+    struct cache_action *actions;
+    char *text;
+};
+
+struct cliopts_parser_st {
+    struct cache_record **buckets;
+    size_t nbuckets;
+    struct cache_record *head;
+    struct cache_record *tail;
+    size_t count;
+    size_t max;
+    struct parse_record record;
+    cliopts_cache_stats stats;
+};
+
+/* Size of the final value of an entry which can simply be copied, or 0 */
+static size_t
+cache_flat_size(const cliopts_entry *entry)
+{
+    if (entry->ktype == CLIOPTS_ARGT_NONE) {
+        return 1;
+    }
+    if (entry->vtype) {
+        return 0;
+    }
+    switch (entry->ktype) {
+    case CLIOPTS_ARGT_INT:
+    case CLIOPTS_ARGT_ENUM:
+        return sizeof(int);
+    case CLIOPTS_ARGT_UINT:
+    case CLIOPTS_ARGT_HEX:
+        return sizeof(unsigned);
+    case CLIOPTS_ARGT_ULONGLONG:
+    case CLIOPTS_ARGT_LONGLONG:
+    case CLIOPTS_ARGT_SIZE:
+    case CLIOPTS_ARGT_DURATION:
+        return sizeof(unsigned long long);
+    case CLIOPTS_ARGT_FLOAT:
+        return sizeof(float);
+    case CLIOPTS_ARGT_DOUBLE:
+        return sizeof(double);
+    default:
+        return 0;
+    }
+}
+
+static void
+cache_make_key(struct cache_key *key, const cliopts_entry *entries, int argc,
+               char **argv, const struct cliopts_extra_settings *settings)
+{
+    /* FNV-1a over the arguments, including their NULs */
+    size_t h = (size_t)2166136261UL, ntext = 0;
+    int ii;
+
+    for (ii = 0; ii < argc; ii++) {
+        const unsigned char *s = (const unsigned char *)argv[ii];
+        do {
+            h ^= *s;
+            h *= (size_t)16777619UL;
+            ntext++;
+        } while (*s++);
+    }
+    key->entries = entries;
+    key->constraints = settings->constraints;
+    key->ntext = ntext;
+    key->argc = argc;
+    key->flags = (settings->argv_noskip ? CACHE_KEY_NOSKIP : 0) |
+            (settings->restargs ? CACHE_KEY_RESTARGS : 0) |
+            (settings->base ? CACHE_KEY_BASE : 0) |
+            (settings->help_noflag ? CACHE_KEY_HELP_NOFLAG : 0);
+    key->min_restargs =
+            settings->argstring_restargs ? settings->min_restargs : 0;
+    key->hash = (h ^ (size_t)entries ^ (size_t)argc) * (size_t)16777619UL;
+}
+
+static struct cache_record *
+cache_find(const cliopts_parser *parser, const struct cache_key *key,
+           char **argv)
+{
+    struct cache_record *rec;
+
+    for (rec = parser->buckets[key->hash & (parser->nbuckets - 1)];
+            rec; rec = rec->chain) {
+        const char *text = rec->text;
+        int ii;
+        if (rec->key.hash != key->hash || rec->key.entries != key->entries ||
+                rec->key.constraints != key->constraints ||
+                rec->key.ntext != key->ntext || rec->key.argc != key->argc ||
+                rec->key.flags != key->flags ||
+                rec->key.min_restargs != key->min_restargs) {
+            continue;
+        }
+        /* The total lengths match, so this never reads past the text */
+        for (ii = 0; ii < key->argc; ii++) {
+            size_t n = strlen(argv[ii]) + 1;
+            if (memcmp(text, argv[ii], n) != 0) {
+                break;
+            }
+            text += n;
+        }
+        if (ii == key->argc) {
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+static void
+cache_unlink(cliopts_parser *parser, struct cache_record *rec)
+{
+    if (rec->prev) {
+        rec->prev->next = rec->next;
+    } else {
+        parser->head = rec->next;
+    }
+    if (rec->next) {
+        rec->next->prev = rec->prev;
+    } else {
+        parser->tail = rec->prev;
+    }
+    rec->prev = rec->next = NULL;
+}
+
+static void
+cache_push(cliopts_parser *parser, struct cache_record *rec)
+{
+    rec->next = parser->head;
+    if (parser->head) {
+        parser->head->prev = rec;
+    } else {
+        parser->tail = rec;
+    }
+    parser->head = rec;
+}
+
+static void
+cache_evict(cliopts_parser *parser)
+{
+    struct cache_record *rec = parser->tail;
+    struct cache_record **pp =
+            parser->buckets + (rec->key.hash & (parser->nbuckets - 1));
+
+    while (*pp != rec) {
+        pp = &(*pp)->chain;
+    }
+    *pp = rec->chain;
+    cache_unlink(parser, rec);
+    free(rec);
+    parser->count--;
+    parser->stats.evictions++;
+}
+
+/*
+ * Repeat a cached parse. Returns nonzero if a value no longer converts (e.g.
+ * an @file has gone), in which case the values converted so far are
+ * released, so that the full parse done instead does not add to them again
+ */
+static int
+cache_restore(const struct cache_record *rec, cliopts_entry *entries,
+              char **argv, int *lastidx,
+              struct cliopts_extra_settings *settings)
+{
+    size_t ii, jj;
+    char *err;
+
+    for (ii = 0; ii < rec->nactions; ii++) {
+        const struct cache_action *act = rec->actions + ii;
+        cliopts_entry *entry = entries + act->pos;
+        switch (act->kind) {
+        case CACHE_FOUND:
+            if (settings->found) {
+                settings->found[act->pos] += (int)act->len;
+            } else {
+                entry->found += (int)act->len;
+            }
+            break;
+        case CACHE_FLAT:
+            memcpy(entry_dest(entry, settings), act->flat.bytes, act->len);
+            break;
+        case CACHE_VALUE:
+            if (convert_value(entry, entry_dest(entry, settings),
+                              entry_valtype(entry),
+                              argv[act->argidx] + act->off, act->len,
+                              &err) != 0) {
+                goto GT_ERROR;
+            }
+            break;
+        case CACHE_REST:
+            settings->restargs[settings->nrestargs++] = argv[act->argidx];
+            break;
+        }
+    }
+    *lastidx = rec->lastidx;
+    return 0;
+
+    GT_ERROR:
+    for (jj = 0; jj < ii; jj++) {
+        const struct cache_action *act = rec->actions + jj;
+        if (act->kind == CACHE_VALUE) {
+            free_value(entries + act->pos,
+                       entry_dest(entries + act->pos, settings));
+        }
+    }
+    return -1;
+}
+
+/* Whether a value event has to be repeated by a cached parse */
+static int
+cache_wants_value(const struct parse_event *ev, const cliopts_entry *entries,
+                  const struct parse_event **lastval)
+{
+    const cliopts_entry *entry = entries + ev->pos;
+    const cliopts_valtype *vt = entry_valtype(entry);
+
+    if (cache_flat_size(entry)) {
+        return 0;
+    }
+    /* Only the last value counts, unless each one adds to the value */
+    return (vt->flags & CLIOPTS_VT_MULTI) || lastval[ev->pos] == ev;
+}
+
+/* Turn the recorded events of a successful parse into a cache record */
+static void
+cache_store(cliopts_parser *parser, const struct cache_key *key,
+            cliopts_entry *entries, char **argv, int lastidx,
+            const struct cliopts_extra_settings *settings)
+{
+    const struct parse_record *pr = &parser->record;
+    const struct parse_event **lastval = NULL;
+    struct cache_record *rec = NULL, **bucket;
+    struct cache_action *act;
+    size_t ii, nentries, nactions = 0, hdrsize;
+    int *counts = NULL;
+    char *text;
+
+    for (nentries = 0; entries[nentries].dest; nentries++) {
+    }
+    counts = CLIOPTS_CALLOC(nentries + 1, sizeof(*counts));
+    lastval = CLIOPTS_CALLOC(nentries + 1, sizeof(*lastval));
+    if (!counts || !lastval) {
+        goto GT_DONE;
+    }
+
+    for (ii = 0; ii < pr->nevents; ii++) {
+        const struct parse_event *ev = pr->events + ii;
+        if (ev->kind == PARSE_MATCH) {
+            counts[ev->pos]++;
+        } else if (ev->kind == PARSE_VALUE) {
+            lastval[ev->pos] = ev;
+        }
+    }
+    for (ii = 0; ii < nentries; ii++) {
+        if (counts[ii]) {
+            nactions += cache_flat_size(entries + ii) ? 2 : 1;
+        }
+    }
+    for (ii = 0; ii < pr->nevents; ii++) {
+        const struct parse_event *ev = pr->events + ii;
+        if (ev->kind == PARSE_REST) {
+            nactions++;
+        } else if (ev->kind == PARSE_VALUE &&
+                cache_wants_value(ev, entries, lastval)) {
+            /* These could not be released if a value stopped converting */
+            if (entries[ev->pos].vtype &&
+                    (entries[ev->pos].vtype->flags & CLIOPTS_VT_MULTI)) {
+                goto GT_DONE;
+            }
+            nactions++;
+        }
+    }
+
+    /* The actions follow the record, suitably aligned, then the text */
+    hdrsize = (sizeof(*rec) + sizeof(*act) - 1) / sizeof(*act) * sizeof(*act);
+    rec = CLIOPTS_MALLOC(hdrsize + nactions * sizeof(*act) + key->ntext);
+    if (!rec) {
+        goto GT_DONE;
+    }
+    rec->key = *key;
+    rec->lastidx = lastidx;
+    rec->nactions = nactions;
+    rec->actions = (struct cache_action *)((char *)rec + hdrsize);
+    rec->text = (char *)(rec->actions + nactions);
+    rec->prev = rec->next = rec->chain = NULL;
+
+    act = rec->actions;
+    for (ii = 0; ii < nentries; ii++) {
+        size_t flat = cache_flat_size(entries + ii);
+        if (counts[ii] && flat) {
+            act->kind = CACHE_FLAT;
+            act->pos = (unsigned)ii;
+            act->len = flat;
+            memcpy(act->flat.bytes, entry_dest(entries + ii, settings), flat);
+            act++;
+        }
+    }
+    for (ii = 0; ii < pr->nevents; ii++) {
+        const struct parse_event *ev = pr->events + ii;
+        if (ev->kind == PARSE_REST) {
+            act->kind = CACHE_REST;
+            act->argidx = ev->argidx;
+            act++;
+        } else if (ev->kind == PARSE_VALUE &&
+                cache_wants_value(ev, entries, lastval)) {
+            act->kind = CACHE_VALUE;
+            act->pos = ev->pos;
+            act->argidx = ev->argidx;
+            act->off = (size_t)(ev->value - argv[ev->argidx]);
+            act->len = ev->len;
+            act++;
+        }
+    }
+    /* Last, so that nothing is counted twice if a value fails to convert */
+    for (ii = 0; ii < nentries; ii++) {
+        if (counts[ii]) {
+            act->kind = CACHE_FOUND;
+            act->pos = (unsigned)ii;
+            act->len = (size_t)counts[ii];
+            act++;
+        }
+    }
+
+    for (text = rec->text, ii = 0; ii < (size_t)key->argc; ii++) {
+        size_t n = strlen(argv[ii]) + 1;
+        memcpy(text, argv[ii], n);
+        text += n;
+    }
+
+    if (parser->count == parser->max) {
+        cache_evict(parser);
+    }
+    bucket = parser->buckets + (key->hash & (parser->nbuckets - 1));
+    rec->chain = *bucket;
+    *bucket = rec;
+    cache_push(parser, rec);
+    parser->count++;
+
+    GT_DONE:
+    free(counts);
+    free(lastval);
+}
+
+static int
+parse_cached(cliopts_parser *parser, cliopts_entry *entries, int argc,
+             char **argv, int *lastidx,
+             struct cliopts_extra_settings *settings)
+{
+    struct cliopts_extra_settings default_settings = { 0 };
+    struct cache_key key;
+    struct cache_record *rec;
+    int rv, lastidx_s = 0;
+
+    if (!parser) {
+        return parse_options(entries, argc, argv, lastidx, settings, NULL);
+    }
+    if (!lastidx) {
+        lastidx = &lastidx_s;
+    }
+    if (!settings) {
+        settings = &default_settings;
+        settings->show_defaults = 1;
+    }
+    /*
+     * Pending values would point into the argv of the first parse, and
+     * positional arguments are not recorded
+     */
+    if (parser->max == 0 || (settings->lazy && !settings->base) ||
+            settings->positionals) {
+        parser->stats.misses++;
+        return parse_options(entries, argc, argv, lastidx, settings, NULL);
+    }
+
+    cache_make_key(&key, entries, argc, argv, settings);
+    rec = cache_find(parser, &key, argv);
+    if (rec) {
+        settings->nrestargs = 0;
+        if (settings->errors) {
+            cliopts_errors_clear(settings->errors);
+        }
+        if (cache_restore(rec, entries, argv, lastidx, settings) == 0) {
+            cache_unlink(parser, rec);
+            cache_push(parser, rec);
+            parser->stats.hits++;
+            if (settings->fingerprint) {
+                cliopts_fingerprint_compute(entries, settings,
+                                            settings->fingerprint);
+            }
+            if (settings->shm) {
+                cliopts_shm_publish(settings->shm);
+            }
+            return 0;
+        }
+    }
+
+    parser->stats.misses++;
+    parser->record.nevents = 0;
+    parser->record.failed = 0;
+    rv = parse_options(entries, argc, argv, lastidx, settings,
+                       &parser->record);
+    if (rv == 0 && !rec && !parser->record.failed) {
+        cache_store(parser, &key, entries, argv, *lastidx, settings);
+    }
+    return rv;
+}
+
+CLIOPTS_API
+cliopts_parser *
+cliopts_parser_create(size_t max_cached)
+{
+    cliopts_parser *parser = CLIOPTS_CALLOC(1, sizeof(*parser));
+
+    if (!parser) {
+        return NULL;
+    }
+    parser->max = max_cached;
+    /* At least as many buckets as records */
+    for (parser->nbuckets = 16; parser->nbuckets < max_cached;
+            parser->nbuckets *= 2) {
+    }
+    parser->buckets =
+            CLIOPTS_CALLOC(parser->nbuckets, sizeof(*parser->buckets));
+    if (!parser->buckets) {
+        free(parser);
+        return NULL;
+    }
+    return parser;
+}
+
+CLIOPTS_API
+int
+cliopts_parser_parse(cliopts_parser *parser,
+                     cliopts_entry *entries,
+                     int argc,
+                     char **argv,
+                     int *lastidx,
+                     struct cliopts_extra_settings *settings)
+{
+    return parse_cached(parser, entries, argc, argv, lastidx, settings);
+}
+
+CLIOPTS_API
+int
+cliopts_parser_parse_into(cliopts_parser *parser,
+                          const cliopts_entry *entries,
+                          void *base,
+                          int *found,
+                          int argc,
+                          char **argv,
+                          int *lastidx,
+                          struct cliopts_extra_settings *settings)
+{
+    return parse_into(parser, entries, base, found, argc, argv, lastidx,
+                      settings);
+}
+
+CLIOPTS_API
+void
+cliopts_parser_stats(const cliopts_parser *parser, cliopts_cache_stats *stats)
+{
+    *stats = parser->stats;
+}
+
+CLIOPTS_API
+void
+cliopts_parser_free(cliopts_parser *parser)
+{
+    if (!parser) {
+        return;
+    }
+    while (parser->tail) {
+        cache_evict(parser);
+    }
+    free(parser->buckets);
+    free(parser->record.events);
+    free(parser);
+}
+
+/**
+ * Fingerprints. Each entry's name and canonical value are hashed separately
+ * and the digests added up, which makes the result independent of the order
+ * of the table as well as of the command line. Since it is taken from the
+ * final values, later occurrences of an option and defaults are accounted
+ * for without any extra work.
+ */
+
+/* Write the name of an entry, a NUL and its canonical value */
+static size_t
+entry_canonical(const cliopts_entry *entry,
+                const struct cliopts_extra_settings *settings,
+                char *buf, size_t nbuf)
+{
+    const cliopts_valtype *vt = entry_valtype(entry);
+    const void *dest = entry_dest(entry, settings);
+    size_t pos;
+
+    if (entry->klong) {
+        pos = canon_put(buf, nbuf, 0, entry->klong, strlen(entry->klong) + 1);
+    } else {
+        char name[2];
+        name[0] = entry->kshort;
+        name[1] = '\0';
+        pos = canon_put(buf, nbuf, 0, name, sizeof name);
+    }
+
+    /* A value pending in lazy mode is converted now, so that e.g. 16 and
+     * 0x10 hash the same. Only a parse sets pending, so the table is not
+     * really const. An invalid one can only be hashed as given */
+    if (entry->pending &&
+            cliopts_entry_convert((cliopts_entry *)entry, NULL) != 0) {
+        pos = canon_put(buf, nbuf, pos, "p", 1);
+        return canon_put(buf, nbuf, pos, entry->pending,
+                         strlen(entry->pending));
+    }
+    if (vt && vt->canonical) {
+        return pos + vt->canonical(dest, entry->vtype_arg,
+                                   pos < nbuf ? buf + pos : NULL,
+                                   pos < nbuf ? nbuf - pos : 0);
+    }
+    if (vt && vt->format) {
+        /* The display form does not report its full length, so ask for
+         * twice the room whenever it fills what there is */
+        size_t avail = pos < nbuf ? nbuf - pos : 0, len;
+        if (avail < 2) {
+            return pos + 64;
+        }
+        vt->format(dest, entry->vtype_arg, buf + pos, avail);
+        len = strlen(buf + pos);
+        if (len + 1 >= avail) {
+            return pos + avail * 2;
+        }
+        pos += len;
+    }
+    return pos;
+}
+
+static int
+fingerprint_chain(const struct cliopts_chain_st *chain,
+                  const struct cliopts_extra_settings *settings,
+                  cliopts_fingerprint *fp)
+{
+    const cliopts_entry *cur;
+    unsigned long long sum[2] = { 0, 0 }, h[2];
+    char stackbuf[512], *buf = stackbuf;
+    size_t ii, n, nbuf = sizeof stackbuf;
+    int rv = 0;
+
+    for (ii = 0; ii < chain->ntables && rv == 0; ii++) {
+        for (cur = chain->tables[ii].entries; cur->dest; cur++) {
+            if (cur->nonsemantic) {
+                continue;
+            }
+            n = entry_canonical(cur, settings, buf, nbuf);
+            while (n > nbuf) {
+                char *bigger = CLIOPTS_MALLOC(n);
+                if (!bigger) {
+                    rv = -1;
+                    break;
+                }
+                if (buf != stackbuf) {
+                    free(buf);
+                }
+                buf = bigger;
+                nbuf = n;
+                n = entry_canonical(cur, settings, buf, nbuf);
+            }
+            if (rv != 0) {
+                break;
+            }
+            hash128(buf, n, h);
+            sum[0] += h[0];
+            sum[1] += h[1];
+        }
+    }
+    if (buf != stackbuf) {
+        free(buf);
+    }
+
+    if (rv != 0) {
+        memset(fp, 0, sizeof(*fp));
+    } else {
+        canon_put_digest((char *)fp->bytes, sizeof fp->bytes, 0, sum);
+    }
+    return rv;
+}
+
+CLIOPTS_API
+int
+cliopts_fingerprint_compute(const cliopts_entry *entries,
+                            const struct cliopts_extra_settings *settings,
+                            cliopts_fingerprint *fp)
+{
+    struct cliopts_chain_st chain;
+    chain_init_single(&chain, (cliopts_entry *)entries);
+    return fingerprint_chain(&chain, settings, fp);
+}
+
+/**
+ * Command line strings. The words are built in a buffer which follows the
+ * argv array in the same allocation; since quotes and separators are
+ * dropped, the words and their terminating NULs never need more space than
+ * the string itself.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || \
+        (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLIOPTS_HAVE_SSE2
+#endif
+
+/* Quoting states. Each has its own set of characters ending a literal run */
+#define SPLIT_PLAIN 0
+#define SPLIT_SQUOTE 1
+#define SPLIT_DQUOTE 2
+
+static int
+split_special(int c, int state)
+{
+    switch (state) {
+    case SPLIT_SQUOTE:
+        return c == '\'';
+    case SPLIT_DQUOTE:
+        return c == '"' || c == '\\';
+    default:
+        return c == '\'' || c == '"' || c == '\\' ||
+                c == ' ' || c == '\t' || c == '\n';
+    }
+}
+
+/**
+ * Return the first position in [p, end) holding a character which is
+ * special in the given quoting state, or end if there is none. Most of a
+ * command line is literal text, so this is done 16 bytes at a time where
+ * SSE2 is available.
+ */
+static const char *
+split_scan(const char *p, const char *end, int state)
+{
+#ifdef CLIOPTS_HAVE_SSE2
+    const __m128i sq = _mm_set1_epi8('\'');
+    const __m128i dq = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\');
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m;
+        unsigned bits;
+
+        if (state == SPLIT_SQUOTE) {
+            m = _mm_cmpeq_epi8(v, sq);
+        } else {
+            m = _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, bs));
+            if (state == SPLIT_PLAIN) {
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, sq));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, sp));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, tab));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nl));
+            }
+        }
+        bits = (unsigned)_mm_movemask_epi8(m);
+        if (bits) {
+#ifdef __GNUC__
+            return p + __builtin_ctz(bits);
+#else
+            for (; !(bits & 1); bits >>= 1) {
+                p++;
+            }
+            return p;
+#endif
+        }
+    }
+#endif /* CLIOPTS_HAVE_SSE2 */
+    for (; p < end; p++) {
+        if (split_special(*p, state)) {
+            return p;
+        }
+    }
+    return end;
+}
+
+CLIOPTS_API
+int
+cliopts_split_string(const char *cmdline, int *argcp, char ***argvp,
+                     char **errp)
+{
+    size_t len = strlen(cmdline);
+    /* Each word takes at least one character and one separator (except the
+     * last), so this always has room for the words and the NULL */
+    size_t maxwords = len / 2 + 2;
+    const char *p = cmdline, *end = cmdline + len;
+    char **argv;
+    char *out;
+    int argc = 0, state = SPLIT_PLAIN, inword = 0;
+
+    argv = CLIOPTS_MALLOC(maxwords * sizeof(*argv) + len + 1);
+    if (!argv) {
+        *errp = "Out of memory";
+        return -1;
+    }
+    out = (char *)(argv + maxwords);
+
+    while (1) {
+        const char *next = split_scan(p, end, state);
+        int c;
+
+        if (next != p) {
+            if (!inword) {
+                argv[argc++] = out;
+                inword = 1;
+            }
+            memcpy(out, p, next - p);
+            out += next - p;
+            p = next;
+        }
+        if (p == end) {
+            break;
+        }
+
+        c = *p++;
+        if (state == SPLIT_PLAIN && (c == ' ' || c == '\t' || c == '\n')) {
+            if (inword) {
+                *out++ = '\0';
+                inword = 0;
+            }
+            continue;
+        }
+
+        if (c == '\\' && p < end && *p == '\n') {
+            /* Line continuation */
+            p++;
+            continue;
+        }
+
+        if (!inword) {
+            argv[argc++] = out;
+            inword = 1;
+        }
+
+        if (c == '\\') {
+            if (p == end) {
+                *out++ = '\\';
+            } else if (state == SPLIT_DQUOTE &&
+                    *p != '"' && *p != '\\' && *p != '$' && *p != '`') {
+                /* Inside double quotes, other backslashes are literal */
+                *out++ = '\\';
+            } else {
+                *out++ = *p++;
+            }
+        } else if (c == '\'') {
+            state = state == SPLIT_SQUOTE ? SPLIT_PLAIN : SPLIT_SQUOTE;
+        } else {
+            state = state == SPLIT_DQUOTE ? SPLIT_PLAIN : SPLIT_DQUOTE;
+        }
+    }
+
+    if (state != SPLIT_PLAIN) {
+        free(argv);
+        *errp = state == SPLIT_SQUOTE ?
+                "Unterminated single quote" : "Unterminated double quote";
+        return -1;
+    }
+    if (inword) {
+        *out = '\0';
+    }
+    argv[argc] = NULL;
+    *argcp = argc;
+    *argvp = argv;
+    return 0;
+}
+
+CLIOPTS_API
+int
+cliopts_parse_string(cliopts_entry *entries,
+                     const char *cmdline,
+                     int *lastidx,
+                     struct cliopts_extra_settings *settings,
+                     char ***argvp)
+{
+    char **argv;
+    char *errstr = NULL;
+    const char *progname = settings ? settings->progname : NULL;
+    int argc, ret;
+
+    if (cliopts_split_string(cmdline, &argc, &argv, &errstr) != 0) {
+        fprintf(stderr, "Couldn't split command line: %s\n", errstr);
+        if (!settings || settings->error_noexit == 0) {
+            exit(EXIT_FAILURE);
+        }
+        return -1;
+    }
+
+    ret = cliopts_parse_options(entries, argc, argv, lastidx, settings);
+    if (argvp) {
+        *argvp = argv;
+    } else {
+        /* Don't leave the program name pointing at the released words */
+        if (settings) {
+            settings->progname = progname;
+        }
+        free(argv);
     }
+    return ret;
+}
 
-    if (ctx->current_value[0]) {
-        /* --foo=bar */
-        if (ctx->current->ktype == CLIOPTS_ARGT_NONE) {
-            ctx->errnum = CLIOPTS_ERR_ISSWITCH;
-            ctx->errstr = "Option takes no arguments";
-            return MODE_ERROR;
-        } else {
-            return parse_value(ctx, ctx->current_value);
+/**
+ * Runtime schemas. A schema file is compiled into a flat image (a header,
+ * one record per option, the sorted order of the long names, the enum
+ * choices and a string pool), from which the table and index are built.
+ * The image doubles as the cache format, so a valid sidecar file can be
+ * mapped and used as is, skipping both the parsing and the sort.
+ */
+#define SCHEMA_MAGIC "CLIOSCH\1"
+#define SCHEMA_VERSION 1
+
+struct schema_header {
+    char magic[8];
+    unsigned version;
+    /* Length and hashes of the schema source the image was compiled from */
+    unsigned srclen;
+    unsigned srchash[2];
+    unsigned nentries;
+    unsigned nlong;
+    unsigned nchoices;
+    unsigned npool;
+};
+
+struct schema_record {
+    /* Offsets into the string pool, 0 if not set */
+    unsigned klong;
+    unsigned help;
+    unsigned vdesc;
+    unsigned defval;
+    /* Range in the choice array, for enums */
+    unsigned choices;
+    unsigned nchoices;
+    unsigned char kshort;
+    unsigned char ktype;
+    unsigned char required;
+    unsigned char hidden;
+};
+
+/* Storage for the value of a schema option */
+union schema_value {
+    char c;
+    int i;
+    unsigned u;
+    float f;
+    double d;
+    char *s;
+    cliopts_list l;
+    cliopts_numlist nl;
+    cliopts_map m;
+    cliopts_blob b;
+    cliopts_strpool sp;
+#ifdef ULLONG_MAX
+    unsigned long long ull;
+    long long ll;
+#endif
+};
+
+struct cliopts_schema_st {
+    char *image;
+    size_t nimage;
+    int mapped;
+
+    cliopts_entry *entries;
+    union schema_value *values;
+    cliopts_choice *choices;
+    cliopts_index *idx;
+};
+
+struct schema_builder {
+    struct schema_record *recs;
+    size_t nrecs, nrecs_alloc;
+    unsigned *choices;
+    size_t nchoices, nchoices_alloc;
+    char *pool;
+    size_t npool, npool_alloc;
+    int oom;
+};
+
+static void
+schema_hash(const char *s, size_t n, unsigned *hash)
+{
+    /* FNV-1a, and a multiplicative hash to make up 64 bits */
+    unsigned long h1 = 2166136261UL, h2 = 5381;
+    size_t ii;
+    for (ii = 0; ii < n; ii++) {
+        h1 = ((h1 ^ (unsigned char)s[ii]) * 16777619UL) & 0xffffffffUL;
+        h2 = (h2 * 33 + (unsigned char)s[ii]) & 0xffffffffUL;
+    }
+    hash[0] = (unsigned)h1;
+    hash[1] = (unsigned)h2;
+}
+
+/* Make room for one more element in a growable array */
+static void *
+schema_grow(void *arr, size_t n, size_t *nalloc, size_t size, int *oom)
+{
+    void *tmp;
+    if (n < *nalloc) {
+        return arr;
+    }
+    tmp = CLIOPTS_REALLOC(arr, (*nalloc ? *nalloc * 2 : 16) * size);
+    if (!tmp) {
+        *oom = 1;
+        return NULL;
+    }
+    *nalloc = *nalloc ? *nalloc * 2 : 16;
+    return tmp;
+}
+
+static unsigned
+builder_str(struct schema_builder *b, const char *s, size_t n)
+{
+    unsigned off;
+    while (b->npool + n + 1 > b->npool_alloc) {
+        char *tmp = CLIOPTS_REALLOC(b->pool, b->npool_alloc * 2);
+        if (!tmp) {
+            b->oom = 1;
+            return 0;
         }
+        b->pool = tmp;
+        b->npool_alloc *= 2;
     }
+    off = (unsigned)b->npool;
+    memcpy(b->pool + off, s, n);
+    b->pool[off + n] = '\0';
+    b->npool += n + 1;
+    return off;
+}
 
-    if (ctx->current->ktype == CLIOPTS_ARGT_NONE) {
-        *(char*)ctx->current->dest = 1;
+static int
+builder_choices(struct schema_builder *b, struct schema_record *rec,
+                const char *s)
+{
+    rec->choices = (unsigned)b->nchoices;
+    while (1) {
+        const char *end = strchr(s, ',');
+        size_t n = end ? (size_t)(end - s) : strlen(s);
+        unsigned *tmp;
+        if (!n) {
+            return -1;
+        }
+        tmp = schema_grow(b->choices, b->nchoices, &b->nchoices_alloc,
+                          sizeof(*b->choices), &b->oom);
+        if (!tmp) {
+            return -1;
+        }
+        b->choices = tmp;
+        b->choices[b->nchoices++] = builder_str(b, s, n);
+        rec->nchoices++;
+        if (!end) {
+            return 0;
+        }
+        s = end + 1;
+    }
+}
 
-        if (prefix_len == 1 && klen > 1) {
-            /**
-             * e.g. ls -lsh
-             */
-            klen--;
-            key++;
+static int
+schema_type_lookup(const char *name)
+{
+    size_t ii;
+    for (ii = 0; ii < sizeof(builtin_types) / sizeof(*builtin_types); ii++) {
+        const cliopts_valtype *vt = builtin_types + ii;
+        if (strcmp(vt->name, name) == 0 &&
+                (vt->extract || ii == CLIOPTS_ARGT_NONE)) {
+            return (int)ii;
+        }
+    }
+    return -1;
+}
 
-            /**
-             * While we can also possibly recurse, this may be a security risk
-             * as it wouldn't take much to cause a deep recursion on the stack
-             * which will cause all sorts of nasties.
-             */
-            goto GT_PARSEOPT;
+/**
+ * Compile one line of the schema: a list of attributes, e.g.
+ * long=threads short=t type=int default=4 help="Worker threads"
+ */
+static int
+schema_compile_line(struct schema_builder *b, char *line, char **errp)
+{
+    struct schema_record rec, *recs;
+    char **argv;
+    int argc, ii, ktype = -1;
+
+    if (cliopts_split_string(line, &argc, &argv, errp) != 0) {
+        return -1;
+    }
+    if (argc == 0 || argv[0][0] == '#') {
+        free(argv);
+        return 0;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    for (ii = 0; ii < argc; ii++) {
+        char *key = argv[ii], *val = strchr(key, '=');
+        if (val) {
+            *val++ = '\0';
         }
-        return WANT_OPTION;
+        if (strcmp(key, "required") == 0 && !val) {
+            rec.required = 1;
+        } else if (strcmp(key, "hidden") == 0 && !val) {
+            rec.hidden = 1;
+        } else if (!val) {
+            *errp = "Expected attribute=value";
+            goto GT_ERR;
+        } else if (strcmp(key, "short") == 0) {
+            if (strlen(val) != 1) {
+                *errp = "Short names must be a single character";
+                goto GT_ERR;
+            }
+            rec.kshort = (unsigned char)*val;
+        } else if (strcmp(key, "long") == 0) {
+            rec.klong = builder_str(b, val, strlen(val));
+        } else if (strcmp(key, "type") == 0) {
+            if ((ktype = schema_type_lookup(val)) < 0) {
+                *errp = "Unknown option type";
+                goto GT_ERR;
+            }
+            rec.ktype = (unsigned char)ktype;
+        } else if (strcmp(key, "default") == 0) {
+            rec.defval = builder_str(b, val, strlen(val));
+        } else if (strcmp(key, "help") == 0) {
+            rec.help = builder_str(b, val, strlen(val));
+        } else if (strcmp(key, "value") == 0) {
+            rec.vdesc = builder_str(b, val, strlen(val));
+        } else if (strcmp(key, "choices") == 0) {
+            if (builder_choices(b, &rec, val) != 0) {
+                *errp = "Bad list of choices";
+                goto GT_ERR;
+            }
+        } else {
+            *errp = "Unknown attribute";
+            goto GT_ERR;
+        }
+    }
 
-    } else if (prefix_len == 1 && klen > 1) {
+    if (!rec.kshort && !rec.klong) {
+        *errp = "Option has no name";
+        goto GT_ERR;
+    } else if (ktype < 0) {
+        *errp = "Option has no type";
+        goto GT_ERR;
+    } else if ((ktype == CLIOPTS_ARGT_ENUM) != (rec.nchoices != 0)) {
+        *errp = "Choices must be given for enums, and only for enums";
+        goto GT_ERR;
+    } else if (rec.defval && (ktype == CLIOPTS_ARGT_NONE ||
+            (builtin_types[ktype].flags & CLIOPTS_VT_MULTI))) {
+        *errp = "Switches and multi-valued options cannot have a default";
+        goto GT_ERR;
+    }
 
-        /* e.g. patch -p0 */
-        ctx->wanted = WANT_VALUE;
-        return parse_value(ctx, key + 1);
+    recs = schema_grow(b->recs, b->nrecs, &b->nrecs_alloc, sizeof(*b->recs),
+                       &b->oom);
+    if (recs) {
+        b->recs = recs;
+        b->recs[b->nrecs++] = rec;
     }
-    return WANT_VALUE;
+    free(argv);
+    return 0;
+
+    GT_ERR:
+    free(argv);
+    return -1;
 }
 
+/* Compile schema source (which is modified) into an image */
 static char *
-get_option_name(cliopts_entry *entry, char *buf)
+schema_compile(char *src, size_t nsrc, const unsigned *hash, size_t *nimage,
+               char **errp)
 {
-    /* [-s,--option] */
-    char *bufp = buf;
-    bufp += sprintf(buf, "[");
-    if (entry->kshort) {
-        bufp += sprintf(bufp, "-%c", entry->kshort);
+    struct schema_builder b;
+    struct schema_header hdr;
+    struct cliopts_index_slot *slots = NULL;
+    char *line, *image = NULL, *p;
+    size_t ii, nlong = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.npool_alloc = 256;
+    b.pool = CLIOPTS_MALLOC(b.npool_alloc);
+    if (!b.pool) {
+        *errp = "Out of memory";
+        return NULL;
     }
-    if (entry->klong) {
-        if (entry->kshort) {
-            bufp += sprintf(bufp, ",");
+    /* Offset 0 means "not set" */
+    b.pool[b.npool++] = '\0';
+
+    for (line = src; line < src + nsrc; line = p + 1) {
+        p = memchr(line, '\n', src + nsrc - line);
+        if (!p) {
+            p = src + nsrc;
+        }
+        *p = '\0';
+        if (schema_compile_line(&b, line, errp) != 0) {
+            goto GT_DONE;
         }
-        bufp += sprintf(bufp, "--%s", entry->klong);
     }
-    sprintf(bufp, "]");
-    return buf;
+    if (b.oom) {
+        *errp = "Out of memory";
+        goto GT_DONE;
+    }
+
+    /* Sort the long names once, here, rather than on every load */
+    slots = CLIOPTS_MALLOC(sizeof(*slots) * (b.nrecs + 1));
+    if (!slots) {
+        *errp = "Out of memory";
+        goto GT_DONE;
+    }
+    for (ii = 0; ii < b.nrecs; ii++) {
+        if (b.recs[ii].klong) {
+            slots[nlong].name = b.pool + b.recs[ii].klong;
+            slots[nlong].entry = NULL;
+            slots[nlong].ord = (unsigned)ii;
+            nlong++;
+        }
+    }
+    qsort(slots, nlong, sizeof(*slots), index_slot_cmp);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SCHEMA_MAGIC, sizeof(hdr.magic));
+    hdr.version = SCHEMA_VERSION;
+    hdr.srclen = (unsigned)nsrc;
+    hdr.srchash[0] = hash[0];
+    hdr.srchash[1] = hash[1];
+    hdr.nentries = (unsigned)b.nrecs;
+    hdr.nlong = (unsigned)nlong;
+    hdr.nchoices = (unsigned)b.nchoices;
+    hdr.npool = (unsigned)b.npool;
+
+    *nimage = sizeof(hdr) + b.nrecs * sizeof(*b.recs) +
+            (nlong + b.nchoices) * sizeof(unsigned) + b.npool;
+    image = CLIOPTS_MALLOC(*nimage);
+    if (!image) {
+        *errp = "Out of memory";
+        goto GT_DONE;
+    }
+    p = image;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    if (b.nrecs) {
+        memcpy(p, b.recs, b.nrecs * sizeof(*b.recs));
+        p += b.nrecs * sizeof(*b.recs);
+    }
+    for (ii = 0; ii < nlong; ii++, p += sizeof(unsigned)) {
+        memcpy(p, &slots[ii].ord, sizeof(unsigned));
+    }
+    if (b.nchoices) {
+        memcpy(p, b.choices, b.nchoices * sizeof(unsigned));
+        p += b.nchoices * sizeof(unsigned);
+    }
+    memcpy(p, b.pool, b.npool);
+
+    GT_DONE:
+    free(slots);
+    free(b.recs);
+    free(b.choices);
+    free(b.pool);
+    return image;
 }
 
-static int get_terminal_width(void)
+/**
+ * Check that an image is intact and was compiled from the given source.
+ * A cache file is untrusted input, so every offset is checked here.
+ */
+static int
+schema_image_valid(const char *image, size_t nimage, size_t nsrc,
+                   const unsigned *hash)
 {
-#ifndef _WIN32
-    struct winsize max;
-    if (ioctl(0, TIOCGWINSZ, &max) != -1) {
-        return max.ws_col;
-    } else {
-        return 80;
+    struct schema_header hdr;
+    const struct schema_record *recs;
+    const unsigned *order, *choices;
+    const char *pool;
+    size_t ii;
+
+    if (nimage < sizeof(hdr)) {
+        return 0;
     }
-#else
-    CONSOLE_SCREEN_BUFFER_INFO cbsi;
-    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &cbsi);
-    return cbsi.srWindow.Right - cbsi.srWindow.Left;
-#endif
+    memcpy(&hdr, image, sizeof(hdr));
+    if (memcmp(hdr.magic, SCHEMA_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != SCHEMA_VERSION || hdr.srclen != nsrc ||
+            hdr.srchash[0] != hash[0] || hdr.srchash[1] != hash[1]) {
+        return 0;
+    }
+    if (hdr.nentries > nimage / sizeof(*recs) || hdr.nlong > hdr.nentries ||
+            hdr.nchoices > nimage / sizeof(unsigned) || hdr.npool == 0 ||
+            nimage != sizeof(hdr) + hdr.nentries * sizeof(*recs) +
+            ((size_t)hdr.nlong + hdr.nchoices) * sizeof(unsigned) +
+            hdr.npool) {
+        return 0;
+    }
+
+    recs = (const struct schema_record *)(image + sizeof(hdr));
+    order = (const unsigned *)(recs + hdr.nentries);
+    choices = order + hdr.nlong;
+    pool = (const char *)(choices + hdr.nchoices);
+    if (pool[hdr.npool - 1] != '\0') {
+        return 0;
+    }
+
+    for (ii = 0; ii < hdr.nentries; ii++) {
+        const struct schema_record *rec = recs + ii;
+        if (rec->klong >= hdr.npool || rec->help >= hdr.npool ||
+                rec->vdesc >= hdr.npool || rec->defval >= hdr.npool ||
+                rec->choices > hdr.nchoices ||
+                rec->nchoices > hdr.nchoices - rec->choices ||
+                rec->ktype >= sizeof(builtin_types) / sizeof(*builtin_types) ||
+                (!builtin_types[rec->ktype].extract &&
+                        rec->ktype != CLIOPTS_ARGT_NONE)) {
+            return 0;
+        }
+    }
+    for (ii = 0; ii < hdr.nlong; ii++) {
+        if (order[ii] >= hdr.nentries || !recs[order[ii]].klong) {
+            return 0;
+        }
+    }
+    for (ii = 0; ii < hdr.nchoices; ii++) {
+        if (choices[ii] >= hdr.npool) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-static char*
-format_option_help(cliopts_entry *entry,
-                   char *buf,
-                   struct cliopts_extra_settings *settings)
+static void
+schema_clear_value(const cliopts_schema *schema, int ktype,
+                   union schema_value *val)
 {
-    char *bufp = buf;
-    if (entry->kshort) {
-        bufp += sprintf(bufp, " -%c ", entry->kshort);
+    switch (ktype) {
+    case CLIOPTS_ARGT_STRING:
+        /* Defaults point into the image */
+        if (val->s < schema->image ||
+                val->s >= schema->image + schema->nimage) {
+            free(val->s);
+        }
+        break;
+    case CLIOPTS_ARGT_LIST:
+        cliopts_list_clear(&val->l);
+        break;
+    case CLIOPTS_ARGT_INT_LIST:
+    case CLIOPTS_ARGT_UINT_LIST:
+    case CLIOPTS_ARGT_ULONGLONG_LIST:
+    case CLIOPTS_ARGT_FLOAT_LIST:
+        cliopts_numlist_clear(&val->nl);
+        break;
+    case CLIOPTS_ARGT_SET:
+    case CLIOPTS_ARGT_MAP:
+        cliopts_map_clear(&val->m);
+        break;
+    case CLIOPTS_ARGT_BLOB:
+        cliopts_blob_clear(&val->b);
+        break;
+    case CLIOPTS_ARGT_STRPOOL:
+        cliopts_strpool_clear(&val->sp);
+        break;
+    default:
+        break;
     }
+}
 
-#define _advance_margin(offset) \
-    while(bufp-buf < offset || *bufp) { \
-        if (!*bufp) { \
-            *bufp = ' '; \
-        } \
-        bufp++; \
+CLIOPTS_API
+void
+cliopts_schema_free(cliopts_schema *schema)
+{
+    size_t ii;
+    if (!schema) {
+        return;
+    }
+    if (schema->entries) {
+        for (ii = 0; schema->entries[ii].dest; ii++) {
+            schema_clear_value(schema, schema->entries[ii].ktype,
+                               schema->values + ii);
+        }
+    }
+    cliopts_index_free(schema->idx);
+    free(schema->entries);
+    free(schema->values);
+    free(schema->choices);
+#ifndef _WIN32
+    if (schema->mapped) {
+        munmap(schema->image, schema->nimage);
+    } else
+#endif
+    {
+        free(schema->image);
     }
+    free(schema);
+}
 
-    _advance_margin(4)
+/**
+ * Build the table from a valid image. Strings are used in place, so the
+ * image must live as long as the schema.
+ */
+static int
+schema_instantiate(cliopts_schema *schema, char **errp)
+{
+    struct schema_header hdr;
+    const struct schema_record *recs;
+    const unsigned *order, *choices;
+    const char *pool;
+    cliopts_choice *nextchoice;
+    size_t ii, jj;
 
-    if (entry->klong) {
-        bufp += sprintf(bufp, " --%s ", entry->klong);
+    memcpy(&hdr, schema->image, sizeof(hdr));
+    recs = (const struct schema_record *)(schema->image + sizeof(hdr));
+    order = (const unsigned *)(recs + hdr.nentries);
+    choices = order + hdr.nlong;
+    pool = (const char *)(choices + hdr.nchoices);
+
+    schema->entries =
+            CLIOPTS_CALLOC(hdr.nentries + 1, sizeof(*schema->entries));
+    schema->values = CLIOPTS_CALLOC(hdr.nentries + 1, sizeof(*schema->values));
+    /* Each enum's choices are followed by a terminator */
+    schema->choices = CLIOPTS_CALLOC(hdr.nchoices + hdr.nentries + 1,
+                                     sizeof(*schema->choices));
+    if (!schema->entries || !schema->values || !schema->choices) {
+        *errp = "Out of memory";
+        return -1;
     }
 
-    if (entry->vdesc) {
-        bufp += sprintf(bufp, " <%s> ", entry->vdesc);
+    nextchoice = schema->choices;
+    for (ii = 0; ii < hdr.nentries; ii++) {
+        const struct schema_record *rec = recs + ii;
+        cliopts_entry *ent = schema->entries + ii;
+
+        ent->kshort = rec->kshort;
+        ent->klong = rec->klong ? pool + rec->klong : NULL;
+        ent->ktype = (cliopts_argtype_t)rec->ktype;
+        ent->dest = schema->values + ii;
+        ent->help = rec->help ? pool + rec->help : NULL;
+        ent->vdesc = rec->vdesc ? pool + rec->vdesc : NULL;
+        ent->required = rec->required;
+        ent->hidden = rec->hidden;
+
+        if (rec->nchoices) {
+            ent->vtype_arg = nextchoice;
+            for (jj = 0; jj < rec->nchoices; jj++, nextchoice++) {
+                nextchoice->name = pool + choices[rec->choices + jj];
+                nextchoice->value = (int)jj;
+            }
+            nextchoice++;
+        }
+
+        if (rec->defval && rec->ktype == CLIOPTS_ARGT_STRING) {
+            schema->values[ii].s = (char *)pool + rec->defval;
+        } else if (rec->defval) {
+            const char *defval = pool + rec->defval;
+            const cliopts_valtype *vt = builtin_types + rec->ktype;
+            if (vt->extract(defval, strlen(defval), ent->dest, ent->vtype_arg,
+                            errp) != 0) {
+                return -1;
+            }
+        }
     }
 
-    _advance_margin(35)
-#undef _advance_margin
+    schema->idx = index_build(schema->entries, order, hdr.nlong);
+    if (!schema->idx) {
+        *errp = "Out of memory";
+        return -1;
+    }
+    return 0;
+}
 
-    if (entry->help) {
-        unsigned initial_indent = bufp - buf + 1;
-        int curpos = initial_indent;
-        const char *help_p = entry->help;
+static char *
+schema_read_file(const char *path, size_t *np)
+{
+    FILE *fp = fopen(path, "rb");
+    char *buf = NULL;
+    size_t n = 0, nalloc = 0;
 
-        for (; *help_p; help_p++, curpos++, bufp++) {
+    if (!fp) {
+        return NULL;
+    }
+    while (1) {
+        size_t nr;
+        if (n == nalloc) {
+            char *tmp = CLIOPTS_REALLOC(buf, nalloc ? nalloc * 2 : 4096);
+            if (!tmp) {
+                free(buf);
+                fclose(fp);
+                return NULL;
+            }
+            buf = tmp;
+            nalloc = nalloc ? nalloc * 2 : 4096;
+        }
+        nr = fread(buf + n, 1, nalloc - n, fp);
+        n += nr;
+        if (nr == 0) {
+            break;
+        }
+    }
+    if (ferror(fp)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    *np = n;
+    return buf;
+}
 
-            if (curpos >= settings->line_max) {
-                unsigned ii;
-                if (!isspace(*help_p) && !isspace(*(help_p-1))) {
-                    *bufp = '-';
-                    bufp++;
-                }
-                *bufp = '\n';
-                bufp++;
+/* Map (or read) a cache file, returning it if it matches the source */
+static int
+schema_load_cache(cliopts_schema *schema, const char *cachepath,
+                  size_t nsrc, const unsigned *hash)
+{
+#ifndef _WIN32
+    struct stat st;
+    int fd = open(cachepath, O_RDONLY);
+    void *addr;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    if (!schema_image_valid(addr, (size_t)st.st_size, nsrc, hash)) {
+        munmap(addr, (size_t)st.st_size);
+        return -1;
+    }
+    schema->image = addr;
+    schema->nimage = (size_t)st.st_size;
+    schema->mapped = 1;
+    return 0;
+#else
+    size_t n;
+    char *buf = schema_read_file(cachepath, &n);
+    if (!buf) {
+        return -1;
+    }
+    if (!schema_image_valid(buf, n, nsrc, hash)) {
+        free(buf);
+        return -1;
+    }
+    schema->image = buf;
+    schema->nimage = n;
+    return 0;
+#endif
+}
 
-                for (ii = 0; ii < initial_indent+1; ii++, bufp++) {
-                    *bufp = ' ';
-                }
+/* Write the cache through a temporary file, so readers never see it
+ * partially written. Failure only means the next load compiles again */
+static void
+schema_write_cache(const char *cachepath, const char *image, size_t nimage)
+{
+    size_t npath = strlen(cachepath);
+    char *tmppath = CLIOPTS_MALLOC(npath + 5);
+    FILE *fp;
+    int ok;
 
-                curpos = initial_indent;
-                if (isspace(*help_p)) {
-                    bufp--;
-                    continue;
-                }
-            }
-            *bufp = *help_p;
-        }
+    if (!tmppath) {
+        return;
     }
+    memcpy(tmppath, cachepath, npath);
+    memcpy(tmppath + npath, ".tmp", 5);
 
-    *bufp = '\0';
-    return buf;
+    fp = fopen(tmppath, "wb");
+    if (!fp) {
+        free(tmppath);
+        return;
+    }
+    ok = fwrite(image, 1, nimage, fp) == nimage;
+    ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+    if (ok) {
+        remove(cachepath);
+    }
+#endif
+    if (!ok || rename(tmppath, cachepath) != 0) {
+        remove(tmppath);
+    }
+    free(tmppath);
 }
 
-static void
-print_help(struct cliopts_priv *ctx, struct cliopts_extra_settings *settings)
+CLIOPTS_API
+cliopts_schema *
+cliopts_schema_load(const char *path, const char *cachepath, char **errp)
 {
-    cliopts_entry *cur;
-    cliopts_entry helpent = { 0 };
-    char helpbuf[1024] = { 0 };
-
-    helpent.klong = "help";
-    helpent.kshort = '?';
-    helpent.help = "this message";
+    cliopts_schema *schema;
+    unsigned hash[2];
+    char *src;
+    size_t nsrc;
 
-    fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  %s %s", settings->progname, settings->argstring);
+    src = schema_read_file(path, &nsrc);
+    if (!src) {
+        *errp = "Couldn't read schema file";
+        return NULL;
+    }
+    if (nsrc > UINT_MAX) {
+        free(src);
+        *errp = "Schema file too large";
+        return NULL;
+    }
+    schema_hash(src, nsrc, hash);
 
-    if (settings->argstring_restargs) {
-        fprintf(stderr, " %s", settings->argstring_restargs);
+    schema = CLIOPTS_CALLOC(1, sizeof(*schema));
+    if (!schema) {
+        free(src);
+        *errp = "Out of memory";
+        return NULL;
     }
 
-    fprintf(stderr, "\n\n");
-    if (settings->shortdesc) {
-        fprintf(stderr, "%s", settings->shortdesc);
-        fprintf(stderr, "\n");
+    if (!cachepath || schema_load_cache(schema, cachepath, nsrc, hash) != 0) {
+        schema->image = schema_compile(src, nsrc, hash, &schema->nimage, errp);
+        if (schema->image && cachepath) {
+            schema_write_cache(cachepath, schema->image, schema->nimage);
+        }
     }
+    free(src);
 
+    if (!schema->image || schema_instantiate(schema, errp) != 0) {
+        cliopts_schema_free(schema);
+        return NULL;
+    }
+    return schema;
+}
 
-    for (cur = ctx->entries; cur->dest; cur++) {
-        if (cur->hidden) {
-            continue;
-        }
+CLIOPTS_API
+cliopts_entry *
+cliopts_schema_entries(cliopts_schema *schema)
+{
+    return schema->entries;
+}
 
-        memset(helpbuf, 0, sizeof(helpbuf));
-        format_option_help(cur, helpbuf, settings);
-        fprintf(stderr, INDENT "%s", helpbuf);
+CLIOPTS_API
+const cliopts_index *
+cliopts_schema_index(const cliopts_schema *schema)
+{
+    return schema->idx;
+}
 
+CLIOPTS_API
+cliopts_entry *
+cliopts_schema_find(cliopts_schema *schema, const char *name)
+{
+    long pos = index_position(schema->idx, name);
+    return pos < 0 ? NULL : schema->idx->all[pos];
+}
 
-        if (settings->show_defaults && !cur->required) {
-            fprintf(stderr, " [Default=");
+/**
+ * Shared memory publishing. A segment is a header, one descriptor per
+ * option, a string pool holding the names and types, and the value slots,
+ * which are all that changes once the segment exists. The writer formats
+ * the values into a private shadow of the slots and copies it in under the
+ * sequence lock, so that the lock is only held for a memcpy; readers copy
+ * the slots out and retry if the sequence changed meanwhile.
+ */
+#define SHM_MAGIC "CLIOSHM\1"
+#define SHM_VERSION 2
+/* Capacity of the value slots, including the trailing NUL */
+#define SHM_SLOT_SCALAR 64
+#define SHM_SLOT_TEXT 1024
+/* How many times a reader tries to get a consistent copy */
+#define SHM_SAMPLE_TRIES 1000
 
-            switch (cur->ktype) {
-            case CLIOPTS_ARGT_STRING:
-                fprintf(stderr, "'%s'", (cur->dest && *(char **)cur->dest) ?
-                        *(char**)cur->dest : "");
-                break;
-            case CLIOPTS_ARGT_LIST: {
-                size_t ii;
-                cliopts_list *l = (cliopts_list *)cur->dest;
-                for (ii = 0; ii < l->nvalues; ii++) {
-                    fprintf(stderr, "'%s'", l->values[ii]);
-                    if (ii != l->nvalues-1) {
-                        fprintf(stderr, ", ");
-                    }
-                }
-                break;
-            }
-            case CLIOPTS_ARGT_FLOAT:
-                fprintf(stderr, "%0.2f", *(float*)cur->dest);
-                break;
-            case CLIOPTS_ARGT_HEX:
-                fprintf(stderr, "0x%x", *(int*)cur->dest);
-                break;
-            case CLIOPTS_ARGT_INT:
-                fprintf(stderr, "%d", *(int*)cur->dest);
-                break;
-            case CLIOPTS_ARGT_UINT:
-                fprintf(stderr, "%u", *(unsigned int*)cur->dest);
-                break;
-#ifdef ULLONG_MAX
-            case CLIOPTS_ARGT_ULONGLONG:
-                fprintf(stderr, "%llu", *(unsigned long long*)cur->dest);
-                break;
+#if defined(__GNUC__)
+#define SHM_BARRIER() __sync_synchronize()
+#elif defined(_MSC_VER)
+#define SHM_BARRIER() MemoryBarrier()
+#else
+#define SHM_BARRIER()
 #endif
-            case CLIOPTS_ARGT_NONE:
-                fprintf(stderr, "%s", *(int*)cur->dest ? "TRUE" : "FALSE");
-                break;
-            default:
-                fprintf(stderr, "Unknown option type '%d'", (int)cur->ktype);
-                break;
-            }
-            fprintf(stderr, "]");
-        }
-        fprintf(stderr, "\n");
-    }
-    memset(helpbuf, 0, sizeof(helpbuf));
-    fprintf(stderr, INDENT "%s\n",
-            format_option_help(&helpent, helpbuf, settings));
 
-}
+struct shm_header {
+    char magic[8];
+    unsigned version;
+    /* Odd while the values are being written. Each publish adds two */
+    unsigned seq;
+    unsigned pid;
+    unsigned nentries;
+    /* Offset and total size of the value slots */
+    unsigned slots;
+    unsigned nslots;
+    /* Size of the whole segment */
+    unsigned size;
+};
 
-static void
-dump_error(struct cliopts_priv *ctx)
+struct shm_desc {
+    /* Offsets of the name and type name from the start of the segment */
+    unsigned name;
+    unsigned type;
+    /* Offset of the slot within the slots, and the capacity of its text */
+    unsigned slot;
+    unsigned cap;
+};
+
+struct shm_slot {
+    unsigned found;
+    /* Length of the text as stored */
+    unsigned len;
+    /* Whether the text was cut short to fit the slot */
+    unsigned truncated;
+    /* The text follows */
+};
+
+#define SHM_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct cliopts_shm_st {
+    char *addr;
+    size_t size;
+    char *path;
+    const cliopts_entry *entries;
+    /* Only base and found are used */
+    struct cliopts_extra_settings settings;
+    char *shadow;
+};
+
+struct cliopts_shm_reader_st {
+    char *addr;
+    size_t size;
+    /*
+     * Copies of the header and of everything up to the slots (descriptors
+     * and names), taken and checked when attaching. Only the sequence
+     * number and the slots are read from the segment afterwards
+     */
+    struct shm_header hdr;
+    char *meta;
+    /* Private copy of the slots, which the values point into */
+    char *copy;
+    cliopts_shm_value *values;
+};
+
+static size_t
+shm_slot_cap(const cliopts_entry *entry)
 {
-    fprintf(stderr, "Couldn't parse options: %s\n", ctx->errstr);
-    if (ctx->errnum == CLIOPTS_ERR_BADOPT) {
-        fprintf(stderr, "Bad option: %s", ctx->current_key);
-    } else if (ctx->errnum == CLIOPTS_ERR_BAD_VALUE) {
-        fprintf(stderr, "Bad value '%s' for %s",
-                ctx->current_value,
-                ctx->current_key);
-    } else if (ctx->errnum == CLIOPTS_ERR_UNRECOGNIZED) {
-        fprintf(stderr, "No such option: %s", ctx->current_key);
-    } else if (ctx->errnum == CLIOPTS_ERR_ISSWITCH) {
-        char optbuf[64] = { 0 };
-        fprintf(stderr, "Option %s takes no arguments",
-                get_option_name(ctx->prev, optbuf));
+    const cliopts_valtype *vt = entry_valtype(entry);
+    if (entry->ktype == CLIOPTS_ARGT_STRING || entry->ktype == CLIOPTS_ARGT_ENUM
+            || !vt || entry->vtype || (vt->flags & CLIOPTS_VT_MULTI)) {
+        return SHM_SLOT_TEXT;
     }
-    fprintf(stderr, "\n");
-
+    return SHM_SLOT_SCALAR;
 }
 
 CLIOPTS_API
-int
-cliopts_parse_options(cliopts_entry *entries,
-                      int argc,
-                      char **argv,
-                      int *lastidx,
-                      struct cliopts_extra_settings *settings)
+cliopts_shm *
+cliopts_shm_create(const char *path, const cliopts_entry *entries,
+                   const struct cliopts_extra_settings *settings,
+                   char **errp)
 {
-    /**
-     * Now let's build ourselves a
-     */
-    int curmode;
-    int ii, ret = 0, lastidx_s = 0;
-    struct cliopts_priv ctx = { 0 };
-    struct cliopts_extra_settings default_settings = { 0 };
+#ifndef _WIN32
+    cliopts_shm *shm;
+    const cliopts_entry *cur;
+    struct shm_header *hdr;
+    struct shm_desc *descs;
+    size_t ii, n = 0, npool = 0, nslots = 0, pos, size, npath;
+    char *tmppath, namebuf[2];
+    int fd;
 
-    if (!lastidx) {
-        lastidx = &lastidx_s;
+    for (cur = entries; cur->dest; cur++, n++) {
+        const cliopts_valtype *vt = entry_valtype(cur);
+        npool += (cur->klong ? strlen(cur->klong) : 1) + 1;
+        npool += strlen(vt && vt->name ? vt->name : "") + 1;
+        nslots += SHM_ALIGN(sizeof(struct shm_slot) + shm_slot_cap(cur));
+    }
+    pos = SHM_ALIGN(sizeof(*hdr) + n * sizeof(*descs) + npool);
+    size = pos + nslots;
+    if (size > UINT_MAX) {
+        *errp = "Too many options";
+        return NULL;
     }
 
-    ctx.entries = entries;
+    shm = CLIOPTS_CALLOC(1, sizeof(*shm));
+    npath = strlen(path);
+    if (!shm || !(shm->path = CLIOPTS_MALLOC(npath + 1)) ||
+            !(shm->shadow = CLIOPTS_CALLOC(1, nslots + 1))) {
+        cliopts_shm_close(shm, 0);
+        *errp = "Out of memory";
+        return NULL;
+    }
+    memcpy(shm->path, path, npath + 1);
+    shm->entries = entries;
+    if (settings) {
+        shm->settings.base = settings->base;
+        shm->settings.found = settings->found;
+    }
 
-    if (!settings) {
-        settings = &default_settings;
-        settings->show_defaults = 1;
+    /* Fill in a temporary file, so that readers never see it half done */
+    tmppath = CLIOPTS_MALLOC(npath + 5);
+    if (!tmppath) {
+        cliopts_shm_close(shm, 0);
+        *errp = "Out of memory";
+        return NULL;
     }
-    if (!settings->progname) {
-        settings->progname = argv[0];
+    memcpy(tmppath, path, npath);
+    memcpy(tmppath + npath, ".tmp", 5);
+    fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+        *errp = "Couldn't create segment";
+        goto GT_ERROR;
     }
-    if (!settings->argstring) {
-        settings->argstring = "[OPTIONS...]";
+    shm->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm->addr == MAP_FAILED) {
+        shm->addr = NULL;
+        *errp = "Couldn't map segment";
+        goto GT_ERROR;
     }
-    settings->nrestargs = 0;
+    shm->size = size;
+    close(fd);
+    fd = -1;
 
-    if (!settings->line_max) {
-        settings->line_max = get_terminal_width() - 3;
+    hdr = (struct shm_header *)shm->addr;
+    descs = (struct shm_desc *)(hdr + 1);
+    hdr->version = SHM_VERSION;
+    hdr->pid = (unsigned)getpid();
+    hdr->nentries = (unsigned)n;
+    hdr->slots = (unsigned)pos;
+    hdr->nslots = (unsigned)nslots;
+    hdr->size = (unsigned)size;
+
+    pos = sizeof(*hdr) + n * sizeof(*descs);
+    nslots = 0;
+    for (ii = 0; ii < n; ii++) {
+        const cliopts_valtype *vt;
+        const char *name = entries[ii].klong;
+        cur = entries + ii;
+        vt = entry_valtype(cur);
+        if (!name) {
+            namebuf[0] = cur->kshort;
+            namebuf[1] = '\0';
+            name = namebuf;
+        }
+        descs[ii].name = (unsigned)pos;
+        strcpy(shm->addr + pos, name);
+        pos += strlen(name) + 1;
+        descs[ii].type = (unsigned)pos;
+        strcpy(shm->addr + pos, vt && vt->name ? vt->name : "");
+        pos += strlen(shm->addr + pos) + 1;
+        descs[ii].slot = (unsigned)nslots;
+        descs[ii].cap = (unsigned)shm_slot_cap(cur);
+        nslots += SHM_ALIGN(sizeof(struct shm_slot) + descs[ii].cap);
     }
+    memcpy(hdr->magic, SHM_MAGIC, sizeof(hdr->magic));
 
-    ii = (settings->argv_noskip) ? 0 : 1;
+    cliopts_shm_publish(shm);
+    if (rename(tmppath, path) != 0) {
+        *errp = "Couldn't create segment";
+        goto GT_ERROR;
+    }
+    free(tmppath);
+    return shm;
 
-    if (ii >= argc) {
-        *lastidx = 0;
-        ret = 0;
-        goto GT_CHECK_REQ;
-        return 0;
+    GT_ERROR:
+    if (fd >= 0) {
+        close(fd);
     }
+    remove(tmppath);
+    free(tmppath);
+    cliopts_shm_close(shm, 0);
+    return NULL;
+#else
+    (void)path; (void)entries; (void)settings;
+    *errp = "Shared memory segments are not supported on this platform";
+    return NULL;
+#endif
+}
 
-    curmode = WANT_OPTION;
-    ctx.wanted = curmode;
-    ctx.settings = settings;
+CLIOPTS_API
+void
+cliopts_shm_publish(cliopts_shm *shm)
+{
+    struct shm_header *hdr = (struct shm_header *)shm->addr;
+    const struct shm_desc *descs = (const struct shm_desc *)(hdr + 1);
+    volatile unsigned *seq = &hdr->seq;
+    char scratch[SHM_SLOT_TEXT + 1];
+    size_t ii;
 
-    for (; ii < argc; ii++) {
+    for (ii = 0; ii < hdr->nentries; ii++) {
+        const cliopts_entry *entry = shm->entries + ii;
+        const cliopts_valtype *vt = entry_valtype(entry);
+        struct shm_slot *slot =
+                (struct shm_slot *)(shm->shadow + descs[ii].slot);
+        char *text = (char *)(slot + 1);
+        size_t len;
 
-        if (curmode == WANT_OPTION) {
-            curmode = parse_option(&ctx, argv[ii]);
-        } else if (curmode == WANT_VALUE) {
-            curmode = parse_value(&ctx, argv[ii]);
+        /* One byte more than the slot holds, so a value which exactly
+         * fills it can be told apart from one which was cut short */
+        scratch[0] = '\0';
+        if (entry->pending) {
+            format_append(scratch, descs[ii].cap + 1, 0, entry->pending);
+        } else if (vt && vt->format) {
+            vt->format(entry_dest(entry, &shm->settings), entry->vtype_arg,
+                       scratch, descs[ii].cap + 1);
+        }
+        len = strlen(scratch);
+        slot->truncated = len >= descs[ii].cap;
+        if (slot->truncated) {
+            len = descs[ii].cap - 1;
         }
+        memcpy(text, scratch, len);
+        text[len] = '\0';
+        slot->len = (unsigned)len;
+        slot->found = (unsigned)entry_found(entry, ii, &shm->settings);
+    }
 
-        if (curmode == MODE_ERROR) {
-            if (settings->error_nohelp == 0) {
-                dump_error(&ctx);
-            }
-            ret = -1;
-            break;
-        } else if (curmode == MODE_HELP) {
-            if (settings->help_noflag) {
-                /* ignore it ? */
-                continue;
-            }
+    ++*seq;
+    SHM_BARRIER();
+    memcpy(shm->addr + hdr->slots, shm->shadow, hdr->nslots);
+    SHM_BARRIER();
+    ++*seq;
+}
 
-            print_help(&ctx, settings);
-            exit(0);
+CLIOPTS_API
+void
+cliopts_shm_close(cliopts_shm *shm, int destroy)
+{
+    if (!shm) {
+        return;
+    }
+#ifndef _WIN32
+    if (shm->addr) {
+        munmap(shm->addr, shm->size);
+    }
+#endif
+    if (destroy && shm->path) {
+        remove(shm->path);
+    }
+    free(shm->path);
+    free(shm->shadow);
+    free(shm);
+}
 
-        } else if (curmode == MODE_RESTARGS) {
-            ii++;
-            break;
-        } else {
-            ctx.wanted = curmode;
-        }
+/* Check that a string in the segment ends before the slots */
+static const char *
+shm_string(const char *addr, unsigned off, unsigned end)
+{
+    if (off >= end || !memchr(addr + off, '\0', end - off)) {
+        return NULL;
     }
+    return addr + off;
+}
 
-    *lastidx = ii;
+/* Check everything a reader relies on, since the segment is not ours */
+static int
+shm_reader_init(cliopts_shm_reader *reader)
+{
+    const struct shm_header *hdr = &reader->hdr;
+    const struct shm_desc *descs;
+    size_t ii;
 
-    if (curmode == WANT_VALUE) {
-        ret = -1;
+    if (reader->size < sizeof(*hdr)) {
+        return -1;
+    }
+    memcpy(&reader->hdr, reader->addr, sizeof(*hdr));
+    if (memcmp(hdr->magic, SHM_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != SHM_VERSION || hdr->size != reader->size ||
+            hdr->nentries > (reader->size - sizeof(*hdr)) / sizeof(*descs) ||
+            hdr->slots < sizeof(*hdr) + hdr->nentries * sizeof(*descs) ||
+            hdr->slots > reader->size ||
+            hdr->nslots > reader->size - hdr->slots) {
+        return -1;
+    }
 
-        if (settings->error_nohelp == 0) {
-            fprintf(stderr,
-                    "Option %s requires argument\n",
-                    ctx.current_key);
+    reader->meta = CLIOPTS_MALLOC(hdr->slots);
+    reader->copy = CLIOPTS_MALLOC(hdr->nslots + 1);
+    reader->values =
+            CLIOPTS_CALLOC(hdr->nentries + 1, sizeof(*reader->values));
+    if (!reader->meta || !reader->copy || !reader->values) {
+        return -1;
+    }
+    /* The header part is replaced by the copy which was checked */
+    memcpy(reader->meta, reader->addr, hdr->slots);
+    memcpy(reader->meta, hdr, sizeof(*hdr));
+    descs = (const struct shm_desc *)(reader->meta + sizeof(*hdr));
+    for (ii = 0; ii < hdr->nentries; ii++) {
+        cliopts_shm_value *value = reader->values + ii;
+        if (descs[ii].cap == 0 ||
+                descs[ii].slot > hdr->nslots ||
+                descs[ii].cap > hdr->nslots - descs[ii].slot ||
+                sizeof(struct shm_slot) >
+                    hdr->nslots - descs[ii].slot - descs[ii].cap) {
+            return -1;
+        }
+        value->name = shm_string(reader->meta, descs[ii].name, hdr->slots);
+        value->type = shm_string(reader->meta, descs[ii].type, hdr->slots);
+        if (!value->name || !value->type) {
+            return -1;
         }
-        goto GT_RET;
     }
+    return 0;
+}
 
-    if (settings->argstring_restargs &&
-            settings->nrestargs < settings->min_restargs) {
-        ret = -1;
+CLIOPTS_API
+cliopts_shm_reader *
+cliopts_shm_attach(const char *path, char **errp)
+{
+#ifndef _WIN32
+    cliopts_shm_reader *reader;
+    struct stat st;
+    void *addr;
+    int fd = open(path, O_RDONLY);
 
-        if (settings->error_nohelp == 0) {
-            fprintf(stderr,
-                    "Required arguments: %s\n",
-                    settings->argstring_restargs);
-        }
-        goto GT_RET;
+    if (fd < 0) {
+        *errp = "Couldn't open segment";
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        *errp = "Couldn't open segment";
+        return NULL;
+    }
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        *errp = "Couldn't map segment";
+        return NULL;
     }
 
-    GT_CHECK_REQ:
-    {
-        cliopts_entry *cur_ent;
-        for (cur_ent = entries; cur_ent->dest; cur_ent++) {
-            char entbuf[128] = { 0 };
-            if (cur_ent->found || cur_ent->required == 0) {
-                continue;
-            }
+    reader = CLIOPTS_CALLOC(1, sizeof(*reader));
+    if (!reader) {
+        munmap(addr, (size_t)st.st_size);
+        *errp = "Out of memory";
+        return NULL;
+    }
+    reader->addr = addr;
+    reader->size = (size_t)st.st_size;
+    if (shm_reader_init(reader) != 0) {
+        cliopts_shm_detach(reader);
+        *errp = "Not a valid segment";
+        return NULL;
+    }
+    return reader;
+#else
+    (void)path;
+    *errp = "Shared memory segments are not supported on this platform";
+    return NULL;
+#endif
+}
 
-            ret = -1;
-            if (settings->error_nohelp) {
-                goto GT_RET;
-            }
+CLIOPTS_API
+int
+cliopts_shm_sample(cliopts_shm_reader *reader, cliopts_shm_snapshot *snap)
+{
+    const struct shm_header *hdr = &reader->hdr;
+    const struct shm_desc *descs =
+            (const struct shm_desc *)(reader->meta + sizeof(*hdr));
+    const volatile unsigned *seq =
+            &((const struct shm_header *)reader->addr)->seq;
+    unsigned before = 0;
+    size_t ii;
+    int tries;
 
-            fprintf(stderr, "Required option %s missing\n",
-                    get_option_name(cur_ent, entbuf));
+    for (tries = 0; tries < SHM_SAMPLE_TRIES; tries++) {
+        before = *seq;
+        if (before & 1) {
+            continue;
+        }
+        SHM_BARRIER();
+        memcpy(reader->copy, reader->addr + hdr->slots, hdr->nslots);
+        SHM_BARRIER();
+        if (*seq == before) {
+            break;
         }
     }
+    if (tries == SHM_SAMPLE_TRIES) {
+        return -1;
+    }
 
-    GT_RET:
-    if (ret == -1) {
-        if (settings->error_nohelp == 0) {
-            print_help(&ctx, settings);
-        }
-        if (settings->error_noexit == 0) {
-            exit(EXIT_FAILURE);
-        }
+    for (ii = 0; ii < hdr->nentries; ii++) {
+        const struct shm_slot *slot =
+                (const struct shm_slot *)(reader->copy + descs[ii].slot);
+        char *text = (char *)(slot + 1);
+        text[descs[ii].cap - 1] = '\0';
+        reader->values[ii].value = text;
+        reader->values[ii].truncated = slot->truncated != 0;
+        reader->values[ii].found = (int)slot->found;
     }
-    return ret;
+    snap->pid = hdr->pid;
+    snap->generation = before / 2;
+    snap->values = reader->values;
+    snap->nvalues = hdr->nentries;
+    return 0;
+}
+
+CLIOPTS_API
+void
+cliopts_shm_detach(cliopts_shm_reader *reader)
+{
+    if (!reader) {
+        return;
+    }
+#ifndef _WIN32
+    munmap(reader->addr, reader->size);
+#endif
+    free(reader->meta);
+    free(reader->copy);
+    free(reader->values);
+    free(reader);
 }
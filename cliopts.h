@@ -2,6 +2,7 @@
 #define CLIOPTS_H_
 
 #include <stddef.h> /* size_t */
+#include <stdio.h> /* FILE */
 #include <limits.h>
 
 #ifdef __cplusplus
@@ -44,13 +45,187 @@ typedef enum {
 
     /**
      * Destination should be cliopts_list. Argument type is assumed to be a
-     * string. You can use this option type to build -Doption=value style
-     * options which can be processed later on.
+     * string. Each occurrence of the option appends to the list. For
+     * -Doption=value style options, see CLIOPTS_ARGT_MAP.
      */
-    CLIOPTS_ARGT_LIST
+    CLIOPTS_ARGT_LIST,
+
+    /**
+     * Destination is of a user-defined type. The entry's vtype field must
+     * point to a cliopts_valtype describing how to convert it.
+     */
+    CLIOPTS_ARGT_CUSTOM,
+
+    /**
+     * Destination should be a cliopts_numlist. Each occurrence of the option
+     * takes a comma-separated list of numbers and ranges, e.g.
+     * --cpus=0-63,128-191 or --shard=1,5,9 or --ports=9000-9999:10 (every
+     * tenth port). Values are stored as 'int'
+     */
+    CLIOPTS_ARGT_INT_LIST,
+
+    /** Like CLIOPTS_ARGT_INT_LIST, but values are 'unsigned int' */
+    CLIOPTS_ARGT_UINT_LIST,
+
+    /** Like CLIOPTS_ARGT_INT_LIST, but values are 'unsigned long long' */
+    CLIOPTS_ARGT_ULONGLONG_LIST,
+
+    /**
+     * Like CLIOPTS_ARGT_INT_LIST, but values are 'float'. Ranges need a step,
+     * e.g. 0.5-2:0.5
+     */
+    CLIOPTS_ARGT_FLOAT_LIST,
+
+    /**
+     * Destination should be a cliopts_map. Each occurrence adds its value
+     * as a key; duplicates are stored once.
+     */
+    CLIOPTS_ARGT_SET,
+
+    /**
+     * Destination should be a cliopts_map. Values are of the form key=value
+     * (e.g. -Doption=value), and a later value for the same key replaces an
+     * earlier one. A value without '=' stores the key with an empty value.
+     */
+    CLIOPTS_ARGT_MAP,
+
+    /**
+     * Destination should be an int. The value must be one of a fixed set of
+     * names, which is mapped to its number. vtype_arg must point to an array
+     * of cliopts_choice, terminated by an entry with a NULL name.
+     */
+    CLIOPTS_ARGT_ENUM,
+
+    /** dest should be a long long (at least 64 bits, signed) */
+    CLIOPTS_ARGT_LONGLONG,
+
+    /** dest should be a double */
+    CLIOPTS_ARGT_DOUBLE,
+
+    /**
+     * Destination should be an unsigned long long, which receives a number
+     * of bytes. The value may have an SI (kB, MB, ... EB, powers of 1000) or
+     * IEC (KiB, MiB, ... EiB, powers of 1024) suffix and a fraction, e.g.
+     * 1.5GiB. The B may be left out.
+     */
+    CLIOPTS_ARGT_SIZE,
+
+    /**
+     * Destination should be an unsigned long long, which receives a number
+     * of nanoseconds. The value is one or more numbers with a unit of ns,
+     * us, ms, s, m or h, e.g. 250ms or 1h30m. A number on its own is in
+     * seconds.
+     */
+    CLIOPTS_ARGT_DURATION,
+
+    /**
+     * Destination should be a cliopts_blob. The value is used in place,
+     * without being copied. A value of @path maps the contents of the file
+     * at path instead, and @@ at the start stands for a literal @.
+     */
+    CLIOPTS_ARGT_BLOB,
+
+    /**
+     * Like CLIOPTS_ARGT_LIST, but the destination is a cliopts_strpool,
+     * which stores large numbers of values compactly. A value of @path adds
+     * each non-empty line of the file at path, and @@ at the start stands
+     * for a literal @.
+     */
+    CLIOPTS_ARGT_STRPOOL
 } cliopts_argtype_t;
 
+/** A possible value for a CLIOPTS_ARGT_ENUM option */
+typedef struct {
+    /** Name as given on the command line, e.g. "fast" */
+    const char *name;
+    /** Value stored in the destination */
+    int value;
+} cliopts_choice;
+
+/**
+ * Function which converts a value from the command line into its destination.
+ *
+ * @param value the value string. This points into argv where possible, and is
+ * always NUL-terminated
+ * @param nvalue the length of the value string
+ * @param dest the entry's destination pointer
+ * @param arg the entry's vtype_arg
+ * @param errp set this to an error message if the value could not be converted
+ * @return 0 on success, nonzero on failure
+ */
+typedef int (*cliopts_extract_fn)(const char *value, size_t nvalue,
+                                  void *dest, void *arg, char **errp);
+
+/**
+ * Function which writes a printable representation of the value in dest.
+ * This is used to display default values in the help text. Writing an empty
+ * string means there is nothing to display.
+ *
+ * @param dest the entry's destination pointer
+ * @param arg the entry's vtype_arg
+ * @param buf the buffer to write to
+ * @param nbuf the size of the buffer, including the trailing NUL
+ */
+typedef void (*cliopts_format_fn)(const void *dest, void *arg,
+                                  char *buf, size_t nbuf);
+
+/**
+ * Function which writes the value in dest as bytes which are equal exactly
+ * when the values are equal. This is what fingerprints are computed from
+ * (see cliopts_fingerprint_compute()).
+ *
+ * @param dest the entry's destination pointer
+ * @param arg the entry's vtype_arg
+ * @param buf the buffer to write to. Nothing is written beyond nbuf
+ * @param nbuf the size of the buffer
+ * @return the full size of the canonical form. If this is more than nbuf,
+ * the function is called again with a large enough buffer
+ */
+typedef size_t (*cliopts_canonical_fn)(const void *dest, void *arg,
+                                       char *buf, size_t nbuf);
+
+struct cliopts_entry_st;
+
+/**
+ * Function which checks a value after it has been converted. Failures are
+ * reported like conversion errors.
+ *
+ * @param entry the entry whose value is being checked
+ * @param dest the entry's destination pointer, holding the converted value
+ * @param arg the entry's validator_arg
+ * @param errp set this to an error message if the value is not acceptable
+ * @return 0 if the value is acceptable, nonzero otherwise
+ */
+typedef int (*cliopts_validate_fn)(const struct cliopts_entry_st *entry,
+                                   const void *dest, void *arg, char **errp);
+
+/**
+ * Each occurrence of the option adds to the value (as for CLIOPTS_ARGT_LIST)
+ * rather than replacing it. Such values are never deferred in lazy mode.
+ */
+#define CLIOPTS_VT_MULTI 0x01
+
+/**
+ * Describes how to handle values of a given type. The built-in types are
+ * each described by one of these, and an entry may supply its own.
+ */
 typedef struct {
+    /** Name of the type, e.g. "int" */
+    const char *name;
+    /** Conversion function */
+    cliopts_extract_fn extract;
+    /** Display function. May be NULL */
+    cliopts_format_fn format;
+    /** Combination of CLIOPTS_VT_* flags */
+    unsigned flags;
+    /**
+     * Canonical form, for fingerprints. May be NULL, in which case the
+     * display form is used instead
+     */
+    cliopts_canonical_fn canonical;
+} cliopts_valtype;
+
+typedef struct cliopts_entry_st {
     /**
      * Input parameters
      */
@@ -64,7 +239,10 @@ typedef struct {
     /** type of value */
     cliopts_argtype_t ktype;
 
-    /** destination pointer for value */
+    /**
+     * destination pointer for value. With cliopts_extra_settings::base, an
+     * offset made with CLIOPTS_OFFSET() instead
+     */
     void *dest;
 
     /** help string for this option */
@@ -87,8 +265,154 @@ typedef struct {
     /** whether this option was encountered on the command line */
     int found;
 
+    /**
+     * More input parameters
+     */
+
+    /**
+     * Value handling for this entry. Required for CLIOPTS_ARGT_CUSTOM; for
+     * other types this may be set to override the built-in conversion.
+     */
+    const cliopts_valtype *vtype;
+
+    /** Passed to the vtype functions */
+    void *vtype_arg;
+
+    /**
+     * Called with each value as soon as it is converted, e.g.
+     * cliopts_validate_range. If it fails, the value stays in dest but the
+     * parse fails. In lazy mode, where the parse has already succeeded, a
+     * rejected value is not kept: built-in single-valued types (and C++
+     * options) keep their previous value instead.
+     */
+    cliopts_validate_fn validator;
+
+    /** Passed to the validator */
+    void *validator_arg;
+
+    /**
+     * More output parameters
+     */
+
+    /**
+     * In lazy mode, the value (pointing into argv) which has yet to be
+     * converted into dest. See cliopts_entry_convert()
+     */
+    const char *pending;
+
+    /**
+     * More input parameters
+     */
+
+    /**
+     * set this to true if the option does not affect what the program does
+     * (e.g. --verbose), to leave it out of fingerprints
+     */
+    int nonsemantic;
+
 } cliopts_entry;
 
+/**
+ * Parser statistics. These are only gathered if the library was built with
+ * CLIOPTS_ENABLE_STATS defined; otherwise the structure is left untouched.
+ * Counters are added to, so the same structure may be used to accumulate
+ * across several calls.
+ */
+struct cliopts_stats {
+    /** Number of argv elements examined */
+    unsigned long ntokens;
+    /** Number of option table lookups */
+    unsigned long nlookups;
+    /** Number of memory allocations (including reallocations) made by the
+     * library while parsing */
+    unsigned long nallocs;
+    /** Number of bytes copied out of argv */
+    unsigned long nbytes_copied;
+    /** Number of values which could not be converted */
+    unsigned long nconv_failures;
+
+    /** Time spent in each phase of parsing, in nanoseconds */
+    unsigned long long ns_tokenize;
+    unsigned long long ns_lookup;
+    unsigned long long ns_convert;
+    unsigned long long ns_required;
+    unsigned long long ns_help;
+};
+
+/** Opaque compiled set of constraints. See cliopts_constraints_compile() */
+typedef struct cliopts_constraint_set_st cliopts_constraint_set;
+
+/** Error codes, as found in cliopts_error */
+typedef enum {
+    CLIOPTS_ERR_SUCCESS,
+    /** An option is missing its value */
+    CLIOPTS_ERR_NEED_ARG,
+    /** A value was given to an option which does not take one */
+    CLIOPTS_ERR_ISSWITCH,
+    /** Malformed option, or an unexpected positional argument */
+    CLIOPTS_ERR_BADOPT,
+    /** The value could not be converted, or was rejected by a validator */
+    CLIOPTS_ERR_BAD_VALUE,
+    /** No such option */
+    CLIOPTS_ERR_UNRECOGNIZED,
+    /** A required option was not given */
+    CLIOPTS_ERR_MISSING,
+    /** Too few positional arguments */
+    CLIOPTS_ERR_RESTARGS,
+    /** A constraint between options was violated */
+    CLIOPTS_ERR_CONSTRAINT,
+    /** Two tables of a chain use the same option name */
+    CLIOPTS_ERR_DUPLICATE
+} cliopts_errcode;
+
+/** A single error found while parsing */
+typedef struct {
+    /** Index of the argument in argv, or -1 if not about a single argument
+     * (e.g. a missing required option) */
+    int argidx;
+    /** Byte offset within the argument at which the problem starts */
+    size_t offset;
+    /** One of the CLIOPTS_ERR_* codes */
+    cliopts_errcode code;
+    /** The option (or options) concerned, or NULL */
+    char *option;
+    /** The offending value, or NULL */
+    char *value;
+    /** Description of the problem */
+    const char *message;
+} cliopts_error;
+
+typedef struct {
+    cliopts_error *errors;
+    size_t nerrors;
+    size_t nalloc;
+} cliopts_error_list;
+
+/**
+ * Called with each value of a variadic positional argument, once it has
+ * been converted and validated. See cliopts_extra_settings::positionals.
+ *
+ * @param entry the positional argument
+ * @param dest the entry's destination, holding the value. It is overwritten
+ * by the next value; a CLIOPTS_ARGT_STRING value points into argv, and is
+ * only valid during the call. Multi-valued types are not supported
+ * @param argidx index of the value in argv
+ * @param arg the positional_arg from the settings
+ * @param errp set this to an error message if the value is not acceptable
+ * @return 0 to carry on, nonzero to reject the value
+ */
+typedef int (*cliopts_positional_fn)(const cliopts_entry *entry,
+                                     const void *dest, int argidx, void *arg,
+                                     char **errp);
+
+/** Digest of the option values. See cliopts_fingerprint_compute() */
+typedef struct {
+    unsigned char bytes[16];
+} cliopts_fingerprint;
+
+/** Shared memory segment publishing option values. See cliopts_shm_create() */
+typedef struct cliopts_shm_st cliopts_shm;
+
 struct cliopts_extra_settings {
     /** Assume actual arguments start from argv[0], not argv[1] */
     int argv_noskip;
@@ -130,8 +454,111 @@ struct cliopts_extra_settings {
 
     /** The minimum required rest args */
     int min_restargs;
+
+    /**
+     * Answer shell completion requests. If set, and the first argument is
+     * --cliopts-complete=SHELL (SHELL being one of bash, zsh or fish), then
+     * the remaining arguments are taken to be the words of the command line
+     * being completed. Candidates for the last word are printed to stdout
+     * and the program exits, as with --help.
+     */
+    int enable_completion;
+
+    /** If non-NULL, parser statistics are added here. See cliopts_stats */
+    struct cliopts_stats *stats;
+
+    /**
+     * Defer conversion of values until they are needed. The parser only
+     * records the last value given for each option in the entry's pending
+     * field; cliopts_entry_convert() or cliopts_validate_all() must be
+     * called before reading dest. argv must remain valid until then.
+     * Multi-valued types (e.g. CLIOPTS_ARGT_LIST) are always converted
+     * immediately.
+     */
+    int lazy;
+
+    /**
+     * Constraints between options, checked after parsing. All violations
+     * are reported, and cause the parse to fail
+     */
+    const cliopts_constraint_set *constraints;
+
+    /**
+     * If set, parsing carries on past errors, and every error is added to
+     * this list (which is cleared first). They are printed together once
+     * parsing is done, unless error_nohelp is set.
+     */
+    cliopts_error_list *errors;
+
+    /**
+     * If set, the dest of each entry is an offset (see CLIOPTS_OFFSET())
+     * into the structure this points to, rather than a pointer. Values are
+     * then never deferred (see lazy). See cliopts_parse_into()
+     */
+    void *base;
+
+    /**
+     * If set, the number of times each option was found is counted here,
+     * at its position in the table, instead of in the entry's found field
+     */
+    int *found;
+
+    /**
+     * If set, a fingerprint of the option values is computed here once
+     * parsing has succeeded. See cliopts_fingerprint_compute()
+     */
+    cliopts_fingerprint *fingerprint;
+
+    /**
+     * If set, the option values are published to this segment once parsing
+     * has succeeded. See cliopts_shm_publish()
+     */
+    cliopts_shm *shm;
+
+    /**
+     * Positional arguments, converted in order as they are found (wherever
+     * they are among the options, and after a bare --). Each is described
+     * like an option, with klong as its name, and required set if it must
+     * be given (only the last ones can be left out). The table is terminated
+     * by an entry with a NULL dest.
+     *
+     * If the last one has a multi-valued type (e.g. CLIOPTS_ARGT_LIST), or
+     * positional_cb is set, it takes all the remaining arguments. Otherwise
+     * arguments beyond the last one are placed in restargs, or are an error.
+     * The two can't be combined: with positional_cb set, a multi-valued last
+     * argument fails to parse. Positional arguments are counted in their own
+     * found field.
+     */
+    cliopts_entry *positionals;
+
+    /**
+     * If set, called with each value of the last positional argument instead
+     * of collecting them, so that any number can be handled in constant
+     * memory.
+     */
+    cliopts_positional_fn positional_cb;
+
+    /** Passed to positional_cb */
+    void *positional_arg;
 };
 
+/**
+ * Store an entry's value in a member of a structure, for use as the dest of
+ * an entry passed to cliopts_parse_into(). Since the first member has an
+ * offset of zero, the offset is biased so that dest is never NULL.
+ *
+ * @code
+ * struct config { int threads; char *name; };
+ * static const cliopts_entry entries[] = {
+ *     {'t', "threads", CLIOPTS_ARGT_INT,
+ *         CLIOPTS_OFFSET(struct config, threads), "Worker threads"},
+ *     {0}
+ * };
+ * @endcode
+ */
+#define CLIOPTS_OFFSET(type, member) \
+    ((void *)(size_t)(offsetof(type, member) + 1))
+
 typedef struct {
     /** Array of string pointers. Allocated via standard malloc functions */
     char **values;
@@ -149,57 +576,1306 @@ CLIOPTS_API
 void
 cliopts_list_clear(cliopts_list *l);
 
+/** Largest range expanded into a cliopts_numlist's values by default */
+#define CLIOPTS_NUMLIST_MAX_EXPAND 65536
+
 /**
- * Parse options.
- *
- * @param entries an array of cliopts_entry structures. The list should be
- * terminated with a structure which has its dest field set to NULL
- *
- * @param argc the count of arguments
- * @param argv the actual list of arguments
- * @param lastidx populated with the amount of elements from argv actually read
- * @params setting a structure defining extra settings for the argument parser.
- * May be NULL
- *
- * @return 0 for success, -1 on error.
+ * List of numbers, for the CLIOPTS_ARGT_*_LIST types. The element type
+ * (int, unsigned, unsigned long long or float) is determined by the option
+ * type.
+ */
+typedef struct {
+    /**
+     * Contiguous array of values, in the order given. Unexpanded ranges are
+     * kept apart from these; see range_pos.
+     */
+    void *values;
+    /** Number of valid elements in values */
+    size_t nvalues;
+    /** Number of elements allocated */
+    size_t nalloc;
+
+    /**
+     * Input: ranges with more elements than this are not expanded into
+     * values, but kept as a (first, last, step) triple in ranges. 0 means
+     * CLIOPTS_NUMLIST_MAX_EXPAND; (size_t)-1 expands every range that fits
+     * in memory.
+     */
+    size_t max_expand;
+
+    /**
+     * Ranges which were not expanded, as consecutive (first, last, step)
+     * triples of the element type.
+     */
+    void *ranges;
+    /** Number of triples in ranges */
+    size_t nranges;
+    /** Number of triples allocated */
+    size_t nranges_alloc;
+    /**
+     * Where each range goes in the list: the number of elements of values
+     * which were given before it. The list in the order given is values up
+     * to range_pos[0], then the first range, then values up to range_pos[1],
+     * and so on.
+     */
+    size_t *range_pos;
+    /** Changed whenever the contents of the list are */
+    unsigned long generation;
+} cliopts_numlist;
+
+/**
+ * Get the total number of elements in a numeric list, including those in
+ * unexpanded ranges.
+ * @param l the list
+ * @param ktype the option type the list was parsed as
+ * @return the number of elements, or (size_t)-1 if it does not fit in a
+ * size_t
+ */
+CLIOPTS_API
+size_t
+cliopts_numlist_count(const cliopts_numlist *l, cliopts_argtype_t ktype);
+
+/**
+ * Free the contents of a numeric list
+ * @param l the list
+ */
+CLIOPTS_API
+void
+cliopts_numlist_clear(cliopts_numlist *l);
+
+/**
+ * Copy a numeric list, including its unexpanded ranges
+ * @param dst the list to copy into. Its previous contents are not freed
+ * @param src the list to copy
+ * @param ktype the option type the list was parsed as
+ * @return 0 on success, -1 if out of memory
  */
 CLIOPTS_API
 int
-cliopts_parse_options(cliopts_entry *entries,
-                      int argc,
-                      char **argv,
-                      int *lastidx,
-                      struct cliopts_extra_settings *settings);
-#ifdef __cplusplus
-}
+cliopts_numlist_copy(cliopts_numlist *dst, const cliopts_numlist *src,
+                     cliopts_argtype_t ktype);
 
-#ifdef CLIOPTS_ENABLE_CXX
-#include <string>
-#include <vector>
-#include <list>
-#include <cstdlib>
-#include <cstring>
-#include <cstdio>
+/** A slot in a cliopts_map. Unused slots have a NULL key */
+typedef struct {
+    const char *key;
+    /** The value, or NULL for sets */
+    const char *value;
+    size_t hash;
+} cliopts_map_slot;
 
-namespace cliopts {
-class Parser;
+/**
+ * Hash table of strings, for CLIOPTS_ARGT_SET and CLIOPTS_ARGT_MAP. To
+ * iterate, walk all nslots slots and skip the ones whose key is NULL.
+ */
+typedef struct {
+    cliopts_map_slot *slots;
+    /** Number of slots. This is zero or a power of two */
+    size_t nslots;
+    /** Number of keys stored */
+    size_t nitems;
+    /** Changed whenever the contents of the map are */
+    unsigned long generation;
+} cliopts_map;
 
 /**
- * This class should typically not be used directly. It is a simple wrapper
- * around the C-based ::cliopts_entry class for further wrapping by the
- * cliopts::TOption template class.
+ * Look up a key in a map
+ * @param m the map
+ * @param key the key
+ * @return the slot for the key, or NULL if it is not present
  */
-class Option : protected cliopts_entry {
-public:
-    bool passed() const { return found != 0; }
-    void setPassed(bool val = true) { found = val ? 1 : 0; }
-    int numSpecified() const { return found; }
-    Option() { memset(this, 0, sizeof (cliopts_entry)); }
-private:
-    friend class Parser;
+CLIOPTS_API
+const cliopts_map_slot *
+cliopts_map_find(const cliopts_map *m, const char *key);
+
+/**
+ * Get the value for a key in a map
+ * @param m the map
+ * @param key the key
+ * @return the value, or NULL if the key is not present (or the map is a set)
+ */
+CLIOPTS_API
+const char *
+cliopts_map_get(const cliopts_map *m, const char *key);
+
+/**
+ * Free the contents of a map
+ * @param m the map
+ */
+CLIOPTS_API
+void
+cliopts_map_clear(cliopts_map *m);
+
+/**
+ * Copy a map or set
+ * @param dst the map to copy into. Its previous contents are not freed
+ * @param src the map to copy
+ * @return 0 on success, -1 if out of memory
+ */
+CLIOPTS_API
+int
+cliopts_map_copy(cliopts_map *dst, const cliopts_map *src);
+
+/**
+ * Bytes for CLIOPTS_ARGT_BLOB. These are not NUL terminated.
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+    /**
+     * Nonzero if data holds the contents of a file, which must be released
+     * with cliopts_blob_clear(). Otherwise data points into the arguments.
+     */
+    int mapped;
+} cliopts_blob;
+
+/**
+ * Release a blob's file contents, if any, and reset it
+ * @param blob the blob
+ */
+CLIOPTS_API
+void
+cliopts_blob_clear(cliopts_blob *blob);
+
+/**
+ * Copy a blob. File contents are copied into memory owned by dst; values
+ * which point into the arguments are shared.
+ * @param dst the blob to copy into. Its previous contents are not released
+ * @param src the blob to copy
+ * @return 0 on success, -1 if out of memory
+ */
+CLIOPTS_API
+int
+cliopts_blob_copy(cliopts_blob *dst, const cliopts_blob *src);
+
+/**
+ * Get the next line of a blob. Lines are found as they are reached, and are
+ * returned in place without their terminating newline (or CRLF). A last
+ * line without a newline is returned as well.
+ * @param blob the blob
+ * @param pos the position to continue from. Set it to 0 before the first call
+ * @param[out] line set to the start of the line
+ * @param[out] nline set to the length of the line
+ * @return 1 if a line was returned, 0 at the end of the blob
+ */
+CLIOPTS_API
+int
+cliopts_blob_next_line(const cliopts_blob *blob, size_t *pos,
+                       const char **line, size_t *nline);
+
+/** Every CLIOPTS_STRPOOL_RESTART'th string in a cliopts_strpool is whole */
+#define CLIOPTS_STRPOOL_RESTART 16
+
+/**
+ * Compact list of strings, for CLIOPTS_ARGT_STRPOOL. The strings are stored
+ * one after the other in a single buffer, each as the length of the prefix
+ * it shares with the one before it followed by the rest of its bytes. Every
+ * CLIOPTS_STRPOOL_RESTART'th string is stored whole, and its position kept
+ * in offsets, so that any string can be found without decoding the ones
+ * before it. Read the strings with cliopts_strpool_next() or
+ * cliopts_strpool_get().
+ */
+typedef struct {
+    /** The encoded strings */
+    char *data;
+    size_t ndata;
+    size_t nalloc;
+    /** Position in data of each whole string */
+    size_t *offsets;
+    size_t noffsets_alloc;
+    /** Number of strings */
+    size_t nvalues;
+    /** Copy of the last string added, which the next is compared with */
+    char *last;
+    size_t nlast;
+    size_t nlast_alloc;
+} cliopts_strpool;
+
+/**
+ * Position in a cliopts_strpool. Zero it before the first call to
+ * cliopts_strpool_next().
+ */
+typedef struct {
+    /** The current string, NUL terminated */
+    const char *value;
+    /** Length of the current string */
+    size_t len;
+    /* Private */
+    size_t index;
+    size_t pos;
+    char *buf;
+    size_t nbuf;
+} cliopts_strpool_iter;
+
+/**
+ * Add a string to the end of a pool
+ * @param p the pool
+ * @param s the string
+ * @param n length of the string
+ * @return 0 on success, -1 if out of memory
+ */
+CLIOPTS_API
+int
+cliopts_strpool_add(cliopts_strpool *p, const char *s, size_t n);
+
+/**
+ * Advance to the next string of a pool. The iterator frees its buffer when
+ * it reaches the end; call cliopts_strpool_iter_clear() to stop earlier.
+ * @param p the pool
+ * @param it the iterator
+ * @return 1 if it->value is the next string, 0 at the end (or if out of
+ * memory)
+ */
+CLIOPTS_API
+int
+cliopts_strpool_next(const cliopts_strpool *p, cliopts_strpool_iter *it);
+
+/**
+ * Free an iterator's buffer
+ * @param it the iterator
+ */
+CLIOPTS_API
+void
+cliopts_strpool_iter_clear(cliopts_strpool_iter *it);
+
+/**
+ * Copy one string of a pool into a buffer. This decodes at most
+ * CLIOPTS_STRPOOL_RESTART strings.
+ * @param p the pool
+ * @param index the index of the string
+ * @param buf the buffer, which is NUL terminated and may be truncated
+ * @param nbuf size of buf
+ * @return the length of the string, or (size_t)-1 if index is out of range
+ * or memory ran out
+ */
+CLIOPTS_API
+size_t
+cliopts_strpool_get(const cliopts_strpool *p, size_t index, char *buf,
+                    size_t nbuf);
+
+/**
+ * Sort a pool bytewise and remove duplicate strings. Sorted strings share
+ * longer prefixes, so this usually shrinks the pool as well.
+ * @param p the pool
+ * @return 0 on success, -1 if out of memory (the pool is left unchanged)
+ */
+CLIOPTS_API
+int
+cliopts_strpool_sort(cliopts_strpool *p);
+
+/**
+ * Free the contents of a pool
+ * @param p the pool
+ */
+CLIOPTS_API
+void
+cliopts_strpool_clear(cliopts_strpool *p);
+
+/**
+ * Copy a pool
+ * @param dst the pool to copy into. Its previous contents are not freed
+ * @param src the pool to copy
+ * @return 0 on success, -1 if out of memory
+ */
+CLIOPTS_API
+int
+cliopts_strpool_copy(cliopts_strpool *dst, const cliopts_strpool *src);
+
+/** Bounds for cliopts_validate_range(), inclusive */
+typedef struct {
+    double min;
+    double max;
+} cliopts_range;
+
+/**
+ * Validator which checks that a numeric value lies within a range. Set the
+ * entry's validator_arg to a cliopts_range. For numeric lists, every
+ * element is checked.
+ */
+CLIOPTS_API
+int
+cliopts_validate_range(const cliopts_entry *entry, const void *dest,
+                       void *arg, char **errp);
+
+/**
+ * Convert an entry's pending value (see cliopts_extra_settings::lazy). Once
+ * converted, the value is not converted again.
+ *
+ * @param entry the entry
+ * @param errp populated with an error message on failure. May be NULL
+ * @return 0 on success (or if there was nothing to convert), -1 if the value
+ * is invalid. In this case the value remains pending, and dest keeps its
+ * previous value unless the entry has a custom vtype.
+ */
+CLIOPTS_API
+int
+cliopts_entry_convert(cliopts_entry *entry, char **errp);
+
+/**
+ * Convert all pending values in a table, for applications which parsed in
+ * lazy mode but want all values checked up front.
+ *
+ * @param entries the option table
+ * @param settings the settings used when parsing; errors are printed unless
+ * error_nohelp is set. May be NULL
+ * @return 0 if all values were converted, -1 if any were invalid
+ */
+CLIOPTS_API
+int
+cliopts_validate_all(cliopts_entry *entries,
+                     const struct cliopts_extra_settings *settings);
+
+/**
+ * Free the values a parse allocated: strings, lists, string pools, sets,
+ * maps and blob file mappings, for the entries and for
+ * settings->positionals. Values of options which were not found are left
+ * alone, as they may be static defaults. Values of custom types are not
+ * touched.
+ *
+ * @param entries the option table
+ * @param settings the settings used when parsing. May be NULL
+ */
+CLIOPTS_API
+void
+cliopts_free_values(cliopts_entry *entries,
+                    const struct cliopts_extra_settings *settings);
+
+/**
+ * Opaque lookup index over an option table. The index does not copy the
+ * entries; the table must remain valid for as long as the index is used.
+ */
+typedef struct cliopts_index_st cliopts_index;
+
+/**
+ * Compile a lookup index for an option table.
+ * @param entries the option table, terminated by an entry with a NULL dest
+ * @return a new index, or NULL on allocation failure
+ */
+CLIOPTS_API
+cliopts_index *
+cliopts_index_create(cliopts_entry *entries);
+
+/**
+ * Free an index created with cliopts_index_create()
+ * @param idx the index
+ */
+CLIOPTS_API
+void
+cliopts_index_free(cliopts_index *idx);
+
+/**
+ * Find an option by name, in constant time.
+ * @param idx the index (e.g. from cliopts_chain_index())
+ * @param name the long name, without dashes, or a short name as a string of
+ * one character
+ * @return the entry, or NULL if there is no such option
+ */
+CLIOPTS_API
+cliopts_entry *
+cliopts_index_find(const cliopts_index *idx, const char *name);
+
+/**
+ * Reference to the value of an option, for code which only knows the option
+ * by name (e.g. a plugin). Resolve it once with cliopts_handle_resolve(), and
+ * read the value with CLIOPTS_HANDLE_GET() as often as needed.
+ */
+typedef struct {
+    /** The option */
+    const cliopts_entry *entry;
+    /** Where its value is stored */
+    const void *dest;
+} cliopts_handle;
+
+/**
+ * Look up an option by name, and check its type.
+ *
+ * @param idx the index of the option table
+ * @param name the option name, as for cliopts_index_find()
+ * @param ktype the type the caller expects, or -1 to accept any. Other than
+ * for CLIOPTS_ARGT_CUSTOM, an entry whose vtype overrides the conversion
+ * does not match, since its value is not stored as the C type
+ * @param settings the settings the table was parsed with, if it was parsed
+ * into a structure (see cliopts_extra_settings::base). May be NULL
+ * @param[out] handle the handle
+ * @param[out] errp set to an error message on failure
+ * @return 0 on success, -1 if there is no such option, it is of another
+ * type, or a pending value (see cliopts_extra_settings::lazy) is invalid
+ */
+CLIOPTS_API
+int
+cliopts_handle_resolve(const cliopts_index *idx, const char *name, int ktype,
+                       const struct cliopts_extra_settings *settings,
+                       cliopts_handle *handle, char **errp);
+
+/**
+ * The value of a resolved option, e.g. CLIOPTS_HANDLE_GET(h, int) for a
+ * CLIOPTS_ARGT_INT option
+ */
+#define CLIOPTS_HANDLE_GET(handle, type) (*(const type *)(handle).dest)
+
+/** An option table which is part of a chain */
+typedef struct {
+    /** The options, terminated by an entry with a NULL dest */
+    cliopts_entry *entries;
+    /** Heading for these options in the help text. May be NULL */
+    const char *title;
+} cliopts_table;
+
+/**
+ * Opaque list of option tables (e.g. one per library) which are parsed as
+ * a single table, without copying the entries. Positions in the chain (as
+ * used by cliopts_extra_settings::found and constraints) run through the
+ * tables in order.
+ */
+typedef struct cliopts_chain_st cliopts_chain;
+
+/**
+ * Combine several option tables. All tables must remain valid for as long
+ * as the chain is used.
+ *
+ * @param tables the tables, in the order they are shown in the help text
+ * @param ntables the number of tables
+ * @param errors if set, every option name used by more than one entry is
+ * added to this list (which is cleared first) as CLIOPTS_ERR_DUPLICATE.
+ * Otherwise they are printed
+ * @return the chain, or NULL if names conflict or memory could not be
+ * allocated
+ */
+CLIOPTS_API
+cliopts_chain *
+cliopts_chain_create(const cliopts_table *tables, size_t ntables,
+                     cliopts_error_list *errors);
+
+/**
+ * Get the merged index of a chain, e.g. for compiling constraints
+ * @param chain the chain
+ */
+CLIOPTS_API
+const cliopts_index *
+cliopts_chain_index(const cliopts_chain *chain);
+
+/**
+ * Parse options from all the tables of a chain. Options are looked up in
+ * the merged index, and the help text has a section for each table.
+ * Otherwise this is the same as cliopts_parse_options().
+ *
+ * @param chain the chain
+ */
+CLIOPTS_API
+int
+cliopts_chain_parse(const cliopts_chain *chain,
+                    int argc,
+                    char **argv,
+                    int *lastidx,
+                    struct cliopts_extra_settings *settings);
+
+/**
+ * Free a chain. The tables themselves are not touched.
+ * @param chain the chain. May be NULL
+ */
+CLIOPTS_API
+void
+cliopts_chain_free(cliopts_chain *chain);
+
+/** Shells for which completion output may be generated */
+typedef enum {
+    CLIOPTS_SHELL_BASH,
+    CLIOPTS_SHELL_ZSH,
+    CLIOPTS_SHELL_FISH
+} cliopts_shell_t;
+
+/**
+ * Print completion candidates for a partial command line.
+ *
+ * Candidates are written one per line. For bash only the candidate itself
+ * is written; zsh gets "candidate:description" (suitable for _describe) and
+ * fish gets "candidate\tdescription".
+ *
+ * @param idx the option index
+ * @param argc number of words
+ * @param argv the words following the program name. The last word is the
+ * one being completed, and may be empty.
+ * @param shell the output format
+ * @param fp where to write the candidates
+ * @return the number of candidates written
+ */
+CLIOPTS_API
+int
+cliopts_complete(const cliopts_index *idx, int argc, char **argv,
+                 cliopts_shell_t shell, FILE *fp);
+
+/**
+ * Write a static completion script for the program. The script embeds the
+ * option names and does not need to invoke the program.
+ *
+ * @param idx the option index
+ * @param progname the name of the command to complete
+ * @param shell the shell to generate the script for
+ * @param fp where to write the script
+ */
+CLIOPTS_API
+void
+cliopts_completion_script(const cliopts_index *idx, const char *progname,
+                          cliopts_shell_t shell, FILE *fp);
+
+/** Kinds of constraints between options */
+typedef enum {
+    /** Terminates a list of constraints */
+    CLIOPTS_CONSTRAINT_END = 0,
+    /** Exactly one of the members must be given */
+    CLIOPTS_CONSTRAINT_EXACTLY_ONE,
+    /** No more than one of the members may be given */
+    CLIOPTS_CONSTRAINT_AT_MOST_ONE,
+    /** At least one of the members must be given */
+    CLIOPTS_CONSTRAINT_AT_LEAST_ONE,
+    /** If the option is given, all of the members must be given */
+    CLIOPTS_CONSTRAINT_REQUIRES,
+    /** If the option is given, none of the members may be given */
+    CLIOPTS_CONSTRAINT_CONFLICTS
+} cliopts_constraint_type;
+
+/**
+ * A constraint between options. Options are named by their long name, or by
+ * their short name for options which have no long name.
+ */
+typedef struct {
+    cliopts_constraint_type type;
+    /** The option the constraint applies to (REQUIRES and CONFLICTS only) */
+    const char *option;
+    /** The other options in the constraint, terminated by NULL */
+    const char * const *members;
+} cliopts_constraint;
+
+/**
+ * Compile a list of constraints against an option table. The result can be
+ * set as the 'constraints' field of cliopts_extra_settings, and is valid for
+ * as long as the index is.
+ *
+ * @param idx index of the option table
+ * @param constraints list of constraints, terminated by one whose type is
+ * CLIOPTS_CONSTRAINT_END
+ * @param errp populated with an error message if a constraint names an
+ * unknown option
+ * @return the compiled constraints, or NULL on error
+ */
+CLIOPTS_API
+cliopts_constraint_set *
+cliopts_constraints_compile(const cliopts_index *idx,
+                            const cliopts_constraint *constraints,
+                            char **errp);
+
+/**
+ * Free compiled constraints
+ * @param cs the constraints
+ */
+CLIOPTS_API
+void
+cliopts_constraints_free(cliopts_constraint_set *cs);
+
+/**
+ * Check constraints against the options found by a previous parse. This is
+ * done by cliopts_parse_options() if the constraints are passed in its
+ * settings.
+ *
+ * @param cs the constraints
+ * @param settings if non-NULL and error_nohelp is set, violations are not
+ * printed
+ * @return the number of violated constraints, or -1 if they could not be
+ * checked for lack of memory (which is reported like a violation)
+ */
+CLIOPTS_API
+int
+cliopts_constraints_check(const cliopts_constraint_set *cs,
+                          const struct cliopts_extra_settings *settings);
+
+/**
+ * Parse options.
+ *
+ * @param entries an array of cliopts_entry structures. The list should be
+ * terminated with a structure which has its dest field set to NULL
+ *
+ * @param argc the count of arguments
+ * @param argv the actual list of arguments
+ * @param lastidx populated with the amount of elements from argv actually read
+ * @params setting a structure defining extra settings for the argument parser.
+ * May be NULL
+ *
+ * @return 0 for success, -1 on error.
+ */
+CLIOPTS_API
+int
+cliopts_parse_options(cliopts_entry *entries,
+                      int argc,
+                      char **argv,
+                      int *lastidx,
+                      struct cliopts_extra_settings *settings);
+
+/**
+ * Parse options into a structure. The entries' dest fields are offsets into
+ * it (see CLIOPTS_OFFSET()), and the number of times each option was found
+ * is stored in a separate array, so the table itself is never modified. One
+ * table may thus fill any number of structures, from several threads at
+ * once (provided each call has its own settings, or none).
+ *
+ * @param entries the option table, whose dest fields are offsets
+ * @param base the structure to store values in. Options which are not
+ * given keep their values, which are also shown as defaults in the help
+ * @param found if not NULL, an array with an element per entry (not
+ * counting the terminating one), which is cleared and then set to the
+ * number of times each option was found
+ * @param argc the count of arguments
+ * @param argv the actual list of arguments
+ * @param lastidx populated with the amount of elements from argv actually read
+ * @param settings extra settings, which are not modified (apart from
+ * nrestargs). May be NULL
+ * @return 0 for success, -1 on error.
+ */
+CLIOPTS_API
+int
+cliopts_parse_into(const cliopts_entry *entries,
+                   void *base,
+                   int *found,
+                   int argc,
+                   char **argv,
+                   int *lastidx,
+                   struct cliopts_extra_settings *settings);
+
+/**
+ * A parser which remembers the outcome of recent parses, for programs which
+ * parse the same command lines over and over (e.g. a job dispatcher). A
+ * parse whose arguments, table and settings match a cached one is repeated
+ * without being tokenized or looked up again: simple values are copied into
+ * place, and others (strings, lists, custom types) are converted again from
+ * the new argv. Only successful parses are cached, and not those with values
+ * for custom CLIOPTS_VT_MULTI types. Validators must give the same answer for
+ * the same value; if a value no longer converts, the values converted so far
+ * are released (as by cliopts_free_values()) and the arguments are parsed in
+ * full. A parser must not be used by several threads at once.
+ */
+typedef struct cliopts_parser_st cliopts_parser;
+
+/** Counters kept by a cliopts_parser */
+typedef struct {
+    /** Parses repeated from the cache */
+    unsigned long hits;
+    /** Parses done in full */
+    unsigned long misses;
+    /** Cached parses dropped to make room for newer ones */
+    unsigned long evictions;
+} cliopts_cache_stats;
+
+/**
+ * Create a parser with a cache
+ * @param max_cached the maximum number of parses to keep. If 0, nothing
+ * is cached
+ * @return the parser, or NULL if out of memory
+ */
+CLIOPTS_API
+cliopts_parser *
+cliopts_parser_create(size_t max_cached);
+
+/**
+ * Like cliopts_parse_options(), using the parser's cache
+ * @param parser the parser
+ */
+CLIOPTS_API
+int
+cliopts_parser_parse(cliopts_parser *parser,
+                     cliopts_entry *entries,
+                     int argc,
+                     char **argv,
+                     int *lastidx,
+                     struct cliopts_extra_settings *settings);
+
+/**
+ * Like cliopts_parse_into(), using the parser's cache
+ * @param parser the parser
+ */
+CLIOPTS_API
+int
+cliopts_parser_parse_into(cliopts_parser *parser,
+                          const cliopts_entry *entries,
+                          void *base,
+                          int *found,
+                          int argc,
+                          char **argv,
+                          int *lastidx,
+                          struct cliopts_extra_settings *settings);
+
+/**
+ * Get the cache counters of a parser
+ * @param parser the parser
+ * @param stats populated with the counters
+ */
+CLIOPTS_API
+void
+cliopts_parser_stats(const cliopts_parser *parser,
+                     cliopts_cache_stats *stats);
+
+/**
+ * Free a parser and its cache
+ * @param parser the parser. May be NULL
+ */
+CLIOPTS_API
+void
+cliopts_parser_free(cliopts_parser *parser);
+
+/**
+ * Compute the fingerprint of the current option values: a 128 bit digest
+ * which is the same whenever the effective configuration is, whatever order
+ * the options were given in and whether or not defaults were spelled out.
+ * Entries marked nonsemantic are left out. Values still pending in lazy
+ * mode are converted first (see cliopts_entry_convert()); only invalid ones
+ * are hashed as given on the command line.
+ *
+ * This is also done by the parser when the fingerprint setting is set.
+ *
+ * @param entries the option table
+ * @param settings used for base. May be NULL
+ * @param fp populated with the fingerprint
+ * @return 0 on success, -1 if memory could not be allocated, in which case
+ * fp is zeroed
+ */
+CLIOPTS_API
+int
+cliopts_fingerprint_compute(const cliopts_entry *entries,
+                            const struct cliopts_extra_settings *settings,
+                            cliopts_fingerprint *fp);
+
+/**
+ * Write a JSON description of the option table: names, types, value
+ * descriptions, help, defaults, flags, enum choices and constraints. This
+ * is also what --help=json prints.
+ *
+ * @param entries the option table
+ * @param settings used for the program name, usage strings and
+ * constraints. May be NULL
+ * @param fp where to write the schema
+ */
+CLIOPTS_API
+void
+cliopts_dump_schema(cliopts_entry *entries,
+                    const struct cliopts_extra_settings *settings,
+                    FILE *fp);
+
+/**
+ * Embed a schema (e.g. the output of --help=json, captured at build time)
+ * in the binary as an ELF note, so that tools can read it from the file
+ * (e.g. with `readelf -n` or by looking for the .note.cliopts section)
+ * without running the program. Use it once, at file scope, with a string
+ * literal. Expands to nothing where ELF notes are not available.
+ */
+#if defined(__GNUC__) && defined(__ELF__)
+#define CLIOPTS_SCHEMA_NOTE(json) \
+    static const struct { \
+        unsigned namesz, descsz, type; \
+        char name[8]; \
+        char desc[(sizeof(json) + 3) & ~3]; \
+    } cliopts_schema_note__ \
+    __attribute__((used, section(".note.cliopts"), aligned(4))) = { \
+        8, sizeof(json), 1, "cliopts", json \
+    }
+#else
+#define CLIOPTS_SCHEMA_NOTE(json)
+#endif
+
+/**
+ * An option table loaded at runtime from a schema file. Each line of the
+ * file describes one option as a list of attributes, quoted as for
+ * cliopts_split_string():
+ *
+ *   long=threads short=t type=int default=4 value=NUM help="Worker threads"
+ *   long=mode type=enum choices=fast,slow default=fast
+ *   long=input type=string required
+ *
+ * Types are the names of the built-in types ("none", "int", "string",
+ * "int-list", "map", "enum", ...). Blank lines and lines starting with '#'
+ * are ignored.
+ */
+typedef struct cliopts_schema_st cliopts_schema;
+
+/**
+ * Load a schema file.
+ *
+ * @param path the schema file
+ * @param cachepath if non-NULL, a sidecar file holding the compiled schema.
+ * If it matches the contents of the schema file it is mapped and used
+ * directly; otherwise the schema is compiled and the cache rewritten.
+ * @param errp populated with an error message on failure
+ * @return the schema, or NULL on failure
+ */
+CLIOPTS_API
+cliopts_schema *
+cliopts_schema_load(const char *path, const char *cachepath, char **errp);
+
+/**
+ * Get the option table of a schema, for cliopts_parse_options(). Each
+ * entry's dest points to storage of the type its ktype calls for, owned by
+ * the schema.
+ */
+CLIOPTS_API
+cliopts_entry *
+cliopts_schema_entries(cliopts_schema *schema);
+
+/** Get the index of a schema's option table */
+CLIOPTS_API
+const cliopts_index *
+cliopts_schema_index(const cliopts_schema *schema);
+
+/**
+ * Find an option by its long name (or, failing that, its short name)
+ * @return the entry, or NULL if there is no such option
+ */
+CLIOPTS_API
+cliopts_entry *
+cliopts_schema_find(cliopts_schema *schema, const char *name);
+
+/** Free a schema, including the values of its options */
+CLIOPTS_API
+void
+cliopts_schema_free(cliopts_schema *schema);
+
+/**
+ * Print a list of errors. The text is built up and written at once.
+ */
+CLIOPTS_API
+void
+cliopts_errors_print(const cliopts_error_list *errs, FILE *fp);
+
+/** Free the contents of an error list, leaving it empty */
+CLIOPTS_API
+void
+cliopts_errors_clear(cliopts_error_list *errs);
+
+/**
+ * Split a command line into words, following POSIX shell quoting rules
+ * ('single quotes', "double quotes" and backslash escapes). No other shell
+ * expansion is done.
+ *
+ * @param cmdline the command line
+ * @param argcp populated with the number of words
+ * @param argvp populated with a NULL-terminated array of the words. The
+ * array and the words are allocated together, and are released with a
+ * single call to free()
+ * @param errp populated with an error message on failure
+ * @return 0 on success, -1 on failure (e.g. an unterminated quote)
+ */
+CLIOPTS_API
+int
+cliopts_split_string(const char *cmdline, int *argcp, char ***argvp,
+                     char **errp);
+
+/**
+ * Parse options from a command line stored as a single string. The string
+ * is split as by cliopts_split_string(), and the words are then handled as
+ * by cliopts_parse_options(). As with a real command line, the first word
+ * is skipped unless argv_noskip is set.
+ *
+ * @param entries the option table
+ * @param cmdline the command line
+ * @param lastidx as for cliopts_parse_options()
+ * @param settings as for cliopts_parse_options()
+ * @param argvp if non-NULL, populated with the split words, which must be
+ * released with free(). This is needed if anything refers to the words
+ * after parsing, e.g. restargs or values pending in lazy mode. If NULL,
+ * the words are released before returning.
+ * @return 0 for success, -1 on error.
+ */
+CLIOPTS_API
+int
+cliopts_parse_string(cliopts_entry *entries,
+                     const char *cmdline,
+                     int *lastidx,
+                     struct cliopts_extra_settings *settings,
+                     char ***argvp);
+
+/**
+ * Create a shared memory segment through which other processes can read
+ * the values of the options in a table (see cliopts_shm_attach()). The
+ * segment is a file, normally in a memory backed directory such as
+ * /dev/shm, and describes itself: it holds the name and type of each option
+ * along with its value as shown in the help text. Values are updated under
+ * a sequence lock, so readers never block the program.
+ *
+ * The current values are published straight away. They are published
+ * again after each successful parse if the segment is set as the shm field
+ * of cliopts_extra_settings, and whenever cliopts_shm_publish() is called.
+ *
+ * @param path the file to create. An existing file is replaced
+ * @param entries the option table, which must remain valid for as long as
+ * the segment is
+ * @param settings used for base and found. May be NULL
+ * @param errp populated with an error message on failure
+ * @return the segment, or NULL on failure (always on Windows)
+ */
+CLIOPTS_API
+cliopts_shm *
+cliopts_shm_create(const char *path, const cliopts_entry *entries,
+                   const struct cliopts_extra_settings *settings,
+                   char **errp);
+
+/**
+ * Publish the current option values, e.g. after changing them at runtime
+ * @param shm the segment
+ */
+CLIOPTS_API
+void
+cliopts_shm_publish(cliopts_shm *shm);
+
+/**
+ * Close a segment
+ * @param shm the segment. May be NULL
+ * @param destroy whether to remove the file as well
+ */
+CLIOPTS_API
+void
+cliopts_shm_close(cliopts_shm *shm, int destroy);
+
+/** A segment opened for reading. See cliopts_shm_attach() */
+typedef struct cliopts_shm_reader_st cliopts_shm_reader;
+
+/** An option as read from a segment */
+typedef struct {
+    /** Long name, or the short name if the option has no long name */
+    const char *name;
+    /** Type name, e.g. "int" */
+    const char *type;
+    /** The value as shown in the help text */
+    const char *value;
+    /** Whether the value was too long for its slot and was cut short */
+    int truncated;
+    /** How many times the option was given on the command line */
+    int found;
+} cliopts_shm_value;
+
+/** A consistent copy of the values in a segment */
+typedef struct {
+    /** Process which created the segment */
+    unsigned long pid;
+    /** Number of times values have been published */
+    unsigned long generation;
+    const cliopts_shm_value *values;
+    size_t nvalues;
+} cliopts_shm_snapshot;
+
+/**
+ * Open a segment created by cliopts_shm_create(), possibly in another
+ * process. The segment stays mapped, so that sampling it repeatedly costs
+ * a copy of the values and no system calls.
+ *
+ * @param path the segment's file
+ * @param errp populated with an error message on failure
+ * @return the reader, or NULL on failure
+ */
+CLIOPTS_API
+cliopts_shm_reader *
+cliopts_shm_attach(const char *path, char **errp);
+
+/**
+ * Take a consistent copy of the values in a segment.
+ * @param reader the reader
+ * @param snap populated with the values, which remain valid until the next
+ * call or until the reader is closed
+ * @return 0 on success, -1 if the values were being updated on every try
+ */
+CLIOPTS_API
+int
+cliopts_shm_sample(cliopts_shm_reader *reader, cliopts_shm_snapshot *snap);
+
+/**
+ * Close a reader
+ * @param reader the reader. May be NULL
+ */
+CLIOPTS_API
+void
+cliopts_shm_detach(cliopts_shm_reader *reader);
+
+#ifdef __cplusplus
+}
+
+#ifdef CLIOPTS_ENABLE_CXX
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+
+/* Newer language features are used where available */
+#if __cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L)
+#define CLIOPTS_CXX11
+#include <utility>
+#endif
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define CLIOPTS_CXX17
+#include <string_view>
+#endif
+
+namespace cliopts {
+class Parser;
+
+/**
+ * This class should typically not be used directly. It is a simple wrapper
+ * around the C-based ::cliopts_entry class for further wrapping by the
+ * cliopts::TOption template class.
+ */
+class Option : protected cliopts_entry {
+public:
+    bool passed() const { return found != 0; }
+    void setPassed(bool val = true) { found = val ? 1 : 0; }
+    int numSpecified() const { return found; }
+    Option() : convertFn(NULL) { memset(this, 0, sizeof (cliopts_entry)); }
+
+    /**
+     * Convert the value, if parsing was done in lazy mode and this has not
+     * been done yet. This is called implicitly when the result is accessed.
+     * An invalid value leaves the previous one in place.
+     * @param errp populated with the error message on failure. May be NULL
+     * @return true if the value is valid
+     */
+    bool convert(char **errp = NULL) {
+        if (pending && validator && convertFn) {
+            return convertFn(*this, errp);
+        }
+        return cliopts_entry_convert(this, errp) == 0;
+    }
+protected:
+    /**
+     * Converts a pending value held in a C++ type, which the C library
+     * cannot put back if the validator rejects it
+     */
+    bool (*convertFn)(Option&, char **);
+private:
+    friend class Parser;
+};
+
+class EmptyPriv {};
+
+/**
+ * A C++ copy of a C value, e.g. a std::vector built from a cliopts_numlist,
+ * and the generation of the C value it was built from.
+ */
+template <typename C>
+struct CachedResult {
+    CachedResult() : value(), generation(0), valid(false) {}
+    /** Whether value was built from a C value of this generation */
+    bool matches(unsigned long gen) const { return valid && generation == gen; }
+    void set(unsigned long gen) { generation = gen; valid = true; }
+    C value;
+    unsigned long generation;
+    bool valid;
+};
+
+/**
+ * The C++ counterpart of CLIOPTS_OFFSET(), taking a member pointer, e.g.
+ * cliopts::memberOffset(&Config::threads)
+ */
+template <typename C, typename M>
+inline void *memberOffset(M C::*member) {
+    // Nothing is dereferenced, so any suitably aligned address will do
+    const C *obj = reinterpret_cast<const C*>(static_cast<size_t>(4096));
+    const volatile char *field =
+            reinterpret_cast<const volatile char*>(&(obj->*member));
+    return reinterpret_cast<void*>(static_cast<size_t>(
+            field - reinterpret_cast<const volatile char*>(obj)) + 1);
+}
+
+/**
+ * Conversion traits for user-defined option types. Specialize this for
+ * your type and use cliopts::CustomOption<T>::type (or pass your own traits
+ * class as the second parameter of CustomOption). A specialization must
+ * provide:
+ *
+ * @code
+ * static int parse(const char *value, size_t nvalue, T& dest, char **errp);
+ * static void format(const T& value, char *buf, size_t nbuf);
+ * @endcode
+ *
+ * parse() converts the value directly into the option's storage, returning
+ * 0 on success. format() may leave the buffer empty if the value should not
+ * be displayed in the help text.
+ */
+template <typename T> struct ValueTraits;
+
+/**
+ * Adapts a traits class to the C cliopts_valtype interface
+ */
+template <typename T, typename Traits = ValueTraits<T> >
+struct CustomType {
+    static int extract(const char *value, size_t nvalue,
+            void *dest, void *, char **errp) {
+        return Traits::parse(value, nvalue, *static_cast<T*>(dest), errp);
+    }
+    static void format(const void *dest, void *, char *buf, size_t nbuf) {
+        if (nbuf) { *buf = '\0'; }
+        Traits::format(*static_cast<const T*>(dest), buf, nbuf);
+    }
+    static const cliopts_valtype vtype;
+};
+
+template <typename T, typename Traits>
+const cliopts_valtype CustomType<T, Traits>::vtype = {
+    "custom", CustomType<T, Traits>::extract, CustomType<T, Traits>::format
+};
+
+/** Append at most n bytes of s to a help text buffer */
+inline size_t formatAppend(char *buf, size_t nbuf, size_t pos,
+        const char *s, size_t n) {
+    if (pos >= nbuf) { return pos; }
+    if (n > nbuf - pos - 1) { n = nbuf - pos - 1; }
+    memcpy(buf + pos, s, n);
+    buf[pos + n] = '\0';
+    return pos + n;
+}
+
+/** Append n bytes of s to a canonical form. See cliopts_canonical_fn */
+inline size_t canonicalAppend(char *buf, size_t nbuf, size_t pos,
+        const void *s, size_t n) {
+    if (pos < nbuf) { memcpy(buf + pos, s, n < nbuf - pos ? n : nbuf - pos); }
+    return pos + n;
+}
+
+/** Append an integer to a canonical form, as eight bytes (LSB first) */
+inline size_t canonicalAppend(char *buf, size_t nbuf, size_t pos, size_t v) {
+    unsigned char tmp[8];
+    for (int ii = 0; ii < 8; ii++) {
+        tmp[ii] = static_cast<unsigned char>(
+                static_cast<unsigned long long>(v) >> (ii * 8));
+    }
+    return canonicalAppend(buf, nbuf, pos, tmp, sizeof tmp);
+}
+
+/**
+ * Storage for a cliopts::StringOption. The parser assigns the value straight
+ * into the string, so each value costs at most one allocation. In borrow
+ * mode (see TOption::borrow()) only a pointer into argv is kept.
+ */
+struct StringValue {
+    std::string owned; /**< The value, unless it is borrowed */
+    const char *borrowed; /**< The value in argv, in borrow mode */
+    size_t nborrowed;
+    bool borrow; /**< Whether to borrow values rather than copy them */
+
+    StringValue() : borrowed(NULL), nborrowed(0), borrow(false) {}
+    StringValue(const std::string& s)
+        : owned(s), borrowed(NULL), nborrowed(0), borrow(false) {}
+
+    const char *c_str() const { return borrowed ? borrowed : owned.c_str(); }
+    size_t size() const { return borrowed ? nborrowed : owned.size(); }
+
+    static int extract(const char *value, size_t nvalue,
+            void *dest, void *, char **errp) {
+        StringValue *sv = static_cast<StringValue*>(dest);
+        if (sv->borrow) {
+            sv->borrowed = value;
+            sv->nborrowed = nvalue;
+            return 0;
+        }
+        try {
+            sv->owned.assign(value, nvalue);
+        } catch (std::bad_alloc&) {
+            *errp = const_cast<char*>("Out of memory");
+            return -1;
+        }
+        sv->borrowed = NULL;
+        return 0;
+    }
+    static void format(const void *dest, void *, char *buf, size_t nbuf) {
+        const StringValue *sv = static_cast<const StringValue*>(dest);
+        size_t pos = formatAppend(buf, nbuf, 0, "'", 1);
+        pos = formatAppend(buf, nbuf, pos, sv->c_str(), sv->size());
+        formatAppend(buf, nbuf, pos, "'", 1);
+    }
+    /* The same as for a C string */
+    static size_t canonical(const void *dest, void *, char *buf, size_t nbuf) {
+        const StringValue *sv = static_cast<const StringValue*>(dest);
+        size_t pos = canonicalAppend(buf, nbuf, 0, "s", 1);
+        return canonicalAppend(buf, nbuf, pos, sv->c_str(), sv->size());
+    }
+    static const cliopts_valtype *valtype() {
+        static const cliopts_valtype vt = {
+            "string", extract, format, 0, canonical
+        };
+        return &vt;
+    }
+};
+
+/**
+ * Value handling for a cliopts::ListOption, which appends each value to a
+ * std::vector directly.
+ */
+struct ListValue {
+    static int extract(const char *value, size_t nvalue,
+            void *dest, void *, char **errp) {
+        std::vector<std::string> *l =
+                static_cast<std::vector<std::string>*>(dest);
+        try {
+            l->resize(l->size() + 1);
+            l->back().assign(value, nvalue);
+        } catch (std::bad_alloc&) {
+            *errp = const_cast<char*>("Out of memory");
+            return -1;
+        }
+        return 0;
+    }
+    static void format(const void *dest, void *, char *buf, size_t nbuf) {
+        const std::vector<std::string>& l =
+                *static_cast<const std::vector<std::string>*>(dest);
+        size_t pos = formatAppend(buf, nbuf, 0, "", 0);
+        for (size_t ii = 0; ii < l.size(); ii++) {
+            pos = formatAppend(buf, nbuf, pos, ii ? ", '" : "'", ii ? 3 : 1);
+            pos = formatAppend(buf, nbuf, pos, l[ii].data(), l[ii].size());
+            pos = formatAppend(buf, nbuf, pos, "'", 1);
+        }
+    }
+    /* The same as for a C list */
+    static size_t canonical(const void *dest, void *, char *buf, size_t nbuf) {
+        const std::vector<std::string>& l =
+                *static_cast<const std::vector<std::string>*>(dest);
+        size_t pos = canonicalAppend(buf, nbuf, 0, l.size());
+        for (size_t ii = 0; ii < l.size(); ii++) {
+            pos = canonicalAppend(buf, nbuf, pos, l[ii].size());
+            pos = canonicalAppend(buf, nbuf, pos, l[ii].data(), l[ii].size());
+        }
+        return pos;
+    }
+    static const cliopts_valtype *valtype() {
+        static const cliopts_valtype vt = {
+            "list", extract, format, CLIOPTS_VT_MULTI, canonical
+        };
+        return &vt;
+    }
 };
 
-class EmptyPriv {};
+/**
+ * Selects the value handling for a cliopts::TOption. Most built-in types are
+ * handled by the C library; strings and lists are stored in C++ containers,
+ * and custom types go through their traits.
+ */
+template <cliopts_argtype_t Targ, typename Tpriv>
+struct ArgTypeInfo {
+    static const cliopts_valtype *get() { return NULL; }
+};
+
+template <typename Tpriv>
+struct ArgTypeInfo<CLIOPTS_ARGT_CUSTOM, Tpriv> {
+    static const cliopts_valtype *get() { return &Tpriv::vtype; }
+};
+
+template <typename Tpriv>
+struct ArgTypeInfo<CLIOPTS_ARGT_STRING, Tpriv> {
+    static const cliopts_valtype *get() { return StringValue::valtype(); }
+};
+
+template <typename Tpriv>
+struct ArgTypeInfo<CLIOPTS_ARGT_LIST, Tpriv> {
+    static const cliopts_valtype *get() { return ListValue::valtype(); }
+};
 
 /**
  * Option template class. This class is not meant to be used by applications
@@ -221,8 +1897,9 @@ class TOption : public Option {
 
 private:
     typedef TOption<T,Targ, Taccum, Tpriv> Ttype;
-    Taccum innerVal; /**< Pointer for cliopts_entry destination */
-    Tpriv priv; /**< Type-specific data */
+    Taccum innerVal; /**< Destination of the parsed value */
+    Tpriv priv; /**< Type-specific data, e.g. a cache of the result */
+    bool ownsBounds; /**< Whether validator_arg holds limits from range() */
 public:
 
     /**
@@ -233,12 +1910,15 @@ public:
      * @param helpstr Text explaining the option
      */
     TOption(char shortname, const char *longname = NULL,
-        T deflval = createDefault(), const char *helpstr = NULL) {
+        T deflval = createDefault(), const char *helpstr = NULL)
+        : innerVal(), priv(), ownsBounds(false) {
 
         memset((cliopts_entry *)this, 0, sizeof(cliopts_entry));
         ktype = Targ;
         klong = longname;
         dest = &innerVal;
+        vtype = ArgTypeInfo<Targ, Tpriv>::get();
+        convertFn = vtype ? convertCopy : NULL;
 
         abbrev(shortname);
         description(helpstr);
@@ -249,25 +1929,48 @@ public:
      * Construct a new option
      * @param longname the long ("GNU-Style") name.
      */
-    TOption(const char *longname) {
+    TOption(const char *longname)
+        : innerVal(), priv(), ownsBounds(false) {
         memset((cliopts_entry *)this, 0, sizeof(cliopts_entry));
         ktype = Targ;
         klong = longname;
-        innerVal = createDefault();
         dest = &innerVal;
+        vtype = ArgTypeInfo<Targ, Tpriv>::get();
+        convertFn = vtype ? convertCopy : NULL;
     }
 
     /**
-     * Copy constructor. This mainly exists to allow chaining (See example)
+     * Copy constructor. This mainly exists to allow chaining (See example).
+     * The value is copied as well; the source is left untouched.
      * @param other the source option to copy
      */
-    TOption(TOption& other) {
-        *(cliopts_entry*)this = *(cliopts_entry*) &other;
-        innerVal = other.innerVal;
+    TOption(const TOption& other)
+        : Option(other), innerVal(other.innerVal), priv(other.priv),
+          ownsBounds(false) {
+        rebind(other);
+        copyRaw(other);
+    }
+
+#ifdef CLIOPTS_CXX11
+    /**
+     * Move constructor. The value is moved rather than copied, and the
+     * source is left without one.
+     * @param other the source option
+     */
+    TOption(TOption&& other)
+        : Option(other), innerVal(std::move(other.innerVal)),
+          priv(std::move(other.priv)), ownsBounds(other.ownsBounds) {
         dest = &innerVal;
-        other.dest = NULL;
-        doCopy(other);
+        if (ownsBounds) {
+            other.ownsBounds = false;
+            other.validator = NULL;
+            other.validator_arg = NULL;
+        }
+        other.disownRaw();
     }
+#endif
+
+    ~TOption() { clearRaw(); dropBounds(); }
 
     /**
      * Set the default value for the option
@@ -315,40 +2018,219 @@ public:
     inline Ttype& hide(bool val = true) { hidden = val; return *this; }
 
     /**
-     * Returns the result object
+     * Leave this option out of fingerprints, e.g. for --verbose
+     * @param val true if the option does not affect the program's behavior
+     * @return the option object, for method chaining.
+     */
+    inline Ttype& nonsemantic(bool val = true) {
+        cliopts_entry::nonsemantic = val;
+        return *this;
+    }
+
+    /**
+     * Only accept values between lo and hi (inclusive). This is checked as
+     * each value is parsed.
+     * @param lo the lowest acceptable value
+     * @param hi the highest acceptable value
+     * @return the option object, for method chaining.
+     */
+    inline Ttype& range(const Taccum& lo, const Taccum& hi) {
+        Taccum *lim = ownsBounds ?
+                static_cast<Taccum*>(validator_arg) : new Taccum[2];
+        lim[0] = lo;
+        lim[1] = hi;
+        validator = checkRange;
+        validator_arg = lim;
+        ownsBounds = true;
+        return *this;
+    }
+
+    /**
+     * Only accept values for which F returns true. This is checked as each
+     * value is parsed. Since F is a template parameter, the call is direct
+     * and can be inlined. (Before C++11, F must have external linkage.)
+     * @return the option object, for method chaining.
+     */
+    template <bool (*F)(const Taccum&)>
+    inline Ttype& validate() {
+        dropBounds();
+        validator = checkWith<F>;
+        validator_arg = NULL;
+        return *this;
+    }
+
+    /**
+     * Set a C validation function.
+     * @param fn the function
+     * @param arg passed to the function
+     * @return the option object, for method chaining.
+     */
+    inline Ttype& validate(cliopts_validate_fn fn, void *arg = NULL) {
+        dropBounds();
+        validator = fn;
+        validator_arg = arg;
+        return *this;
+    }
+
+    /**
+     * Set the valid names for an EnumOption
+     * @param list array of choices, terminated by one with a NULL name
+     * @return the option object, for method chaining.
+     */
+    inline Ttype& choices(const cliopts_choice *list) {
+        vtype_arg = const_cast<cliopts_choice*>(list);
+        return *this;
+    }
+
+    /**
+     * Make a StringOption keep a pointer into argv rather than copying its
+     * value, so that parsing it allocates nothing. argv must then remain
+     * valid for as long as the value is used.
+     * @param val whether to borrow values
+     * @return the option object, for method chaining.
+     */
+    inline Ttype& borrow(bool val = true) {
+        innerVal.borrow = val;
+        return *this;
+    }
+
+    /**
+     * Returns the result object. In lazy mode, an invalid value leaves the
+     * default in place; use Parser::validateAll() to detect this.
      * @return a copy of the result object
      */
-    inline T result() { return (T)innerVal; }
+    inline T result() { convert(); return static_cast<T>(innerVal); }
 
     /**
-     * Returns a reference to the result object
+     * Returns a reference to the result object, which is not copied. For a
+     * borrowed StringOption this copies the value once.
      * @return a reference to the result object.
      */
-    inline T& const_result() { return (T)innerVal; }
+    inline const T& const_result() { convert(); return innerVal; }
+
+    /**
+     * Returns a StringOption's value as a C string, without copying it.
+     * @return the value, valid for the lifetime of the option (or of argv,
+     * in borrow mode)
+     */
+    inline const char *c_str() { convert(); return innerVal.c_str(); }
+
+#ifdef CLIOPTS_CXX17
+    /**
+     * Returns a StringOption's value, without copying it. See c_str()
+     * @return a view of the value
+     */
+    inline std::string_view view() {
+        convert();
+        return std::string_view(innerVal.c_str(), innerVal.size());
+    }
+#endif
+
+    /**
+     * Returns the underlying C value, e.g. the cliopts_numlist for numeric
+     * list options.
+     * @return a reference to the raw value
+     */
+    inline const Taccum& raw() const { return innerVal; }
 
     operator T() { return result(); }
 
 protected:
-    /** Called from within copy constructor */
-    inline void doCopy(TOption&) {}
+    static int checkRange(const cliopts_entry *, const void *dest,
+            void *arg, char **errp) {
+        const Taccum& val = *static_cast<const Taccum*>(dest);
+        const Taccum *lim = static_cast<const Taccum*>(arg);
+        if (val < lim[0] || lim[1] < val) {
+            *errp = const_cast<char*>("Value out of range");
+            return -1;
+        }
+        return 0;
+    }
+
+    template <bool (*F)(const Taccum&)>
+    static int checkWith(const cliopts_entry *, const void *dest,
+            void *, char **) {
+        return F(*static_cast<const Taccum*>(dest)) ? 0 : -1;
+    }
+
+    /**
+     * Convert a pending value into a copy of the current one, which it only
+     * replaces once the validator has accepted it
+     */
+    static bool convertCopy(Option& opt, char **errp) {
+        Ttype& self = static_cast<Ttype&>(opt);
+        Taccum tmp(self.innerVal);
+        char *err = NULL;
+        int rv = self.vtype->extract(self.pending, strlen(self.pending), &tmp,
+                self.vtype_arg, &err);
+        if (rv == 0) {
+            rv = self.validator(&self, &tmp, self.validator_arg, &err);
+        }
+        if (rv != 0) {
+            if (errp) {
+                *errp = err ? err : const_cast<char*>("Invalid value");
+            }
+            return false;
+        }
+        self.innerVal = tmp;
+        self.pending = NULL;
+        return true;
+    }
+
+    /** Point the entry at this object's storage, after a copy */
+    inline void rebind(const TOption& other) {
+        dest = &innerVal;
+        if (other.ownsBounds) {
+            const Taccum *src = static_cast<const Taccum*>(other.validator_arg);
+            Taccum *lim = new Taccum[2];
+            lim[0] = src[0];
+            lim[1] = src[1];
+            validator_arg = lim;
+            ownsBounds = true;
+        }
+    }
+
+    /**
+     * Free the limits set by range(). They are only allocated when used, so
+     * that other options don't carry them
+     */
+    inline void dropBounds() {
+        if (ownsBounds) {
+            delete[] static_cast<Taccum*>(validator_arg);
+            validator = NULL;
+            validator_arg = NULL;
+            ownsBounds = false;
+        }
+    }
+
+    /** Deep copy of a value held in C storage, from the copy constructor */
+    inline void copyRaw(const TOption&) {}
+
+    /** Give up a value held in C storage, after it has been moved */
+    inline void disownRaw() {}
+
+    /** Free a value held in C storage */
+    inline void clearRaw() {}
 
     /** Create the default value for the option */
-    static inline Taccum createDefault() { return Taccum(); }
+    static inline T createDefault() { return T(); }
+
+private:
+    TOption& operator=(const TOption&);
 };
 
 typedef TOption<std::string,
         CLIOPTS_ARGT_STRING,
-        const char*,
-        std::string> StringOption;
+        StringValue> StringOption;
 
 typedef TOption<std::vector<std::string>,
         CLIOPTS_ARGT_LIST,
-        cliopts_list,
         std::vector<std::string> > ListOption;
 
 typedef TOption<bool,
         CLIOPTS_ARGT_NONE,
-        int> BoolOption;
+        int,
+        bool> BoolOption;
 
 typedef TOption<unsigned,
         CLIOPTS_ARGT_UINT,
@@ -364,45 +2246,372 @@ typedef TOption<int,
 
 typedef TOption<int,
         CLIOPTS_ARGT_HEX,
-        unsigned> HexOption;
+        unsigned,
+        int> HexOption;
 
 typedef TOption<float,
         CLIOPTS_ARGT_FLOAT,
         float> FloatOption;
 
+typedef TOption<long long,
+        CLIOPTS_ARGT_LONGLONG,
+        long long> LongLongOption;
+
+typedef TOption<double,
+        CLIOPTS_ARGT_DOUBLE,
+        double> DoubleOption;
+
+/** Result is in bytes */
+typedef TOption<unsigned long long,
+        CLIOPTS_ARGT_SIZE,
+        unsigned long long> SizeOption;
+
+/** Result is in nanoseconds */
+typedef TOption<unsigned long long,
+        CLIOPTS_ARGT_DURATION,
+        unsigned long long> DurationOption;
+
+typedef TOption<int,
+        CLIOPTS_ARGT_ENUM,
+        int> EnumOption;
+
+/**
+ * Option of a user-defined type. The value is converted by Traits::parse
+ * straight from the command line into the option's storage.
+ *
+ * @code
+ * static cliopts::CustomOption<Duration>::type Timeout("timeout");
+ * @endcode
+ */
+template <typename T, typename Traits = ValueTraits<T> >
+struct CustomOption {
+    typedef TOption<T, CLIOPTS_ARGT_CUSTOM, T, CustomType<T, Traits> > type;
+};
+
 // STRING ROUTINES
-template<> inline std::string& StringOption::const_result() {
-    if (innerVal && passed()) {
-        priv = innerVal;
+template<> inline const std::string& StringOption::const_result() {
+    convert();
+    if (innerVal.borrowed) {
+        innerVal.owned.assign(innerVal.borrowed, innerVal.nborrowed);
+        innerVal.borrowed = NULL;
     }
-    return priv;
+    return innerVal.owned;
 }
 template<> inline std::string StringOption::result() {
-    return const_result();
+    convert();
+    return std::string(innerVal.c_str(), innerVal.size());
 }
 template<> inline StringOption& StringOption::setDefault(const std::string& s) {
-    priv = s;
-    innerVal = priv.c_str();
+    innerVal.owned = s;
+    innerVal.borrowed = NULL;
     return *this;
 }
-template<> inline void StringOption::doCopy(StringOption& other) {
-    priv = other.priv;
-    if (other.innerVal == other.priv.c_str()) {
-        innerVal = priv.c_str();
+
+// NUMERIC LIST ROUTINES
+typedef TOption<std::vector<int>,
+        CLIOPTS_ARGT_INT_LIST,
+        cliopts_numlist,
+        CachedResult<std::vector<int> > > IntListOption;
+
+typedef TOption<std::vector<unsigned>,
+        CLIOPTS_ARGT_UINT_LIST,
+        cliopts_numlist,
+        CachedResult<std::vector<unsigned> > > UIntListOption;
+
+typedef TOption<std::vector<unsigned long long>,
+        CLIOPTS_ARGT_ULONGLONG_LIST,
+        cliopts_numlist,
+        CachedResult<std::vector<unsigned long long> > > ULongLongListOption;
+
+typedef TOption<std::vector<float>,
+        CLIOPTS_ARGT_FLOAT_LIST,
+        cliopts_numlist,
+        CachedResult<std::vector<float> > > FloatListOption;
+
+/**
+ * Copy a numeric list, including its unexpanded ranges, into a vector.
+ * Use NumListView instead to avoid expanding large ranges.
+ */
+template <typename E>
+inline void expandNumList(const cliopts_numlist& l, cliopts_argtype_t ktype,
+    std::vector<E>& out) {
+    const E *vals = static_cast<const E*>(l.values);
+    const E *rp = static_cast<const E*>(l.ranges);
+    size_t nvals = l.nranges ? l.range_pos[0] : l.nvalues;
+    out.assign(vals, vals + nvals);
+    for (size_t ii = 0; ii < l.nranges; ii++, rp += 3) {
+        size_t next = ii + 1 < l.nranges ? l.range_pos[ii + 1] : l.nvalues;
+        cliopts_numlist one;
+        memset(&one, 0, sizeof one);
+        one.ranges = const_cast<E*>(rp);
+        one.nranges = 1;
+        size_t count = cliopts_numlist_count(&one, ktype);
+        if (count == static_cast<size_t>(-1) ||
+                count > out.max_size() - out.size()) {
+            throw std::length_error("numeric list range too large");
+        }
+        out.reserve(out.size() + count + (next - nvals));
+        for (size_t jj = 0; jj < count; jj++) {
+            out.push_back(rp[0] + rp[2] * static_cast<E>(jj));
+        }
+        out.insert(out.end(), vals + nvals, vals + next);
+        nvals = next;
+    }
+}
+
+#define CLIOPTS__NUMLIST_RESULT(Tname, E) \
+    template<> inline const std::vector<E>& Tname::const_result() { \
+        if (!priv.matches(innerVal.generation)) { \
+            expandNumList(innerVal, ktype, priv.value); \
+            priv.set(innerVal.generation); \
+        } \
+        return priv.value; \
+    } \
+    template<> inline std::vector<E> Tname::result() { \
+        return const_result(); \
+    } \
+    template<> inline void Tname::copyRaw(const Tname& other) { \
+        if (cliopts_numlist_copy(&innerVal, &other.innerVal, ktype) != 0) { \
+            throw std::bad_alloc(); \
+        } \
+    } \
+    template<> inline void Tname::disownRaw() { \
+        memset(&innerVal, 0, sizeof innerVal); \
+    } \
+    template<> inline void Tname::clearRaw() { \
+        cliopts_numlist_clear(&innerVal); \
+    }
+
+CLIOPTS__NUMLIST_RESULT(IntListOption, int)
+CLIOPTS__NUMLIST_RESULT(UIntListOption, unsigned)
+CLIOPTS__NUMLIST_RESULT(ULongLongListOption, unsigned long long)
+CLIOPTS__NUMLIST_RESULT(FloatListOption, float)
+#undef CLIOPTS__NUMLIST_RESULT
+
+/**
+ * Read-only view of a numeric list, which visits its elements without
+ * expanding the ranges kept in it, e.g.
+ *
+ * @code
+ * cliopts::NumListView<int> ports(portsOption);
+ * for (cliopts::NumListView<int>::const_iterator it = ports.begin();
+ *         it != ports.end(); ++it) { ... }
+ * @endcode
+ *
+ * Elements are visited in the order given. The list must outlive the view.
+ */
+template <typename E>
+class NumListView {
+public:
+    NumListView(const cliopts_numlist& l, cliopts_argtype_t type)
+        : list(&l), ktype(type) {}
+
+    /** View the list of a numeric list option */
+    template <typename T, cliopts_argtype_t Targ, typename Tpriv>
+    NumListView(const TOption<T, Targ, cliopts_numlist, Tpriv>& opt)
+        : list(&opt.raw()), ktype(Targ) {}
+
+    /** The single values, as a contiguous array of nvalues() elements */
+    const E *values() const { return static_cast<const E*>(list->values); }
+    size_t nvalues() const { return list->nvalues; }
+
+    /** Number of unexpanded ranges */
+    size_t nranges() const { return list->nranges; }
+    /** First, last and step of an unexpanded range */
+    const E *range(size_t ii) const {
+        return static_cast<const E*>(list->ranges) + ii * 3;
+    }
+    /** Number of single values which come before an unexpanded range */
+    size_t rangePos(size_t ii) const { return list->range_pos[ii]; }
+    /** Number of elements in an unexpanded range */
+    size_t rangeSize(size_t ii) const {
+        cliopts_numlist one;
+        memset(&one, 0, sizeof one);
+        one.ranges = const_cast<E*>(range(ii));
+        one.nranges = 1;
+        return cliopts_numlist_count(&one, ktype);
+    }
+
+    /**
+     * Total number of elements, or (size_t)-1 if that does not fit in a
+     * size_t. See cliopts_numlist_count()
+     */
+    size_t size() const { return cliopts_numlist_count(list, ktype); }
+
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef E value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const E *pointer;
+        typedef E reference;
+
+        const_iterator() : view(NULL), seg(0), idx(0), segsize(0) {}
+        E operator*() const {
+            if (seg % 2 == 0) {
+                return view->values()[view->runStart(seg / 2) + idx];
+            }
+            const E *rp = view->range(seg / 2);
+            return rp[0] + rp[2] * static_cast<E>(idx);
+        }
+        const_iterator& operator++() { idx++; settle(); return *this; }
+        const_iterator operator++(int) {
+            const_iterator prev(*this);
+            ++*this;
+            return prev;
+        }
+        bool operator==(const const_iterator& other) const {
+            return seg == other.seg && idx == other.idx;
+        }
+        bool operator!=(const const_iterator& other) const {
+            return !(*this == other);
+        }
+    private:
+        friend class NumListView;
+        // Even segments are runs of single values, and odd ones the
+        // ranges between them
+        const_iterator(const NumListView *v, size_t first)
+            : view(v), seg(first), idx(0), segsize(v->segmentSize(first)) {
+            settle();
+        }
+        // Move past the ends of segments
+        void settle() {
+            while (idx >= segsize && seg < view->nranges() * 2 + 1) {
+                seg++;
+                idx = 0;
+                segsize = view->segmentSize(seg);
+            }
+        }
+        const NumListView *view;
+        size_t seg;
+        size_t idx;
+        size_t segsize;
+    };
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const {
+        return const_iterator(this, list->nranges * 2 + 1);
+    }
+
+private:
+    // Bounds of the n'th run of single values
+    size_t runStart(size_t n) const { return n ? list->range_pos[n - 1] : 0; }
+    size_t runEnd(size_t n) const {
+        return n < list->nranges ? list->range_pos[n] : list->nvalues;
+    }
+    size_t segmentSize(size_t seg) const {
+        if (seg > list->nranges * 2) { return 0; }
+        if (seg % 2) { return rangeSize(seg / 2); }
+        return runEnd(seg / 2) - runStart(seg / 2);
+    }
+
+    const cliopts_numlist *list;
+    cliopts_argtype_t ktype;
+};
+
+// SET AND MAP ROUTINES
+typedef TOption<std::set<std::string>,
+        CLIOPTS_ARGT_SET,
+        cliopts_map,
+        CachedResult<std::set<std::string> > > SetOption;
+
+typedef TOption<std::map<std::string, std::string>,
+        CLIOPTS_ARGT_MAP,
+        cliopts_map,
+        CachedResult<std::map<std::string, std::string> > > MapOption;
+
+#define CLIOPTS__MAP_STORAGE(Tname) \
+    template<> inline void Tname::copyRaw(const Tname& other) { \
+        if (cliopts_map_copy(&innerVal, &other.innerVal) != 0) { \
+            throw std::bad_alloc(); \
+        } \
+    } \
+    template<> inline void Tname::disownRaw() { \
+        memset(&innerVal, 0, sizeof innerVal); \
+    } \
+    template<> inline void Tname::clearRaw() { \
+        cliopts_map_clear(&innerVal); \
+    }
+
+CLIOPTS__MAP_STORAGE(SetOption)
+CLIOPTS__MAP_STORAGE(MapOption)
+#undef CLIOPTS__MAP_STORAGE
+
+/**
+ * Result is a cliopts_blob. A file given as @path is mapped for as long as
+ * the option exists. Use cliopts_blob_next_line() to read it a line at a
+ * time.
+ */
+typedef TOption<cliopts_blob,
+        CLIOPTS_ARGT_BLOB,
+        cliopts_blob> BlobOption;
+
+template<> inline void BlobOption::copyRaw(const BlobOption& other) {
+    if (cliopts_blob_copy(&innerVal, &other.innerVal) != 0) {
+        throw std::bad_alloc();
+    }
+}
+template<> inline void BlobOption::disownRaw() {
+    memset(&innerVal, 0, sizeof innerVal);
+}
+template<> inline void BlobOption::clearRaw() {
+    cliopts_blob_clear(&innerVal);
+}
+
+/**
+ * Result is a cliopts_strpool, which is read with cliopts_strpool_next().
+ * Unlike ListOption, the values are not copied into std::strings.
+ */
+typedef TOption<cliopts_strpool,
+        CLIOPTS_ARGT_STRPOOL,
+        cliopts_strpool> StringPoolOption;
+
+template<> inline void StringPoolOption::copyRaw(
+        const StringPoolOption& other) {
+    if (cliopts_strpool_copy(&innerVal, &other.innerVal) != 0) {
+        throw std::bad_alloc();
+    }
+}
+template<> inline void StringPoolOption::disownRaw() {
+    memset(&innerVal, 0, sizeof innerVal);
+}
+template<> inline void StringPoolOption::clearRaw() {
+    cliopts_strpool_clear(&innerVal);
+}
+
+// Lookups of single keys don't need to build a container; use
+// cliopts_map_get(&option.raw(), key) instead.
+template<> inline const std::set<std::string>& SetOption::const_result() {
+    if (!priv.matches(innerVal.generation)) {
+        priv.value.clear();
+        for (size_t ii = 0; ii < innerVal.nslots; ii++) {
+            if (innerVal.slots[ii].key) {
+                priv.value.insert(innerVal.slots[ii].key);
+            }
+        }
+        priv.set(innerVal.generation);
     }
+    return priv.value;
+}
+template<> inline std::set<std::string> SetOption::result() {
+    return const_result();
 }
-template<> inline const char* StringOption::createDefault() { return ""; }
 
-// LIST ROUTINES
-template<> inline std::vector<std::string>& ListOption::const_result() {
-    if (priv.empty()) {
-        for (size_t ii = 0; ii < innerVal.nvalues; ii++) {
-            priv.push_back(innerVal.values[ii]);
+template<> inline const std::map<std::string, std::string>&
+MapOption::const_result() {
+    if (!priv.matches(innerVal.generation)) {
+        priv.value.clear();
+        for (size_t ii = 0; ii < innerVal.nslots; ii++) {
+            const cliopts_map_slot& slot = innerVal.slots[ii];
+            if (slot.key) {
+                priv.value[slot.key] = slot.value;
+            }
         }
+        priv.set(innerVal.generation);
     }
-    return priv;
+    return priv.value;
 }
-template<> inline std::vector<std::string> ListOption::result() {
+template<> inline std::map<std::string, std::string> MapOption::result() {
     return const_result();
 }
 
@@ -413,6 +2622,86 @@ template<> inline BoolOption& BoolOption::setDefault(const bool& b) {
 template<> inline bool BoolOption::result() {
     return innerVal != 0 ? true : false;
 }
+template<> inline const bool& BoolOption::const_result() {
+    priv = result();
+    return priv;
+}
+
+// HEX ROUTINES
+template<> inline const int& HexOption::const_result() {
+    priv = result();
+    return priv;
+}
+
+/**
+ * Which options can be read as a T through a Handle, and how. Specialized
+ * for the result types of the built-in options; strings of C tables (added
+ * with Parser::addTable()) are read as const char *.
+ */
+template <typename T> struct HandleTraits;
+
+#define CLIOPTS__HANDLE_TRAITS(T, Taccum, cond) \
+template <> struct HandleTraits<T> { \
+    static bool accepts(const cliopts_entry& e) { return (cond); } \
+    static T load(const void *dest) { \
+        return static_cast<T>(*static_cast<const Taccum*>(dest)); \
+    } \
+};
+
+CLIOPTS__HANDLE_TRAITS(int, int,
+        !e.vtype && (e.ktype == CLIOPTS_ARGT_INT ||
+                     e.ktype == CLIOPTS_ARGT_ENUM))
+CLIOPTS__HANDLE_TRAITS(unsigned, unsigned,
+        !e.vtype && (e.ktype == CLIOPTS_ARGT_UINT ||
+                     e.ktype == CLIOPTS_ARGT_HEX))
+CLIOPTS__HANDLE_TRAITS(unsigned long long, unsigned long long,
+        !e.vtype && (e.ktype == CLIOPTS_ARGT_ULONGLONG ||
+                     e.ktype == CLIOPTS_ARGT_SIZE ||
+                     e.ktype == CLIOPTS_ARGT_DURATION))
+CLIOPTS__HANDLE_TRAITS(long long, long long,
+        !e.vtype && e.ktype == CLIOPTS_ARGT_LONGLONG)
+CLIOPTS__HANDLE_TRAITS(float, float,
+        !e.vtype && e.ktype == CLIOPTS_ARGT_FLOAT)
+CLIOPTS__HANDLE_TRAITS(double, double,
+        !e.vtype && e.ktype == CLIOPTS_ARGT_DOUBLE)
+CLIOPTS__HANDLE_TRAITS(bool, int,
+        !e.vtype && e.ktype == CLIOPTS_ARGT_NONE)
+#undef CLIOPTS__HANDLE_TRAITS
+
+template <> struct HandleTraits<const char *> {
+    static bool accepts(const cliopts_entry& e) {
+        return !e.vtype && e.ktype == CLIOPTS_ARGT_STRING;
+    }
+    static const char *load(const void *dest) {
+        return *static_cast<char * const *>(dest);
+    }
+};
+
+template <> struct HandleTraits<std::string> {
+    static bool accepts(const cliopts_entry& e) {
+        return e.vtype == StringValue::valtype();
+    }
+    static std::string load(const void *dest) {
+        const StringValue *sv = static_cast<const StringValue*>(dest);
+        return std::string(sv->c_str(), sv->size());
+    }
+};
+
+/**
+ * Typed reference to the value of an option, from Parser::lookup()
+ */
+template <typename T>
+class Handle {
+public:
+    Handle() : dest(NULL) {}
+    /** Whether the option was found, with a suitable type */
+    bool valid() const { return dest != NULL; }
+    /** The current value of the option */
+    T operator*() const { return HandleTraits<T>::load(dest); }
+private:
+    friend class Parser;
+    const void *dest;
+};
 
 /**
  * Parser class which contains one or more cliopts::Option objects. Options
@@ -425,8 +2714,9 @@ public:
      * @param name the "program name" which is printed at the top of the
      * help message.
      */
-    Parser(const char *name = NULL) {
+    Parser(const char *name = NULL) : chain(NULL), index(NULL) {
         memset(&default_settings, 0, sizeof default_settings);
+        memset(&fingerprint, 0, sizeof fingerprint);
         default_settings.progname = name;
     }
 
@@ -440,6 +2730,62 @@ public:
 
     void addOption(Option& opt) { options.push_back(&opt); }
 
+    /**
+     * Adds a positional argument, which is converted like an option of the
+     * same type, with the option's long name as its name. Arguments are
+     * filled in the order they were added; use mandatory() for those which
+     * must be given. A list option added last takes all the remaining
+     * arguments. See cliopts_extra_settings::positionals
+     * @param opt the argument. As with addOption(), it must remain valid.
+     */
+    void addArgument(Option& opt) { arguments.push_back(&opt); }
+
+    /**
+     * Pass each value of the last positional argument to a function as it
+     * is converted, rather than collecting them.
+     * See cliopts_extra_settings::positional_cb
+     */
+    void setArgumentCallback(cliopts_positional_fn fn, void *arg = NULL) {
+        default_settings.positional_cb = fn;
+        default_settings.positional_arg = arg;
+    }
+
+    /**
+     * Start a new section of the help text. Options added after this are
+     * listed under the title.
+     * @param title the heading, e.g. "Logging"
+     */
+    void addGroup(const char *title) {
+        Section sec = { NULL, title, options.size() };
+        sections.push_back(sec);
+    }
+
+    /**
+     * Parse a C option table (e.g. one contributed by a library) along with
+     * the options of this parser. The table is used in place, and has its
+     * own section in the help text. See cliopts_chain_create()
+     * @param entries the table, which must remain valid during #parse()
+     * @param title the heading for its options. May be NULL
+     */
+    void addTable(cliopts_entry *entries, const char *title = NULL) {
+        Section sec = { entries, title, options.size() };
+        sections.push_back(sec);
+    }
+
+    /**
+     * Adds a constraint between options, which is checked in #parse().
+     * @param type the kind of constraint
+     * @param option the option the constraint applies to, for
+     * CLIOPTS_CONSTRAINT_REQUIRES and CLIOPTS_CONSTRAINT_CONFLICTS
+     * @param members NULL-terminated list of the other options. This must
+     * remain valid for the lifetime of the parser.
+     */
+    void addConstraint(cliopts_constraint_type type, const char *option,
+            const char * const *members) {
+        cliopts_constraint c = { type, option, members };
+        constraints.push_back(c);
+    }
+
     /**
      * Parses the options from the commandline
      * @param argc number of arguments
@@ -451,16 +2797,57 @@ public:
      */
     bool parse(int argc, char **argv, const char *standalone_args = NULL,
             int min_standalone_args = 0) {
-        std::vector<cliopts_entry> ents;
+        std::vector<cliopts_table> tables;
+        std::vector<size_t> where(options.size());
         cliopts_extra_settings settings = default_settings;
         int lastix;
 
-        for (unsigned ii = 0; ii < options.size(); ++ii) {
-            ents.push_back(*options[ii]);
+        // Each group of options is terminated, so that it can be a table of
+        // its own. Reserving keeps the tables' pointers valid. The copies
+        // are kept for lookup() until the next parse.
+        releaseTable();
+        ents.reserve(options.size() + sections.size() + 1);
+        owners.reserve(ents.capacity());
+        const char *title = NULL;
+        size_t next = 0;
+        for (size_t ss = 0; ss <= sections.size(); ss++) {
+            size_t end = ss < sections.size() ?
+                    sections[ss].first : options.size();
+            if (next < end) {
+                cliopts_table table = { NULL, title };
+                size_t first = ents.size();
+                for (; next < end; next++) {
+                    where[next] = ents.size();
+                    ents.push_back(*options[next]);
+                    owners.push_back(options[next]);
+                }
+                ents.push_back(Option());
+                owners.push_back(NULL);
+                table.entries = &ents[first];
+                tables.push_back(table);
+            }
+            if (ss == sections.size()) { break; }
+            title = sections[ss].title;
+            if (sections[ss].table) {
+                cliopts_table table = { sections[ss].table, title };
+                tables.push_back(table);
+                title = NULL;
+            }
+        }
+
+        if (tables.empty()) { return false; }
+        if (!sections.empty()) {
+            chain = cliopts_chain_create(&tables[0], tables.size(), NULL);
+            if (!chain) { return false; }
+        }
+        std::vector<cliopts_entry> args(arguments.size() + 1, Option());
+        for (size_t ii = 0; ii < arguments.size(); ii++) {
+            args[ii] = *arguments[ii];
+        }
+        if (!arguments.empty()) {
+            settings.positionals = &args[0];
         }
 
-        if (ents.empty()) { return false; }
-        ents.push_back(Option());
         const char **tmpargs = NULL;
         if (standalone_args) {
             tmpargs = new const char*[argc];
@@ -471,7 +2858,26 @@ public:
         }
         settings.show_defaults = 1;
 
-        int rv = cliopts_parse_options(&ents[0], argc, argv, &lastix, &settings);
+        cliopts_constraint_set *cs = NULL;
+        if (!constraints.empty()) {
+            char *err = NULL;
+            std::vector<cliopts_constraint> tmpcons(constraints);
+            tmpcons.push_back(cliopts_constraint());
+            const cliopts_index *cidx = getIndex();
+            cs = cidx ?
+                    cliopts_constraints_compile(cidx, &tmpcons[0], &err) : NULL;
+            if (!cs) {
+                fprintf(stderr, "Bad constraint: %s\n", err ? err : "");
+                delete[] tmpargs;
+                return false;
+            }
+            settings.constraints = cs;
+        }
+
+        int rv = chain ?
+                cliopts_chain_parse(chain, argc, argv, &lastix, &settings) :
+                cliopts_parse_options(&ents[0], argc, argv, &lastix, &settings);
+        cliopts_constraints_free(cs);
 
         if (tmpargs != NULL) {
             for (unsigned ii = 0; ii < settings.nrestargs; ii++) {
@@ -482,7 +2888,10 @@ public:
 
         // Copy the options back
         for (unsigned ii = 0; ii < options.size(); ii++) {
-            *(cliopts_entry *)options[ii] = ents[ii];
+            *(cliopts_entry *)options[ii] = ents[where[ii]];
+        }
+        for (unsigned ii = 0; ii < arguments.size(); ii++) {
+            *(cliopts_entry *)arguments[ii] = args[ii];
         }
 
         if (rv == 0 && lastix != 0) {
@@ -494,17 +2903,150 @@ public:
         return rv == 0;
     }
 
+    /**
+     * Defer conversion of option values until they are first accessed.
+     * argv must remain valid for as long as results are read.
+     * See cliopts_extra_settings::lazy
+     * @param val whether to parse lazily
+     */
+    void setLazy(bool val = true) { default_settings.lazy = val; }
+
+    /**
+     * Compute a fingerprint of the option values in #parse().
+     * See cliopts_fingerprint_compute()
+     * @param val whether to compute the fingerprint
+     */
+    void setFingerprint(bool val = true) {
+        default_settings.fingerprint = val ? &fingerprint : NULL;
+    }
+
+    /**
+     * Get the fingerprint computed by the last successful #parse(). This is
+     * all zeroes unless setFingerprint() was called.
+     */
+    const cliopts_fingerprint& getFingerprint() const { return fingerprint; }
+
+    /**
+     * Convert all values which have not yet been converted, printing a
+     * message for each invalid one. This is only needed in lazy mode.
+     * @return true if all values are valid
+     */
+    bool validateAll() {
+        bool ok = true;
+        for (unsigned ii = 0; ii < options.size(); ii++) {
+            Option *opt = options[ii];
+            const char *value = opt->pending;
+            char *err = NULL;
+            if (opt->convert(&err)) {
+                continue;
+            }
+            ok = false;
+            if (!default_settings.error_nohelp) {
+                if (opt->klong) {
+                    fprintf(stderr, "Bad value '%s' for --%s: %s\n", value,
+                            opt->klong, err);
+                } else {
+                    fprintf(stderr, "Bad value '%s' for -%c: %s\n", value,
+                            opt->kshort, err);
+                }
+            }
+        }
+        return ok;
+    }
+
     /**
      * Get the list of any positional arguments found on the commandline
      * @return A list of positional arguments found.
      */
     const std::vector<std::string>& getRestArgs() { return restargs; }
 
+    /**
+     * Look up an option by name after #parse(), without a reference to its
+     * object, e.g. from a plugin. The name and type are checked once, here;
+     * reading the value through the handle is then a plain load. The handle
+     * remains valid as long as the option object does.
+     * @param name the long name, or a one-character short name
+     * @return the handle, which is not valid() if there is no such option or
+     * it is not of a type which gives a T (see HandleTraits)
+     */
+    template <typename T>
+    Handle<T> lookup(const char *name) {
+        Handle<T> handle;
+        const cliopts_index *idx = getIndex();
+        cliopts_entry *entry = idx ? cliopts_index_find(idx, name) : NULL;
+        if (!entry || !HandleTraits<T>::accepts(*entry)) {
+            return handle;
+        }
+        // Options are converted through their own object, so that the
+        // value is only converted (and validated) once
+        Option *owner = NULL;
+        if (!ents.empty() && entry >= &ents[0] &&
+                entry < &ents[0] + ents.size()) {
+            owner = owners[entry - &ents[0]];
+        }
+        if (owner) {
+            bool ok = owner->convert();
+            entry->pending = owner->pending;
+            if (!ok) { return handle; }
+        } else if (cliopts_entry_convert(entry, NULL) != 0) {
+            return handle;
+        }
+        handle.dest = entry->dest;
+        return handle;
+    }
+
+    /**
+     * Get the value of an option by name, e.g. get<int>("threads").
+     * See #lookup(); resolve a handle instead for repeated use.
+     * @param def the value returned if there is no such option of this type
+     */
+    template <typename T>
+    T get(const char *name, const T& def = T()) {
+        Handle<T> handle = lookup<T>(name);
+        return handle.valid() ? *handle : def;
+    }
+
+    ~Parser() { releaseTable(); }
+
     cliopts_extra_settings default_settings;
 private:
     std::vector<Option*> options;
+    std::vector<Option*> arguments;
+    std::vector<cliopts_constraint> constraints;
     std::vector<std::string> restargs;
+    cliopts_fingerprint fingerprint;
+
+    // A group of options or a C table, starting at options[first]
+    struct Section {
+        cliopts_entry *table;
+        const char *title;
+        size_t first;
+    };
+    std::vector<Section> sections;
+
+    // The options as a C table, from the last parse, and the Option each
+    // entry was copied from
+    std::vector<cliopts_entry> ents;
+    std::vector<Option*> owners;
+    cliopts_chain *chain;
+    cliopts_index *index;
+
+    const cliopts_index *getIndex() {
+        if (chain) { return cliopts_chain_index(chain); }
+        if (!index && !ents.empty()) { index = cliopts_index_create(&ents[0]); }
+        return index;
+    }
+    void releaseTable() {
+        cliopts_chain_free(chain);
+        cliopts_index_free(index);
+        chain = NULL;
+        index = NULL;
+        ents.clear();
+        owners.clear();
+    }
+    // Not copyable: the chain and index are owned
     Parser(Parser&);
+    Parser& operator=(const Parser&);
 };
 } // namespace
 #endif /* CLIOPTS_ENABLE_CXX */